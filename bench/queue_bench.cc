@@ -0,0 +1,107 @@
+// Replay an event queue trace (recorded with pilo --queue-trace) through each queue engine and
+// report how long each takes. Every engine must dequeue events in exactly the same order, which is
+// checked along the way.
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <boost/functional/hash.hpp>
+#include <boost/program_options.hpp>
+#include "event_queue.h"
+
+namespace po = boost::program_options;
+
+namespace {
+struct Op {
+    bool push;
+    PILO::Time time;
+};
+
+struct Result {
+    double seconds;
+    size_t peak;
+    size_t ignored;
+    size_t checksum;
+};
+
+Result replay(PILO::EventQueue::Type type, const std::vector<Op>& ops) {
+    auto queue = PILO::EventQueue::make(type);
+    Result result{0.0, 0, 0, 0};
+    uint64_t seq = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (auto& op : ops) {
+        if (op.push) {
+            queue->push(PILO::Event{op.time, seq++, PILO::Task()});
+            if (queue->size() > result.peak) {
+                result.peak = queue->size();
+            }
+        } else if (!queue->empty()) {
+            boost::hash_combine(result.checksum, queue->pop().seq);
+        } else {
+            // Events scheduled before the trace started recording.
+            result.ignored++;
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    result.seconds = std::chrono::duration<double>(end - start).count();
+    return result;
+}
+}
+
+int main(int argc, char* argv[]) {
+    std::string trace;
+    int repetitions;
+    po::options_description args("Event queue benchmark");
+    args.add_options()("help,h", "Display help")("trace,t", po::value<std::string>(&trace), "Recorded queue trace")(
+        "repetitions,n", po::value<int>(&repetitions)->default_value(5), "Replays per engine");
+    po::positional_options_description positional;
+    positional.add("trace", 1);
+    po::variables_map vmap;
+    po::store(po::command_line_parser(argc, argv).options(args).positional(positional).run(), vmap);
+    po::notify(vmap);
+    if (vmap.count("help") || !vmap.count("trace")) {
+        std::cerr << args << std::endl;
+        return 0;
+    }
+
+    std::ifstream in(trace);
+    if (!in) {
+        std::cerr << "Could not open " << trace << std::endl;
+        return 1;
+    }
+    std::vector<Op> ops;
+    std::string op;
+    size_t pushes = 0;
+    while (in >> op) {
+        if (op == "s") {
+            PILO::Time time;
+            in >> time;
+            ops.push_back(Op{true, time});
+            pushes++;
+        } else if (op == "p") {
+            ops.push_back(Op{false, 0.0});
+        }
+    }
+    std::cout << "Trace " << trace << " ops " << ops.size() << " enqueues " << pushes << std::endl;
+
+    size_t checksum = 0;
+    for (int i = PILO::EventQueue::FIBONACCI; i <= PILO::EventQueue::CALENDAR; i++) {
+        auto type = (PILO::EventQueue::Type)i;
+        double best = std::numeric_limits<double>::max();
+        Result result;
+        for (int rep = 0; rep < repetitions; rep++) {
+            result = replay(type, ops);
+            best = std::min(best, result.seconds);
+        }
+        if (i == PILO::EventQueue::FIBONACCI) {
+            checksum = result.checksum;
+        }
+        std::cout << std::setw(10) << PILO::EventQueue::IType[type] << " best " << std::fixed << std::setprecision(6)
+                  << best << "s " << std::setprecision(2) << (ops.size() / best / 1e6) << " Mops/s peak "
+                  << result.peak << " unmatched " << result.ignored
+                  << (result.checksum == checksum ? "" : " ORDER MISMATCH") << std::endl;
+    }
+    return 0;
+}
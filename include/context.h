@@ -1,18 +1,34 @@
-#include <boost/heap/fibonacci_heap.hpp>
-#include <tuple>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include "event_queue.h"
 
 #ifndef __CONTEXT_H__
 #define __CONTEXT_H__
 
 namespace PILO {
-typedef std::function<void(int)> Task;
-typedef double Time;
 typedef double BPS;
 
+// Something events can be attributed to, i.e., a node. When running partitioned, events scheduled for
+// the same time are ordered by (source id, count), which does not depend on how nodes are spread
+// across partitions or on thread timing.
+struct EventSource {
+    uint32_t id;
+    uint64_t count;  // Events attributed to this source so far.
+};
+
 // Simulation context. Responsible for maintaining time and scheduling events.
 class Context {
    public:
-    Context(Time endTime);
+    Context(Time endTime, EventQueue::Type queue = EventQueue::FIBONACCI);
 
     // Run the next event. Return false if no more events need to be run.
     bool next();
@@ -23,33 +39,197 @@ class Context {
     // Also get current time, I kept screwing up.
     inline Time now() const { return _time; }
 
+    // Time after which the simulation stops.
+    inline Time end() const { return _end; }
+
     // Set the current time.
     void set_time(Time time);
 
     // Schedule an event to happen delta time after now.
-    void schedule(Time delta, std::function<void(Time)> task);
+    void schedule(Time delta, Task task);
 
     // Schedule an event to happen at specified time.
-    void scheduleAbsolute(Time time, std::function<void(Time)> task);
+    void scheduleAbsolute(Time time, Task task);
+
+    // Same as above, attributing the event to source.
+    void schedule(Time delta, EventSource& source, Task task);
+
+    void scheduleAbsolute(Time time, EventSource& source, Task task);
+
+    // Schedule an event attributed to source on target, which may be run by another thread. The event
+    // only shows up in target's queue once target calls drain().
+    void send(Context& target, Time time, EventSource& source, Task task);
+
+    // Order same time events by source rather than by scheduling order. Set when running partitioned.
+    void attribute_events() { _attributed = true; }
+
+    // Time of the next event, infinity if there is none.
+    Time next_time() const;
+
+    // Run all events before limit (exclusive), without printing progress. Used when running
+    // partitioned, where the caller guarantees that no earlier event can show up meanwhile.
+    void run_until(Time limit);
+
+    // Move events sent by other contexts into the queue. When speculating this may roll back.
+    void drain();
+
+    // Optimistic (Time Warp) execution, see TimeWarpEngine. Executed events are kept, with what they
+    // sent, until fossil collected. An event arriving with an earlier (time, seq) than one already
+    // executed (a straggler), or the cancellation of an executed event, rolls the context back: state
+    // is restored from the last checkpoint before that point, events up to it are re-executed with
+    // their effects suppressed (coasting forward), and what later events sent is cancelled. Events are
+    // cancelled by sending an event with the same (time, seq) and no task.
+
+    // Something to checkpoint: saves a copy of some state and returns a function restoring it.
+    typedef std::function<std::function<void()>()> StateSaver;
+
+    // Checkpoint state belonging to the node with source id owner. Checkpoints only save it again
+    // once owner has been touched, saving is incremental at node granularity.
+    void track_state(uint32_t owner, StateSaver saver);
+
+    // Note that the node with source id owner is about to change. Executing an event touches its source,
+    // other changes (e.g., delivering a packet) must be reported.
+    inline void touch(uint32_t owner) {
+        if (owner >= _touched.size()) {
+            _touched.resize(owner + 1, true);
+        }
+        _touched[owner] = true;
+    }
+
+    // Start speculating. Output this context's events write to output can be retracted until it is
+    // fossil collected. busy counts messages sent but not yet received, along with whatever the engine
+    // adds. Checkpoints are taken every checkpointInterval events.
+    void speculate(std::string* output, std::atomic<int64_t>* busy, size_t checkpointInterval);
+
+    // Execute the next event speculatively.
+    void step();
+
+    // Forget history and checkpoint, e.g., after global events changed state. Nothing can be rolled
+    // back past this point.
+    void commit();
+
+    // Forget history that can no longer be rolled back because no event before gvt is pending anywhere,
+    // and write output that became final to out.
+    void fossil_collect(Time gvt, std::streambuf* out);
+
+    // Time of the earliest event (or cancellation) waiting in the inbox, infinity if there is none.
+    Time inbox_time();
+
+    bool inbox_empty();
+
+    // Block until a message arrives or wake() returns true. Whatever changes wake() must call notify().
+    void wait_for_messages(const std::function<bool()>& wake);
+
+    void notify();
+
+    struct SpeculationStats {
+        uint64_t executed;
+        uint64_t rollbacks;
+        uint64_t rolledBack;
+        uint64_t coasted;
+        uint64_t cancelled;  // Cancellations sent.
+        uint64_t checkpoints;
+    };
+
+    const SpeculationStats& speculation_stats() const { return _stats; }
 
     void reset();
 
+    // Record every enqueue ("s <time>") and dequeue ("p") to trace, for replaying through the queue
+    // benchmark. Pass NULL to stop recording.
+    void record_trace(std::ostream* trace);
+
+    // Print the number of events scheduled so far, and the heap allocations they caused (closures
+    // too large to store inline and event queue growth). Both should stay flat in steady state.
+    void dump_event_stats() const;
+
+    // Number of events scheduled so far.
+    uint64_t scheduled() const { return _scheduled; }
+
    private:
-    // Comparator that ignores the task, so we can use fibonacci heap.
-    struct TaskCompare {
-        inline bool operator()(const std::tuple<Time, Task>& t1, const std::tuple<Time, Task>& t2) const {
-            Time time1, time2;
-            std::tie(time1, std::ignore) = t1;
-            std::tie(time2, std::ignore) = t2;
-            return time1 > time2;
-        }
+    void enqueue(Time time, EventSource* source, Task&& task);
+
+    // Put an event on target's inbox.
+    void post(Context& target, Event&& event);
+
+    // An executed event, the output it started at (absolute, see _outputBase) and the events it sent.
+    struct Processed {
+        Event event;
+        size_t output;
+        std::vector<std::pair<Context*, std::pair<Time, uint64_t>>> sent;
+    };
+
+    struct Checkpoint {
+        uint64_t position;  // Index (absolute, see _historyBase) of the first event executed after it.
+        Time time;
+        std::vector<std::function<void()>> restore;
     };
 
-    // Fibonacci heap since it is fast
-    typedef boost::heap::fibonacci_heap<std::tuple<Time, Task>, boost::heap::compare<TaskCompare>> Queue;
+    void checkpoint();
+
+    // Undo every event executed from position on.
+    void rollback(uint64_t position);
+
+    // Cancel the event (time, seq), which is either pending or executed.
+    void cancel(Time time, uint64_t seq);
+
+    // Remove pending events, along with those in _cancelled.
+    void remove_pending(std::vector<std::pair<Time, uint64_t>>& events);
+
+    // Pop cancelled events off the front of the queue, so the next event is one that runs.
+    void drop_cancelled();
+
+    inline size_t output_position() const { return _outputBase + _output->size(); }
+
+    inline bool touched(uint32_t owner) const { return owner >= _touched.size() || _touched[owner]; }
+
+    // Forget saved copies, e.g., because state was restored or changed behind our back.
+    void touch_all();
+
+    struct Tracked {
+        uint32_t owner;
+        StateSaver save;
+        std::function<void()> restore;  // Restores the last saved copy.
+    };
+
+    // Bits of the sequence number used for EventSource::count.
+    static const int SOURCE_SHIFT = 40;
 
     // Queue of events
-    Queue _queue;
+    std::unique_ptr<EventQueue> _queue;
+
+    // Tie breaker, so that events scheduled for the same time run in order.
+    uint64_t _seq;
+
+    // Number of events scheduled.
+    uint64_t _scheduled;
+
+    // Whether to derive tie breakers from event sources.
+    bool _attributed;
+
+    // Events sent from other contexts, guarded by _inboxLock.
+    std::vector<Event> _inbox;
+    std::vector<Event> _incoming;  // Swapped with _inbox when draining.
+    std::mutex _inboxLock;
+    std::condition_variable _inboxSignal;
+
+    // Speculation state.
+    bool _speculative;
+    bool _coasting;
+    std::atomic<int64_t>* _busy;
+    std::string* _output;
+    size_t _outputBase;  // Output written out so far.
+    size_t _checkpointInterval;
+    std::vector<Tracked> _tracked;
+    std::vector<bool> _touched;
+    std::deque<Processed> _history;
+    uint64_t _historyBase;  // Events executed and fossil collected before _history.
+    std::deque<Checkpoint> _checkpoints;
+    Processed* _current;  // Event being executed, NULL when coasting or outside events.
+    std::vector<Event> _scratch;
+    // Pending events that were cancelled, dropped when they come up rather than searched for in the queue.
+    std::set<std::pair<Time, uint64_t>> _cancelled;
+    SpeculationStats _stats;
 
     // Current time.
     Time _time;
@@ -58,6 +238,8 @@ class Context {
     Time _end;
 
     uint64_t _lastMajor;
+
+    std::ostream* _trace;
 };
 }
 #endif
@@ -1,58 +1,119 @@
 #include "node.h"
 #include "link.h"
+#include "graph.h"
 #include "packet.h"
+#include "rule_table.h"
+#include "shared_cache.h"
+#include "thread_pool.h"
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 #include <forward_list>
+#include <limits>
+#include <map>
 #include <memory>
-#include <boost/algorithm/string.hpp>
 #include <boost/functional/hash.hpp>
-#include <igraph/igraph.h>  // Graph processing (for the masses).
 #ifndef __CONTROLLER_H__
 #define __CONTROLLER_H__
 
 namespace PILO {
 class Switch;
 
-// A class to keep logs. Currently this is very inefficient in terms of memory, however
-// the memory inefficiency is lower than my laziness.
+// Link event logs, gossiped between controllers. Each link's log keeps a bit per version in 64-bit words,
+// for whether the version is known and the link's state in it, so gaps and entries are found a word at a
+// time.
+//
+// The log is also summarized by a hash tree: node (0, link) is the XOR of digests of link's entries, and
+// each node above the XOR of the (up to) DIGEST_FANOUT nodes below it, up to a single root. Adding an entry
+// updates one node per level. Controllers compare trees top down to find the links their logs differ on.
+//
+// Versions every controller has (learned from the gaps peers gossip, or from their digests matching) are
+// never asked for again, so the words holding them are dropped, bar the newest one.
 class Log {
    public:
-    // Can optimize these if needed.
-    typedef std::unordered_map<std::string, std::vector<Link::State>> LinkLog;
-    typedef std::unordered_map<std::string, std::vector<bool>> LogCommit;
-    typedef std::unordered_map<std::string, uint64_t> LogMarked;
-    typedef std::unordered_map<std::string, size_t> LogSizes;
+    static const uint32_t DIGEST_FANOUT = 8;
 
     Log();
 
+    // Size the log for links [0, links).
+    void resize(size_t links);
+
+    // Controllers, other than this one, whose logs compaction waits for.
+    void set_peers(const std::vector<NodeId>& peers);
+
+    // Learn which versions a peer has from its gossip summary.
+    void learn_marks(const PacketPtr& packet);
+
+    // A peer's hash tree node (level, index) matches this log's, so it has the same entries for those links.
+    void peer_matches(NodeId peer, uint32_t level, uint32_t index);
+
+    // 64-bit words held by link logs, and words dropped so far.
+    size_t words() const;
+    uint64_t compacted() const { return _compacted; }
+
     // Tell the log that a link exists
-    void open_log_link(const std::string& link);
+    void open_log_link(LinkId link);
 
     // Add a link event
-    void add_link_event(const std::string& link, uint64_t version, Link::State state);
+    void add_link_event(LinkId link, uint64_t version, Link::State state);
 
-    // Record what things we might be missing.
-    void compute_gaps(const std::shared_ptr<Packet>& packet);
+    // Record what things we might be missing, for every link or only for links.
+    void compute_gaps(const PacketPtr& packet);
+    void compute_gaps(const PacketPtr& packet, const std::vector<LinkId>& links);
 
     // Given a gossip packet, compute the response.
-    std::vector<Packet::GossipLog> compute_response(const std::shared_ptr<Packet>& packet);
+    std::vector<Packet::GossipLog> compute_response(const PacketPtr& packet);
 
     // Given a gossip response, merge things together.
-    void merge_logs(const std::shared_ptr<Packet>& packet);
+    void merge_logs(const PacketPtr& packet);
+
+    uint32_t digest_root() const { return _digests.size() - 1; }  // Level of the root, its index is 0.
+    uint64_t digest(uint32_t level, uint32_t index) const { return _digests[level][index]; }
+    // Nodes below (level, index) are (level - 1, i) for i in [first, last).
+    std::pair<uint32_t, uint32_t> digest_children(uint32_t level, uint32_t index) const;
 
    private:
-    std::vector<uint64_t> compute_link_gap(const std::string& link, size_t&);
-    LinkLog _log;
-    LogCommit _commit;
-    LogMarked _marked;
-    LogSizes _sizes;
-    LogMarked _max;
-
-    const size_t INITIAL_SIZE = 1024;
-    const size_t HWM = 8192;
-    const size_t GROW = 128;
+    struct LinkLog {
+        std::vector<uint64_t> committed;  // Bit per version from word first on, set if the version is known.
+        std::vector<uint64_t> up;         // Bit per version from word first on, set if the link was up.
+        uint64_t first = 0;               // Words before this were dropped, all their versions are known.
+        uint64_t marked = 0;              // No gaps before this version.
+        uint64_t max = 0;                 // Newest known version.
+
+        inline bool has(uint64_t version) const {
+            uint64_t word = version >> 6;
+            return word < first ||
+                   (word - first < committed.size() && (committed[word - first] >> (version & 63)) & 1);
+        }
+        // Only for versions in words that were not dropped.
+        inline Link::State state(uint64_t version) const {
+            return ((up[(version >> 6) - first] >> (version & 63)) & 1) ? Link::UP : Link::DOWN;
+        }
+        void set(uint64_t version, Link::State state);
+        // Drop words before word, returns how many were dropped.
+        size_t drop(uint64_t word);
+        // First version in [from, to) that is (or is not, if known is false) known, to if there is none.
+        uint64_t find(uint64_t from, uint64_t to, bool known) const;
+    };
+
+    // Versions before this one are in link's log with no gaps.
+    uint64_t prefix(LinkId link) const;
+    // Peer has every version of link before marked. Drops what every controller has.
+    void peer_marked(NodeId peer, LinkId link, uint64_t marked);
+    // Set an entry, keeping digests up to date.
+    void set_entry(LinkId link, uint64_t version, Link::State state);
+    // XOR delta into link's digest and every node above it.
+    void update_digest(LinkId link, uint64_t delta);
+    // Append the [begin, end) version ranges missing from link's log to gaps.
+    void compute_link_gap(LinkId link, std::vector<uint64_t>& gaps);
+    // Append link's known entries with versions in [begin, end) to log.
+    void append_entries(LinkId link, uint64_t begin, uint64_t end, std::vector<Packet::GossipLog>& log) const;
+    std::vector<LinkId> _open;  // Links with a log, in the order they were opened.
+    std::vector<LinkLog> _links;  // Indexed by link.
+    std::vector<std::vector<uint64_t>> _digests;  // Hash tree nodes, by level and index.
+    std::vector<int> _peer;  // Indexed by node, the peer's index in _peerMarked, -1 if not a peer.
+    std::vector<std::vector<uint64_t>> _peerMarked;  // By peer and link, versions before this they have.
+    uint64_t _compacted;
 };
 
 // Equivalent to LSController in Python
@@ -64,7 +125,7 @@ class Controller : public Node {
     Controller(Context& context, const std::string& name, const Time referesh, const Time gossip,
                Distribution<bool>* drop);
 
-    virtual void receive(std::shared_ptr<Packet> packet, Link* link);
+    virtual void receive(PacketPtr packet, Link* link);
 
     virtual void notify_link_existence(Link* link);
 
@@ -76,39 +137,138 @@ class Controller : public Node {
 
     virtual void silent_link_down(Link*);
 
-    static size_t compute_hash(const Packet::flowtable&);
+    // Hash of a single rule. A table's hash is the XOR of its rules', so it does not depend on their order
+    // and can be kept up to date a rule at a time.
+    static inline size_t rule_hash(FlowId flow, LinkId link) {
+        uint64_t x = (flow * 0x9e3779b97f4a7c15ull) ^ link;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+
+    static size_t compute_hash(const RuleTable&);
+
+    // Point flow at link in table (remove it if link is Ids::NONE), updating the table's hash.
+    static void set_flow(RuleTable& table, size_t& hash, FlowId flow, LinkId link);
+
+    // Replace the rules for the most common next hop in table with a default route. Tables without a rule for
+    // each of hosts (the hosts routes are computed to) are left alone, since the default route would carry what
+    // they drop (maybe in loops). Destinations with no rule, such as hosts the controller has not heard of,
+    // fall through to the default route.
+    static void aggregate(RuleTable& table, size_t& hash, const std::vector<NodeId>& hosts);
+
+    // Compute routes on this many threads (counting the one running the controller), 1 or less to
+    // compute them inline. Results do not depend on the number of threads.
+    static void set_route_threads(size_t threads);
+
+    // Wait this long after a change before recomputing routes, so that changes arriving in the meantime
+    // share one recomputation and one round of rule updates. 0 recomputes on every change.
+    static void set_hold_down(Time hold_down);
+
+    // Gossip by comparing log hash trees, exchanging logs only for links they differ on, rather than
+    // flooding a summary of every link.
+    static void set_gossip_digests(bool digests);
+
+    // What rules match on: a rule per flow, a rule per destination host, or a rule per destination host
+    // with the next hop most of a switch's destinations share made its default route instead.
+    enum Forwarding { PER_FLOW, DESTINATION, AGGREGATED };
+    static void set_forwarding(Forwarding forwarding);
+
+    // Share full route computations between controllers (in any partition) with the same view of the network:
+    // switch links up and hosts attached. Up to views route sets are kept, 0 computes routes every time.
+    static void set_route_cache(size_t views);
+    static uint64_t route_cache_hits();
+    static uint64_t route_cache_misses();
+
+    // What schedule_recompute was asked to do and what it did.
+    struct RecomputeStats {
+        uint64_t requests = 0;  // Changes that needed routes recomputed.
+        uint64_t runs = 0;      // Recomputations.
+        uint64_t floods = 0;    // Recomputations that sent rule updates.
+        uint64_t patches = 0;   // Rule updates (CHANGE_RULES) sent.
+        bool pending = false;   // A recomputation is scheduled.
+        std::vector<NodeId> refreshed;  // Switches whose tables we heard (SWITCH_TABLE_RESP) since.
+    };
+
+    const RecomputeStats& recompute_stats() const { return _recompute; }
+    const Log& log() const { return _log; }
 
     typedef std::unordered_map<std::string, std::shared_ptr<PILO::Node>> node_map;
     typedef std::unordered_map<std::string, std::shared_ptr<PILO::Switch>> switch_map;
     typedef std::unordered_map<std::string, std::shared_ptr<Controller>> controller_map;
-    typedef std::unordered_map<std::string, igraph_integer_t> vertex_map;
-    typedef std::unordered_map<igraph_integer_t, std::string> inv_vertex_map;
-    typedef std::unordered_map<std::string, Packet::flowtable> flowtable_db;
-    typedef std::unordered_map<std::string, uint64_t> flowtable_version;
-    typedef std::unordered_map<std::string, std::unordered_set<std::string>> deleted_entries;
+    typedef std::vector<VertexId> vertex_map;  // Indexed by node, -1 for anything but switches.
+    typedef std::vector<NodeId> inv_vertex_map;
+    // Indexed by switch.
+    typedef std::vector<RuleTable> rule_db;
+    typedef std::vector<Packet::flowtable> flowtable_db;
+    typedef std::vector<uint64_t> flowtable_version;
+    // Indexed by switch, rules to remove and the link they had.
+    typedef std::vector<std::unordered_map<FlowId, LinkId>> deleted_entries;
+
+    virtual ~Controller() {}
 
-    // igraph is not C++, and allocates memory. So be nice and remove things.
-    virtual ~Controller() { igraph_destroy(&_graph); }
+    virtual std::shared_ptr<State> save_state() const;
+
+    virtual void restore_state(const State& state);
 
    protected:
+    struct ControllerState : State {
+        std::vector<bool> links;
+        std::vector<uint64_t> linkVersion;
+        std::vector<std::forward_list<NodeId>> hostAtSwitch;
+        std::vector<size_t> hostAtSwitchCount;
+        std::vector<char> graph;
+        rule_db flowDb;
+        flowtable_version flowHash;
+        deleted_entries kept;
+        std::unordered_set<uint64_t> filter;
+        std::vector<bool> existingLinks;
+        Log log;
+        flowtable_version flowVersion;
+        RecomputeStats recompute;
+        uint64_t patchSeq;
+    };
+
+    // Fill in state, for subclasses that save more.
+    void save_state(ControllerState& state) const;
+
     // Some calls that can be used by the simulation to set up the controller.
     void add_controllers(controller_map controllers);
     void add_switches(switch_map switches);
     void add_nodes(node_map nodes);
 
-    virtual bool add_link(const std::string& link, uint64_t version);
-    virtual bool remove_link(const std::string& link, uint64_t version);
+    // Size per node and per link tables, once ids have been handed out.
+    void size_tables();
+
+    virtual bool add_link(LinkId link, uint64_t version);
+    virtual bool remove_link(LinkId link, uint64_t version);
 
     // Compute paths, return a diff of what needs to be fixed.
     virtual std::pair<flowtable_db, deleted_entries> compute_paths();
 
+    // Same as compute_paths, after add_link/remove_link. Switch link changes are applied to the existing path
+    // trees one at a time, touching only the routes they change.
+    virtual std::pair<flowtable_db, deleted_entries> update_paths();
+
     // Respond to various control messages.
-    virtual void handle_link_up(const std::shared_ptr<Packet>& packet);
-    virtual void handle_link_down(const std::shared_ptr<Packet>& packet);
-    virtual void handle_switch_information(const std::shared_ptr<Packet>& packet);
-    virtual void handle_gossip(const std::shared_ptr<Packet>& packet);
-    virtual void handle_gossip_rep(const std::shared_ptr<Packet>& packet);
-    virtual void handle_routing_resp(const std::shared_ptr<Packet>& packet);
+    virtual void handle_link_up(const PacketPtr& packet);
+    virtual void handle_link_down(const PacketPtr& packet);
+    virtual void handle_switch_information(const PacketPtr& packet);
+    virtual void handle_gossip(const PacketPtr& packet);
+    virtual void handle_gossip_rep(const PacketPtr& packet);
+    virtual void handle_gossip_digest(const PacketPtr& packet);
+    virtual void handle_routing_resp(const PacketPtr& packet);
+
+    // Recompute routes and send out the changes, now or after the hold-down.
+    void schedule_recompute();
+    void recompute();
+
+    // Bring the tables of switches we heard from since the last computation back to what that computation
+    // gave, adding the rules to send to patch.
+    void refresh_tables(std::pair<flowtable_db, deleted_entries>& patch);
+
+    // The rules sw gets from the last computation, forwarding per flow or on destination.
+    virtual void switch_table(NodeId sw, RuleTable& table) const;
 
     // Given a diff, packetize things and send rule updates to switches.
     virtual void apply_patch(std::pair<flowtable_db, deleted_entries>& diff);
@@ -119,47 +279,154 @@ class Controller : public Node {
     // Periodically (potentially) query switches for routing table
     virtual void send_routing_request();
 
+    // Ask sw for its table if it differs from ours: the changes since version since, or the whole table.
+    void request_table(NodeId sw, uint64_t since);
+
     // Periodically gossip with controllers
     virtual void send_gossip_request();
 
 
-    void add_new_link(const std::string&, uint64_t);
-    inline bool is_host_link(const std::string&);
-    inline bool add_host_link(const std::string&);
-    inline bool remove_host_link(const std::string&);
-    inline std::pair<std::string, std::string> split_parts(const std::string&);
+    void add_new_link(LinkId, uint64_t);
+    inline bool is_switch(NodeId node) const { return _vertices[node] >= 0; }
+    inline bool is_host_link(LinkId) const;
+    inline bool add_host_link(LinkId);
+    inline bool remove_host_link(LinkId);
+
+    // Shortest path tree rooted at a switch. A vertex's parent is its lowest numbered neighbour one hop
+    // closer to the root, so the tree only depends on distances and can be repaired locally.
+    struct PathTree {
+        std::vector<uint32_t> dist;             // UNREACHABLE if there is no path.
+        std::vector<VertexId> parent;  // -1 for the root and unreachable vertices.
+    };
+    static const uint32_t UNREACHABLE = std::numeric_limits<uint32_t>::max();
+
+    // Vertex sets that are cleared in constant time, reused across repairs.
+    struct Marks {
+        std::vector<uint64_t> stamp;
+        uint64_t epoch = 0;
+        void clear(size_t size) {
+            stamp.resize(size, 0);
+            epoch++;
+        }
+        inline bool test(VertexId v) const { return stamp[v] == epoch; }
+        inline void set(VertexId v) { stamp[v] = epoch; }
+    };
+
+    // A rule computed for sw, before it is merged into the flow tables.
+    struct RouteRule {
+        NodeId sw;
+        LinkId link;
+        FlowId flow;
+    };
+
+    // Call body(i) for every i in [0, n), on the route computation threads if there are any.
+    static void route_parallel_for(size_t n, const std::function<void(size_t)>& body);
+
+    // BFS from root over _graph, using queue as scratch space.
+    void build_tree(VertexId root, PathTree& tree, std::vector<VertexId>& queue) const;
+
+    // Parent of v given the distances in tree.
+    VertexId tree_parent(const PathTree& tree, VertexId root, VertexId v) const;
+
+    // Fix tree after the edge (a, b) was added or removed from _graph, recording the old parent of
+    // every vertex whose parent changed in _changed/_oldParent.
+    void repair_tree(VertexId root, PathTree& tree, VertexId a, VertexId b, bool added);
+
+    // What a full computation produces from a view of the network, before diffing against _flowDb.
+    struct Routes {
+        rule_db tables;
+        flowtable_version hashes;
+        std::vector<PathTree> trees;
+        std::vector<std::vector<VertexId>> linkTrees;
+    };
+
+    // Hosts attached to a switch, which routes are computed to.
+    std::vector<NodeId> routed_hosts() const;
+
+    // Indexed by node, whether it is a host we have heard of a link to.
+    std::vector<char> heard_hosts() const;
+
+    // Aggregated forwarding, switches only get a patch when it has new rules, so they may keep rules table
+    // (about to replace from) drops. Rules for destinations we have not heard of are kept as they are, since another
+    // controller placed them. Rules folded into the default route are kept explicit, at the default route's
+    // link, where from has them elsewhere, so a stale rule cannot override the default route.
+    static void keep_rules(const RuleTable& from, RuleTable& table, size_t& hash, const std::vector<char>& heard);
+
+    // Build trees, _linkTrees and tables for the graph from scratch.
+    void compute_routes(rule_db& new_table, flowtable_version& new_hash);
+
+    // Everything compute_paths depends on: forwarding mode, vertex layout, edges up and hosts at each switch.
+    void view_key(SharedCache<Routes>::Key& key) const;
+
+    // Rules changed in _flowDb by an update, with the link they had before (Ids::NONE if none).
+    typedef std::map<std::pair<NodeId, FlowId>, LinkId> original_rules;
+
+    // Reroute flows from root's hosts (to them, forwarding on destination) whose path went through a vertex
+    // in _changed. Rules are updated in _flowDb, with the value they had before saved in original.
+    void reroute(VertexId root, const PathTree& tree, original_rules& original);
+
+    // Point flow at link in sw's table in _flowDb, saving the rule it had in original.
+    void set_rule(NodeId sw, FlowId flow, LinkId link, original_rules& original);
+
+    // What the rules changed since original need sent to switches.
+    std::pair<flowtable_db, deleted_entries> diff_rules(const original_rules& original) const;
+
+    // Add or remove root from the trees using the edge between vertex v and parent (if any).
+    void index_tree_edge(VertexId root, VertexId v, VertexId parent, bool add);
+
+    // The switch links whose state differs from when routes were last computed, in the order they changed,
+    // and put them back in _graph as they were then. Clears _pendingLinks.
+    std::vector<LinkId> rewind_pending_links();
+
+    // Rules to send so that a switch with table from ends up with table to: rules to is adding or changing in
+    // added, and rules only from has in removed.
+    static void diff(const RuleTable& from, const RuleTable& to, Packet::flowtable& added,
+                     std::unordered_map<FlowId, LinkId>& removed);
+    static std::unique_ptr<ThreadPool> _routePool;
+    static Time _holdDown;
+    static bool _gossipDigests;
+    static Forwarding _forwarding;
+    static SharedCache<Routes> _routeCache;
+
     Distribution<bool>* _drop;
-    std::unordered_set<std::string> _controllers;
-    std::unordered_set<std::string> _switches;
-    std::unordered_set<std::string> _nodes;
-    std::unordered_set<std::string> _links;
-    std::unordered_map<std::string, uint64_t> _linkVersion;
-    std::unordered_map<std::string, std::forward_list<std::string>> _hostAtSwitch;
-    std::unordered_map<std::string, size_t> _hostAtSwitchCount;
+    std::vector<NodeId> _switches;
+    // Indexed by link.
+    std::vector<bool> _links;  // Links heard of.
+    std::vector<uint64_t> _linkVersion;
+    // Indexed by switch.
+    std::vector<std::forward_list<NodeId>> _hostAtSwitch;
+    std::vector<size_t> _hostAtSwitchCount;
     vertex_map _vertices;
     inv_vertex_map _ivertices;
-    igraph_t _graph;
-    igraph_integer_t _usedVertices;
-    flowtable_db _flowDb;
+    Graph _graph;  // Switch links known to be up.
+    VertexId _usedVertices;
+    std::vector<PathTree> _trees;  // Indexed by vertex, built for switches with hosts.
+    bool _treesValid;              // Whether _trees and _flowDb match the graph, bar _pendingLinks.
+    std::vector<LinkId> _pendingLinks;  // Switch links added or removed since.
+    std::vector<std::vector<VertexId>> _linkTrees;  // Indexed by link, the roots whose trees use it.
+    Marks _affected;
+    Marks _queued;
+    Marks _changed;
+    std::vector<VertexId> _changedVertices;
+    std::vector<VertexId> _oldParent;  // For vertices in _changed.
+    std::vector<VertexId> _scratch;
+    rule_db _flowDb;
+    flowtable_version _flowHash;  // Indexed by switch, compute_hash of its table in _flowDb.
+    deleted_entries _kept;  // Rules removed from _flowDb without a patch, so switches still have them.
     std::unordered_set<uint64_t> _filter;
-    std::unordered_set<std::string> _existingLinks;
+    std::vector<bool> _existingLinks;  // Indexed by link.
     Time _refresh;
     Time _gossip;
     Log _log;
-    boost::hash<std::string> _hash;
-    flowtable_version _flow_version;
+    flowtable_version _flow_version;  // Indexed by switch, the table version _flowDb was last updated to.
+    RecomputeStats _recompute;
+    uint64_t _patchSeq;  // Sequence number of the last rule change sent, so switches can drop stale copies.
 };
 
-inline bool Controller::is_host_link(const std::string& link) {
-    std::string v0, v1;
-    std::tie(v0, v1) = split_parts(link);
-    return ((_nodes.find(v0) != _nodes.end()) || (_nodes.find(v1) != _nodes.end()));
-}
-
-inline std::pair<std::string, std::string> Controller::split_parts(const std::string& link) {
-    std::vector<std::string> parts;
-    boost::split(parts, link, boost::is_any_of("-"));
-    return std::make_pair(parts[0], parts[1]);
+inline bool Controller::is_host_link(LinkId link) const {
+    NodeId v0, v1;
+    std::tie(v0, v1) = Ids::ends(link);
+    return (!is_switch(v0) || !is_switch(v1));
 }
 }
 #endif
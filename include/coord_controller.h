@@ -16,16 +16,16 @@ class Coordinator {
         }
         return _instance;
     }
-    void receive(CoordinationController* controller, std::shared_ptr<Packet> packet, Link* link);
+    void receive(CoordinationController* controller, PacketPtr packet, Link* link);
     Coordinator() : _rtt(0.0), _lastTime(0.0) {}
 
    protected:
-    void send_to_controller(std::shared_ptr<Packet> packet, Link* link);
+    void send_to_controller(PacketPtr packet, Link* link);
     void set_rtt(double rtt) { _rtt = rtt; }
     void set_context(Context* context);
     std::list<CoordinationController*> _controllers;
     static std::shared_ptr<Coordinator> _instance;
-    std::unordered_map<std::string, uint32_t> _lastSeen;
+    std::unordered_map<NodeId, uint32_t> _lastSeen;
     double _rtt;
     Time _lastTime;
     Context* _context;
@@ -35,8 +35,8 @@ class CoordinationController : public Controller {
    public:
     CoordinationController(Context& context, const std::string& name, const Time referesh, const Time gossip,
                            Distribution<bool>* drop);
-    virtual void receive(std::shared_ptr<Packet> packet, Link* link);
-    virtual void receive_coordinator(std::shared_ptr<Packet> packet, Link* link);
+    virtual void receive(PacketPtr packet, Link* link);
+    virtual void receive_coordinator(PacketPtr packet, Link* link);
 
     // Periodically (potentially) query switches for routing table. Don't send this for coordinated controllers.
     virtual void send_routing_request() {}
@@ -4,6 +4,8 @@
 #include <boost/random/exponential_distribution.hpp>
 #include <boost/random/uniform_int.hpp>
 #include <boost/random/bernoulli_distribution.hpp>
+#include <algorithm>
+#include <limits>
 
 #ifndef __DISTRIBUTIONS_H__
 #define __DISTRIBUTIONS_H__
@@ -16,6 +18,7 @@ static const std::string EXPONENTIAL = "exponential";
 static const std::string MEAN_KEY = "mean";
 static const std::string SIGMA_KEY = "stdev";
 static const std::string SHAPE_KEY = "shape";
+static const std::string MIN_KEY = "min";  // Optional, draws are clamped to be at least this.
 static const PILO::Time CONV_FACTOR = 1000.0;  // Conversion from Python to s.
 }
 namespace PILO {
@@ -33,6 +36,14 @@ class Distribution {
     virtual T next() = 0;
     virtual T mean() = 0;
 
+    // Smallest value next() can return. Link latency bounds are used as lookahead when running
+    // partitioned.
+    virtual T lower_bound() = 0;
+
+    // A copy of this distribution that draws from rng instead. Used to give every link and controller
+    // its own random stream when running partitioned.
+    virtual Distribution<T>* clone(boost::mt19937& rng) = 0;
+
     // Convert a YAML node into a distribution.
     static Distribution<T>* get_distribution(const YAML::Node& node, boost::mt19937& rng) {
         if (node[DISTRO].as<std::string>() == NORMAL) {
@@ -63,6 +74,10 @@ class ConstantDistribution : public Distribution<T> {
     virtual T next() { return _value; }
 
     virtual T mean() { return _value; }
+
+    virtual T lower_bound() { return _value; }
+
+    virtual Distribution<T>* clone(boost::mt19937&) { return new ConstantDistribution<T>(_value); }
 };
 
 template <typename T>
@@ -70,17 +85,27 @@ class NormalDistribution : public Distribution<T> {
    private:
     boost::normal_distribution<T> _distro;
     boost::variate_generator<boost::mt19937&, boost::normal_distribution<T>> _var;
+    T _min;
 
    public:
     NormalDistribution(const YAML::Node& node, boost::mt19937& rng)
-        : _distro(node[MEAN_KEY].as<T>(), node[SIGMA_KEY].as<T>()), _var(rng, _distro) {}
+        : _distro(node[MEAN_KEY].as<T>(), node[SIGMA_KEY].as<T>()),
+          _var(rng, _distro),
+          _min(node[MIN_KEY] ? node[MIN_KEY].as<T>() / CONV_FACTOR : std::numeric_limits<T>::lowest()) {}
+
+    NormalDistribution(const boost::normal_distribution<T>& distro, const T min, boost::mt19937& rng)
+        : _distro(distro), _var(rng, _distro), _min(min) {}
 
     virtual T next() {
         // We treat returns of this type as meaning ms in Python. Convert to S.
-        return _var() / CONV_FACTOR;
+        return std::max(_min, _var() / CONV_FACTOR);
     }
 
     virtual T mean() { return _distro.mean() / CONV_FACTOR; }
+
+    virtual T lower_bound() { return _min; }
+
+    virtual Distribution<T>* clone(boost::mt19937& rng) { return new NormalDistribution<T>(_distro, _min, rng); }
 };
 
 template <typename T>
@@ -88,19 +113,31 @@ class ExponentialDistribution : public Distribution<T> {
    private:
     boost::exponential_distribution<T> _distro;
     boost::variate_generator<boost::mt19937&, boost::exponential_distribution<T>> _var;
+    T _min;
 
    public:
     ExponentialDistribution(const YAML::Node& node, boost::mt19937& rng)
-        : _distro(node[SHAPE_KEY].as<T>()), _var(rng, _distro) {}
+        : _distro(node[SHAPE_KEY].as<T>()),
+          _var(rng, _distro),
+          _min(node[MIN_KEY] ? node[MIN_KEY].as<T>() / CONV_FACTOR : 0) {}
+
+    ExponentialDistribution(const T shape, boost::mt19937& rng) : _distro(shape), _var(rng, _distro), _min(0) {}
 
-    ExponentialDistribution(const T shape, boost::mt19937& rng) : _distro(shape), _var(rng, _distro) {}
+    ExponentialDistribution(const T shape, const T min, boost::mt19937& rng)
+        : _distro(shape), _var(rng, _distro), _min(min) {}
 
     virtual T next() {
         // We treat returns of this type as meaning ms in Python. Convert to S.
-        return _var() / CONV_FACTOR;
+        return std::max(_min, _var() / CONV_FACTOR);
     }
 
     virtual T mean() { return (1.0 / _distro.lambda()) / CONV_FACTOR; }
+
+    virtual T lower_bound() { return _min; }
+
+    virtual Distribution<T>* clone(boost::mt19937& rng) {
+        return new ExponentialDistribution<T>(_distro.lambda(), _min, rng);
+    }
 };
 
 class UniformIntDistribution : public Distribution<int32_t> {
@@ -118,6 +155,12 @@ class UniformIntDistribution : public Distribution<int32_t> {
     }
 
     virtual int mean() { return 0; }
+
+    virtual int32_t lower_bound() { return _distro.min(); }
+
+    virtual Distribution<int32_t>* clone(boost::mt19937& rng) {
+        return new UniformIntDistribution(_distro.min(), _distro.max(), rng);
+    }
 };
 
 class BernoulliDistribution : public Distribution<bool> {
@@ -131,6 +174,10 @@ class BernoulliDistribution : public Distribution<bool> {
     virtual bool next() { return _var(); }
 
     virtual bool mean() { return (_distro.p() > 0.5 ? true : false); }
+
+    virtual bool lower_bound() { return false; }
+
+    virtual Distribution<bool>* clone(boost::mt19937& rng) { return new BernoulliDistribution(_distro.p(), rng); }
 };
 }
 #endif
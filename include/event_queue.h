@@ -0,0 +1,140 @@
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/heap/fibonacci_heap.hpp>
+#include <boost/heap/d_ary_heap.hpp>
+#include "pool_allocator.h"
+#include "task.h"
+
+#ifndef __EVENT_QUEUE_H__
+#define __EVENT_QUEUE_H__
+
+namespace PILO {
+typedef InlineTask Task;
+
+// A scheduled event. Events at the same time run in the order they were scheduled (by seq), so that
+// every queue engine produces exactly the same execution order.
+struct Event {
+    Time time;
+    uint64_t seq;
+    Task task;
+};
+
+// Orders events so that the earliest (time, seq) is on top of a max-heap.
+struct EventCompare {
+    inline bool operator()(const Event& e1, const Event& e2) const {
+        return e1.time > e2.time || (e1.time == e2.time && e1.seq > e2.seq);
+    }
+};
+
+// Interface for the priority queue backing a Context. Which engine to use is picked per run.
+class EventQueue {
+   public:
+    enum Type { FIBONACCI = 0, DARY_HEAP, CALENDAR };
+
+    // Pretty print support, indexed by Type.
+    static const std::string IType[];
+
+    // Create an empty queue of the given type.
+    static std::unique_ptr<EventQueue> make(Type type);
+
+    // Parse a queue name (as printed by IType). Returns false if the name is unknown.
+    static bool parse_type(const std::string& name, Type& type);
+
+    virtual void push(Event&& event) = 0;
+
+    // Earliest event. Must not be called on an empty queue.
+    virtual const Event& top() const = 0;
+
+    // Remove and return the earliest event.
+    virtual Event pop() = 0;
+
+    virtual bool empty() const = 0;
+
+    virtual size_t size() const = 0;
+
+    virtual void clear() = 0;
+
+    // Heap allocations made by event queue storage since the process started. Queues stop
+    // allocating once they reach their peak population.
+    static uint64_t allocations() { return AllocationCounter::allocations.load(std::memory_order_relaxed); }
+
+    virtual ~EventQueue() {}
+};
+
+// Fibonacci heap, the original engine. Needs one heap node per event, recycled through a pool.
+class FibonacciQueue : public EventQueue {
+   public:
+    virtual void push(Event&& event) { _heap.push(std::move(event)); }
+    virtual const Event& top() const { return _heap.top(); }
+    virtual Event pop();
+    virtual bool empty() const { return _heap.empty(); }
+    virtual size_t size() const { return _heap.size(); }
+    virtual void clear() { _heap.clear(); }
+
+   private:
+    boost::heap::fibonacci_heap<Event, boost::heap::compare<EventCompare>,
+                                boost::heap::allocator<PoolAllocator<Event>>> _heap;
+};
+
+// Implicit 4-ary heap stored in a single array. Shallower than a binary heap and children share a
+// cache line, which makes it considerably cheaper than chasing Fibonacci heap pointers.
+class DaryHeapQueue : public EventQueue {
+   public:
+    virtual void push(Event&& event) { _heap.push(std::move(event)); }
+    virtual const Event& top() const { return _heap.top(); }
+    virtual Event pop();
+    virtual bool empty() const { return _heap.empty(); }
+    virtual size_t size() const { return _heap.size(); }
+    virtual void clear() { _heap.clear(); }
+
+   private:
+    boost::heap::d_ary_heap<Event, boost::heap::arity<4>, boost::heap::compare<EventCompare>,
+                            boost::heap::allocator<CountingAllocator<Event>>> _heap;
+};
+
+// Calendar queue (Brown, CACM 1988). Events are hashed by time into a ring of buckets ("days") of
+// fixed width, each kept sorted. Dequeue walks the ring from the current day, so for our nearly
+// monotonic timestamps both enqueue and dequeue are O(1) amortized. The ring is resized (and the
+// bucket width re-estimated from the queue contents) whenever the population doubles or halves.
+class CalendarQueue : public EventQueue {
+   public:
+    CalendarQueue();
+    virtual void push(Event&& event);
+    virtual const Event& top() const;
+    virtual Event pop();
+    virtual bool empty() const { return _size == 0; }
+    virtual size_t size() const { return _size; }
+    virtual void clear();
+
+   private:
+    // Each bucket is sorted in descending order so that its earliest event is at the back.
+    typedef std::vector<Event, CountingAllocator<Event>> Bucket;
+
+    inline uint64_t day(Time time) const { return (uint64_t)(time / _width); }
+
+    // Find the bucket holding the earliest event, and advance the current day to it.
+    size_t locate() const;
+
+    void insert(Event&& event);
+
+    void resize(size_t buckets);
+
+    // Only the first _nbuckets buckets are in use, the rest are kept for when the ring grows again.
+    std::vector<Bucket> _buckets;
+    size_t _nbuckets;
+    // Scratch space for resizing, kept around so that resizing does not allocate once warm.
+    std::vector<Event, CountingAllocator<Event>> _resize;
+    size_t _size;
+    Time _width;
+    // Current day (absolute, not modulo the number of buckets). Every queued event is on or after it.
+    mutable uint64_t _day;
+    // Bucket containing the earliest event, if known.
+    mutable size_t _top;
+    mutable bool _topValid;
+
+    static const size_t MIN_BUCKETS = 2;
+    static const size_t WIDTH_SAMPLES = 25;
+};
+}
+#endif
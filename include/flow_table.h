@@ -0,0 +1,86 @@
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "ids.h"
+
+#ifndef __FLOW_TABLE_H__
+#define __FLOW_TABLE_H__
+namespace PILO {
+// A switch's forwarding table: flow to the port (index into the switch's links) it is forwarded on. Open
+// addressing with linear probing over a flat array of at most half full slots, deleting by shifting later
+// entries back, so lookups touch one or two cache lines and nothing is allocated once the table has grown.
+class FlowTable {
+   public:
+    typedef uint32_t Port;
+    static const Port NONE = std::numeric_limits<Port>::max();
+
+    struct Entry {
+        FlowId flow;
+        Port port;  // NONE for empty slots.
+    };
+
+    FlowTable() : _slots(MIN_SLOTS, Entry{0, NONE}), _size(0), _shift(64 - MIN_BITS) {}
+
+    size_t size() const { return _size; }
+
+    // The port flow is forwarded on, NONE if it has no rule.
+    inline Port find(FlowId flow) const {
+        for (size_t s = home(flow);; s = (s + 1) & mask()) {
+            if (_slots[s].port == NONE || _slots[s].flow == flow) {
+                return _slots[s].port;
+            }
+        }
+    }
+
+    // Point flow at port, returns the port it was on before (NONE if it had no rule).
+    Port set(FlowId flow, Port port);
+
+    // Remove flow's rule, returns the port it was on (NONE if it had no rule).
+    Port erase(FlowId flow);
+
+    // Rules, in no particular order.
+    class iterator {
+       public:
+        iterator(const std::vector<Entry>& slots, size_t slot) : _slots(slots), _slot(slot) { skip(); }
+        inline const Entry& operator*() const { return _slots[_slot]; }
+        inline const Entry* operator->() const { return &_slots[_slot]; }
+        inline iterator& operator++() {
+            _slot++;
+            skip();
+            return *this;
+        }
+        inline bool operator!=(const iterator& other) const { return _slot != other._slot; }
+
+       private:
+        inline void skip() {
+            while (_slot < _slots.size() && _slots[_slot].port == NONE) {
+                _slot++;
+            }
+        }
+        const std::vector<Entry>& _slots;
+        size_t _slot;
+    };
+
+    iterator begin() const { return iterator(_slots, 0); }
+    iterator end() const { return iterator(_slots, _slots.size()); }
+
+   private:
+    static const unsigned MIN_BITS = 4;
+    static const size_t MIN_SLOTS = (size_t)1 << MIN_BITS;
+
+    inline size_t mask() const { return _slots.size() - 1; }
+
+    inline size_t home(FlowId flow) const {
+        // Fibonacci hashing: the top bits of the product mix both node ids in a flow id.
+        return (size_t)((flow * 0x9e3779b97f4a7c15ull) >> _shift);
+    }
+
+    // Double the slots and reinsert every rule.
+    void grow();
+
+    std::vector<Entry> _slots;  // Size is a power of two.
+    size_t _size;
+    unsigned _shift;  // 64 less log2 of the number of slots.
+};
+}
+#endif
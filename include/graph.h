@@ -0,0 +1,105 @@
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "ids.h"
+
+#ifndef __GRAPH_H__
+#define __GRAPH_H__
+namespace PILO {
+// Index of a vertex in a Graph, -1 for none.
+typedef int32_t VertexId;
+
+// Undirected graph over switches. Every link the topology has between two vertices is laid out once, as
+// contiguous (CSR) neighbour arrays sorted by neighbour, and links are then only switched up and down, with
+// a flag per direction. Updates are constant time, and traversals read memory in order.
+class Graph {
+   public:
+    // One direction of an edge. The neighbours of v are in slots [first(v), last(v)).
+    typedef uint32_t Slot;
+    static const Slot NONE = std::numeric_limits<Slot>::max();
+    static const uint32_t UNREACHABLE = std::numeric_limits<uint32_t>::max();
+
+    // Lay out vertices [0, vertices) and an edge for every link between two of them. vertex is indexed by
+    // node, -1 for nodes that are not vertices. All edges start down.
+    void build(size_t vertices, const std::vector<VertexId>& vertex);
+
+    size_t vertices() const { return _first.empty() ? 0 : _first.size() - 1; }
+
+    size_t slots() const { return _target.size(); }
+
+    // Set a link up or down, returns whether its state changed. Links that are not edges are ignored.
+    bool set_link(LinkId link, bool up);
+
+    bool link_up(LinkId link) const { return link < _slots.size() && _slots[link] != NONE && _up[_slots[link]]; }
+
+    inline Slot first(VertexId v) const { return _first[v]; }
+    inline Slot last(VertexId v) const { return _first[v + 1]; }
+    inline VertexId target(Slot slot) const { return _target[slot]; }
+    inline bool up(Slot slot) const { return _up[slot]; }
+
+    // The slot from a to b, NONE if the topology has no such edge.
+    Slot slot(VertexId a, VertexId b) const;
+
+    // Neighbours of a vertex over edges that are up, in increasing order.
+    class Neighbours {
+       public:
+        class iterator {
+           public:
+            iterator(const Graph& graph, Slot slot, Slot end) : _graph(graph), _slot(slot), _end(end) { skip(); }
+            inline VertexId operator*() const { return _graph._target[_slot]; }
+            inline iterator& operator++() {
+                _slot++;
+                skip();
+                return *this;
+            }
+            inline bool operator!=(const iterator& other) const { return _slot != other._slot; }
+
+           private:
+            inline void skip() {
+                while (_slot < _end && !_graph._up[_slot]) {
+                    _slot++;
+                }
+            }
+            const Graph& _graph;
+            Slot _slot;
+            Slot _end;
+        };
+
+        Neighbours(const Graph& graph, VertexId v) : _graph(graph), _begin(graph.first(v)), _end(graph.last(v)) {}
+        iterator begin() const { return iterator(_graph, _begin, _end); }
+        iterator end() const { return iterator(_graph, _end, _end); }
+
+       private:
+        const Graph& _graph;
+        Slot _begin;
+        Slot _end;
+    };
+
+    Neighbours neighbours(VertexId v) const { return Neighbours(*this, v); }
+
+    // Edge states, to save and restore.
+    const std::vector<char>& state() const { return _up; }
+    void restore(const std::vector<char>& state) { _up = state; }
+
+    // Breadth first search from root visiting neighbours in order, so a vertex's parent is the first vertex
+    // it was reached from: parent[root] is root, and -1 for unreachable vertices. Slots set in removed (if
+    // any) are skipped, for searches over a directed variant of the graph.
+    void bfs(VertexId root, std::vector<VertexId>& parent, const std::vector<char>* removed = nullptr) const;
+
+    // Hop counts from each of roots (dist[i] for roots[i]) to every vertex, UNREACHABLE if there is no path.
+    // Searches run 64 roots at a time: each vertex keeps a word with a bit per root that has reached it, and
+    // a level is one pass over the edges ORing the words of the vertices reached on the level before.
+    void distances(const std::vector<VertexId>& roots, std::vector<std::vector<uint32_t>>& dist) const;
+
+    // A shortest path from a to b as a list of vertices (the one bfs finds), empty if there is none.
+    void shortest_path(VertexId a, VertexId b, std::vector<VertexId>& path) const;
+
+   private:
+    std::vector<Slot> _first;       // Indexed by vertex, plus one past the end.
+    std::vector<VertexId> _target;  // Indexed by slot.
+    std::vector<char> _up;          // Indexed by slot.
+    std::vector<Slot> _slots;       // Indexed by link, the slot from its first end, NONE for non-edges.
+    std::vector<Slot> _reverse;     // Indexed by link, the slot from its second end.
+};
+}
+#endif
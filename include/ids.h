@@ -0,0 +1,77 @@
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifndef __IDS_H__
+#define __IDS_H__
+namespace PILO {
+typedef uint32_t NodeId;
+typedef uint32_t LinkId;
+// A (source, destination) host pair. Rules may also be keyed by destination (any source) or match
+// everything, see Ids::destination and Ids::DEFAULT_ROUTE.
+typedef uint64_t FlowId;
+
+// Dense integer ids for nodes and links, handed out in order as the topology is loaded, so that
+// everything else can key on (and index vectors with) integers. Names are only needed for output.
+// Ids are assigned before the simulation starts and only read after that, so there is no locking.
+class Ids {
+   public:
+    // Not a node, used for packets addressed to everyone.
+    static const NodeId ANY = std::numeric_limits<NodeId>::max();
+    static const LinkId NONE = std::numeric_limits<LinkId>::max();
+
+    // Id for node name, allocating one if needed.
+    static NodeId node(const std::string& name);
+
+    static const std::string& node_name(NodeId node);
+
+    static size_t nodes() { return _nodeNames.size(); }
+
+    // Id for the link name between a and b, allocating one if needed.
+    static LinkId link(const std::string& name, NodeId a, NodeId b);
+
+    static const std::string& link_name(LinkId link) { return _links[link].name; }
+
+    // Endpoints of link, in the order they appear in its name.
+    static std::pair<NodeId, NodeId> ends(LinkId link) { return std::make_pair(_links[link].a, _links[link].b); }
+
+    // The link between a and b (in either order), NONE if there is none.
+    static LinkId between(NodeId a, NodeId b);
+
+    static size_t links() { return _links.size(); }
+
+    static inline FlowId flow(NodeId source, NodeId destination) {
+        return ((FlowId)source << 32) | destination;
+    }
+
+    static inline NodeId flow_source(FlowId flow) { return (NodeId)(flow >> 32); }
+
+    static inline NodeId flow_destination(FlowId flow) { return (NodeId)flow; }
+
+    // Key for rules matching packets from any source to destination.
+    static inline FlowId destination(NodeId destination) { return flow(ANY, destination); }
+
+    // Key for a rule matching all packets.
+    static const FlowId DEFAULT_ROUTE = ~(FlowId)0;
+
+   private:
+    struct LinkInfo {
+        std::string name;
+        NodeId a;
+        NodeId b;
+    };
+
+    static inline uint64_t key(NodeId a, NodeId b) { return ((uint64_t)std::min(a, b) << 32) | std::max(a, b); }
+
+    static std::vector<std::string> _nodeNames;
+    static std::unordered_map<std::string, NodeId> _nodeIds;
+    static std::vector<LinkInfo> _links;
+    static std::unordered_map<std::string, LinkId> _linkIds;
+    static std::unordered_map<uint64_t, LinkId> _linkBetween;
+};
+}
+#endif
@@ -1,12 +1,17 @@
+#include <deque>
+#include <functional>
 #include <memory>
 #include <unordered_map>
+#include <vector>
 #include "context.h"
 #include "distributions.h"
+#include "ids.h"
 #ifndef __LINK_H__
 #define __LINK_H__
 namespace PILO {
 class Node;
 class Packet;
+class PacketPtr;
 /// This is equivalent to bandwidth link in the Python version.
 class Link {
     friend class Simulation;
@@ -14,6 +19,7 @@ class Link {
    private:
     Context& _context;
     std::string _name;
+    LinkId _id;
     Distribution<Time>* _latency;
     const BPS _bandwidth;
     Distribution<bool>* _drop;
@@ -27,7 +33,7 @@ class Link {
          std::shared_ptr<Node> b, Distribution<bool>* drop);
 
     // Send a packet.
-    void send(Node* sender, std::shared_ptr<Packet> packet);
+    void send(Node* sender, PacketPtr packet);
 
     inline bool is_up() const { return _state == UP; }
 
@@ -35,14 +41,48 @@ class Link {
 
     inline const std::string& name() const { return _name; }
 
+    inline LinkId id() const { return _id; }
+
     inline uint64_t version() const { return _version; }
 
-    void reset() { _nextSchedulableA = 0.; _nextSchedulableB = 0.; _aQueue = 0; _bQueue = 0; }
+    void reset();
+
+    // Give each direction its own state and random streams (derived from seed), so that the two
+    // endpoints can be simulated by different threads. See Simulation::run_parallel.
+    void partition(uint32_t seed);
+
+    // Smallest delay between sending a packet on this link and its delivery.
+    Time lookahead() const { return _latency->lower_bound(); }
+
+    // Save the sending or receiving half of the direction sender sends on, for rolling back optimistic
+    // execution. Returns a function restoring it.
+    std::function<void()> save_direction(const Node* sender, bool sending) const;
+
+    // Bits delivered over this link, in total and by packet type.
+    size_t total_bits() const;
+    size_t bits_by_type(int type) const;
 
     std::shared_ptr<Node> _a;
     std::shared_ptr<Node> _b;
 
    private:
+    // When partitioned, the sending endpoint owns the scheduling half of a direction and the receiving
+    // endpoint owns the accounting half. Every packet pays the propagation latency, so a packet is
+    // never delivered sooner than lookahead() after it was sent.
+    struct Direction {
+        // Sender side
+        std::unique_ptr<boost::mt19937> rng;
+        std::unique_ptr<Distribution<Time>> latency;
+        std::unique_ptr<Distribution<bool>> drop;
+        Time nextSchedulable;
+        std::deque<Time> inFlight;  // Delivery times of packets not yet delivered, in order.
+        // Receiver side
+        size_t totalBits;
+        std::vector<size_t> bitByType;
+    };
+
+    void send_partitioned(Node* sender, PacketPtr&& packet);
+
     void set_up();
 
     void set_down();
@@ -61,6 +101,8 @@ class Link {
     State _state;
     size_t _totalBits;
     std::unordered_map<int32_t, size_t> _bitByType;
+    // Indexed by sender, 0 for _a and 1 for _b. Empty unless partitioned.
+    std::unique_ptr<Direction> _directions[2];
 };
 }
 #endif
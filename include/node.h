@@ -1,6 +1,7 @@
 #include <memory>
-#include <unordered_map>
+#include <vector>
 #include "context.h"
+#include "ids.h"
 #include "packet.h"
 #include "link.h"
 #ifndef __NODE_H__
@@ -10,6 +11,7 @@ class Link;
 /// A base node, also an end host.
 class Node {
     friend class Simulation;
+    friend class Link;
 
    protected:
     Context& _context;
@@ -17,7 +19,7 @@ class Node {
    public:
     Node(Context& context, const std::string& name);
 
-    virtual void receive(std::shared_ptr<Packet> packet, Link* link);
+    virtual void receive(PacketPtr packet, Link* link);
 
     virtual void notify_link_existence(Link* link);
 
@@ -33,14 +35,40 @@ class Node {
 
     virtual void silent_link_down(Link*) {}
 
-    void flood(std::shared_ptr<Packet> packet);
+    void flood(PacketPtr packet);
 
-    void flood(std::shared_ptr<Packet> packet, const std::string& l);
+    // Flood on every link except l.
+    void flood(PacketPtr packet, LinkId l);
+
+    // This node's end of link, NULL if it has none.
+    Link* link(LinkId link) const;
+
+    // Port (index in _links) of link, _links.size() if it is not attached here.
+    size_t port(LinkId link) const;
 
     const std::string _name;
+    const NodeId _id;
+
+    // Events scheduled by this node. Ids are handed out in construction order.
+    EventSource _events;
+
+    // Copy of what a node changes while handling events, used to roll back optimistic execution (see
+    // Context::speculate). Subclasses extend it with their own state.
+    struct State {
+        EventSource events;
+        virtual ~State() {}
+    };
+
+    virtual std::shared_ptr<State> save_state() const;
+
+    virtual void restore_state(const State& state);
 
    protected:
-    std::unordered_map<std::string, Link*> _links;
+    // Links in the order they were attached, a node's port numbers.
+    std::vector<Link*> _links;
+
+   private:
+    static uint32_t _count;
 };
 }
 #endif
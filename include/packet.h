@@ -1,24 +1,32 @@
+#include <atomic>
+#include <cassert>
+#include <cstddef>
 #include <string>
 #include <memory>
 #include <map>
-#include <unordered_set>
+#include <mutex>
+#include <utility>
 #include <vector>
+#include "ids.h"
 #include "link.h"
 #ifndef __PACKET_H__
 #define __PACKET_H__
 namespace PILO {
 class Node;
+class PacketPtr;
 
-// Packets.
+// Packets. Allocated from per-thread pools (see make_packet) and reference counted through PacketPtr.
 class Packet {
    public:
-    typedef std::map<std::string, std::string> flowtable;
+    // Flow to the link it is forwarded on.
+    typedef std::map<FlowId, LinkId> flowtable;
 
     // This packet is for all.
-    static const std::string WILDCARD;
+    static const NodeId WILDCARD = Ids::ANY;
 
-    // Record packet ID.
-    static uint64_t pid;
+    // Record packet ID. Per thread, since partitions draw IDs from disjoint ranges (see
+    // Simulation::run_parallel).
+    static thread_local uint64_t pid;
 
     // Packet type.
     enum Type {
@@ -35,6 +43,7 @@ class Packet {
         GOSSIP_REP = 9,
         SWITCH_TABLE_REQ = 10,
         SWITCH_TABLE_RESP = 11,
+        GOSSIP_DIGEST = 12,
         END
     };
 
@@ -43,66 +52,224 @@ class Packet {
 
     enum {
         HEADER = 14 * 8,
-        LINK_UP_SIZE = HEADER + 64 + 64,   // Header + 64 bit link ID + 64 bit version
-        LINK_DOWN_SIZE = HEADER + 64 + 64  // Header + 64 bit link ID + 64 bit version
     };
 
-    std::string _source;
-    std::string _destination;
+    NodeId _source;
+    NodeId _destination;
     Type _type;
-    std::string _sig;
-    size_t _size;
+    FlowId _flow;
     uint64_t _id;
 
-    // What to send in gossip responses.
+    // Fixed size fields: the link a LINK_UP/LINK_DOWN is about and its version, the table hash in
+    // SWITCH_TABLE_REQ and version in SWITCH_TABLE_RESP. since is the table version the requester last
+    // heard of, and in responses the version the rules are changes since (FULL_TABLE if they are the whole
+    // table), with hash the hash of the whole table.
+    struct {
+        LinkId link;
+        size_t version;
+        size_t since;
+        size_t hash;
+    } data;
+
+    static const size_t FULL_TABLE = ~(size_t)0;
+
+    // Forwarding rule, a flow and the link it is forwarded on.
+    typedef std::pair<FlowId, LinkId> Rule;
+
+    // CHANGE_RULES and SWITCH_TABLE_RESP payload.
+    struct Rules {
+        std::vector<Rule> rules;       // Sorted by flow.
+        std::vector<FlowId> removed;  // Sorted, rules to delete (not in full SWITCH_TABLE_RESP).
+    };
+
+    // SWITCH_INFORMATION payload entry.
+    struct LinkReport {
+        LinkId link;
+        Link::State state;
+        uint64_t version;
+    };
+
+    // GOSSIP payload: for each link the last version we know of, and the versions we are missing as
+    // [begin, end) pairs in gaps.
+    struct Gossip {
+        struct Summary {
+            LinkId link;
+            uint64_t max;
+            uint32_t gapsBegin;  // This link's pairs are gaps[gapsBegin, gapsEnd).
+            uint32_t gapsEnd;
+        };
+        std::vector<Summary> links;
+        std::vector<uint64_t> gaps;
+    };
+
+    // What to send in gossip responses (GOSSIP_REP payload entry).
     struct GossipLog {
-        std::string link;
+        LinkId link;
         Link::State state;
         uint64_t version;
     };
 
-    // All the data we would ever possibly need, since I am lazy
-    struct {
-        std::string link;
-        size_t version;
-        flowtable table;
-        std::unordered_set<std::string> deleteEntries;
-        std::unordered_map<std::string, Link::State> linkState;
-        std::unordered_map<std::string, uint64_t> linkVersion;
-        std::unordered_map<std::string, std::vector<uint64_t>> gaps;
-        std::unordered_map<std::string, uint64_t> logMax;
-        std::vector<GossipLog> gossipResponse;
-    } data;
+    // GOSSIP_DIGEST payload entry: a node of the sender's log hash tree (see Log).
+    struct Digest {
+        uint32_t level;
+        uint32_t index;
+        uint64_t hash;
+    };
 
-    Packet(std::string source, std::string destination, Type type, size_t size)
-        : _source(source), _destination(destination), _type(type), _size(size) {
-        _sig = generate_signature(_source, _destination, _type);
-        _id = pid;
-        pid++;
-        data.version = 0;
-#if 0
-                    std::cout << "packet_obj " << _id << " created " << std::endl;
-#endif
+    // Payload accessors, each only valid for the packet types listed above.
+    Rules& rules() {
+        assert(payload(_type) == RULES);
+        return _payload.rules;
     }
-
-    virtual ~Packet() {
-#if 0
-                std::cout << "packet_obj " << _id << " destroyed " << std::endl;
-#endif
+    const Rules& rules() const {
+        assert(payload(_type) == RULES);
+        return _payload.rules;
+    }
+    std::vector<LinkReport>& link_reports() {
+        assert(payload(_type) == LINK_REPORTS);
+        return _payload.reports;
+    }
+    const std::vector<LinkReport>& link_reports() const {
+        assert(payload(_type) == LINK_REPORTS);
+        return _payload.reports;
     }
+    Gossip& gossip() {
+        assert(payload(_type) == GOSSIP_SUMMARY);
+        return _payload.gossip;
+    }
+    const Gossip& gossip() const {
+        assert(payload(_type) == GOSSIP_SUMMARY);
+        return _payload.gossip;
+    }
+    std::vector<GossipLog>& gossip_log() {
+        assert(payload(_type) == GOSSIP_LOG);
+        return _payload.log;
+    }
+    const std::vector<GossipLog>& gossip_log() const {
+        assert(payload(_type) == GOSSIP_LOG);
+        return _payload.log;
+    }
+    std::vector<Digest>& digests() {
+        assert(payload(_type) == DIGESTS);
+        return _payload.digests;
+    }
+    const std::vector<Digest>& digests() const {
+        assert(payload(_type) == DIGESTS);
+        return _payload.digests;
+    }
+
+    // Size in bits, derived from what the packet carries.
+    size_t size() const;
 
-    static std::string generate_signature(const std::string& src, const std::string& dest, Type type) {
-        return src + ":" + dest + ":" + std::to_string(type);
+    static PacketPtr make_packet(std::shared_ptr<Node> src, std::shared_ptr<Node> dest, Type type);
+
+    static PacketPtr make_packet(std::shared_ptr<Node> src, Type type);
+
+    static PacketPtr make_packet(NodeId src, Packet::Type type);
+
+    static PacketPtr make_packet(NodeId src, NodeId dest, Type type);
+
+    // A copy of packet with the same id, for handing to another thread (see Link::send_partitioned).
+    static PacketPtr copy(const Packet& packet);
+
+    // Packets currently referenced, the most there ever were at once, and the number of Packet objects
+    // ever allocated (pools only allocate when they run dry).
+    static int64_t live() { return _live.load(std::memory_order_relaxed); }
+    static int64_t peak() { return _peak.load(std::memory_order_relaxed); }
+    static uint64_t allocated() { return _allocated.load(std::memory_order_relaxed); }
+
+   private:
+    friend class PacketPtr;
+
+    // Grab a packet of type from this thread's pool.
+    static Packet* acquire(Type type);
+
+    // Return an unreferenced packet to the pool it came from.
+    static void release(Packet* packet);
+
+    // Recycled packets, by type, so that a recycled packet's containers already have room for what
+    // that type of packet usually carries. Each thread allocates from its own pool, packets freed by
+    // another thread (e.g., after crossing partitions) are handed back through returned. Like slabs in
+    // PoolAllocator pools are never freed, packets may outlive the thread that allocated them.
+    struct Pool {
+        std::vector<Packet*> free[END];
+        std::mutex lock;
+        std::vector<Packet*> returned[END];  // Guarded by lock.
+    };
+
+    static Pool& pool();
+
+    // Which payload a packet type carries.
+    enum Payload { NO_PAYLOAD, RULES, LINK_REPORTS, GOSSIP_SUMMARY, GOSSIP_LOG, DIGESTS };
+
+    static Payload payload(Type type);
+
+    // Pools are per type, so a packet's type (and payload) never changes once it is constructed.
+    Packet(Pool* owner, Type type);
+
+    ~Packet();
+
+    // Empty the payload, keeping its storage.
+    void clear();
+
+    // Only the member for payload(_type) is constructed.
+    union Storage {
+        Storage() {}
+        ~Storage() {}
+        Rules rules;
+        std::vector<LinkReport> reports;
+        Gossip gossip;
+        std::vector<GossipLog> log;
+        std::vector<Digest> digests;
+    } _payload;
+
+    // Not atomic: a packet is only ever referenced by one thread at a time.
+    uint32_t _refs;
+    Pool* _owner;
+
+    static thread_local Pool* _pool;
+
+    static std::atomic<int64_t> _live;
+    static std::atomic<int64_t> _peak;
+    static std::atomic<uint64_t> _allocated;
+};
+
+// Intrusive, non-atomic shared pointer to a pooled Packet. The packet goes back to its pool once the
+// last PacketPtr referencing it goes away.
+class PacketPtr {
+   public:
+    PacketPtr() : _packet(nullptr) {}
+
+    PacketPtr(std::nullptr_t) : _packet(nullptr) {}
+
+    explicit PacketPtr(Packet* packet) : _packet(packet) {
+        if (_packet) {
+            _packet->_refs++;
+        }
     }
 
-    static std::shared_ptr<Packet> make_packet(std::shared_ptr<Node> src, std::shared_ptr<Node> dest, Type type,
-                                               size_t size);
+    PacketPtr(const PacketPtr& other) : PacketPtr(other._packet) {}
+
+    PacketPtr(PacketPtr&& other) noexcept : _packet(other._packet) { other._packet = nullptr; }
 
-    static std::shared_ptr<Packet> make_packet(std::shared_ptr<Node> src, Type type, size_t size);
+    PacketPtr& operator=(PacketPtr other) noexcept {
+        std::swap(_packet, other._packet);
+        return *this;
+    }
+
+    ~PacketPtr() {
+        if (_packet && --_packet->_refs == 0) {
+            Packet::release(_packet);
+        }
+    }
 
-    static std::shared_ptr<Packet> make_packet(std::string src, Packet::Type type, size_t size);
+    inline Packet* get() const { return _packet; }
+    inline Packet* operator->() const { return _packet; }
+    inline Packet& operator*() const { return *_packet; }
+    explicit operator bool() const { return _packet != nullptr; }
 
-    static std::shared_ptr<Packet> make_packet(std::string src, std::string dest, Type type, size_t size);
+   private:
+    Packet* _packet;
 };
 }
 #endif
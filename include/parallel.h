@@ -0,0 +1,147 @@
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+#include "context.h"
+
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+namespace PILO {
+// Buffers what each worker thread writes to std::cout, so that the output of a window can be written
+// out partition by partition rather than interleaved. Threads without a buffer write through.
+class PartitionedOutput : public std::streambuf {
+   public:
+    PartitionedOutput(std::ostream& stream, size_t partitions);
+
+    ~PartitionedOutput();
+
+    // Direct this thread's output to the buffer of partition.
+    void attach(size_t partition) { _buffer = &_buffers.at(partition); }
+
+    // Write out and clear all buffers, in partition order. Workers must be idle.
+    void flush();
+
+    std::string* buffer(size_t partition) { return &_buffers.at(partition); }
+
+    // Where output ends up.
+    std::streambuf* target() { return _target; }
+
+   protected:
+    virtual int overflow(int c);
+    virtual std::streamsize xsputn(const char* s, std::streamsize n);
+    virtual int sync();
+
+   private:
+    std::ostream& _stream;
+    std::streambuf* _target;
+    std::vector<std::string> _buffers;
+    static thread_local std::string* _buffer;
+};
+
+// Conservative (YAWNS style) synchronous engine. Each partition has its own context and worker thread.
+// Partitions repeatedly run all events in a window [T, T + lookahead), where T is the earliest pending
+// event, and exchange cross-partition events at the end of it: an event sent at t >= T cannot be due
+// before T + lookahead, so nothing in the window can be missed. Events in the global context (failures,
+// measurements) act on the whole simulation and run alone between windows, before any partition event
+// at the same time.
+class ParallelEngine {
+   public:
+    ParallelEngine(Context& global, const std::vector<std::unique_ptr<Context>>& partitions, Time lookahead,
+                   Time end);
+
+    ~ParallelEngine();
+
+    // Run until all events up to end have been processed, or stopped is set.
+    void run(const bool& stopped);
+
+   private:
+    void worker(size_t idx);
+
+    // Have every worker run its partition up to limit (exclusive) and wait for them to finish.
+    void run_window(Time limit);
+
+    Context& _global;
+    const std::vector<std::unique_ptr<Context>>& _partitions;
+    const Time _lookahead;
+    const Time _end;
+    PartitionedOutput _output;
+
+    std::vector<std::thread> _workers;
+    std::mutex _lock;
+    std::condition_variable _start;
+    std::condition_variable _done;
+    uint64_t _generation;  // Bumped to start a window.
+    size_t _pending;       // Workers still running the current window.
+    Time _limit;
+    bool _quit;
+
+    uint64_t _windows;
+    uint64_t _globalSteps;
+};
+
+// Optimistic (Time Warp) engine. Partitions execute events as soon as they have them, without waiting
+// for each other, and roll back when an event shows up late (see Context::speculate). Global events
+// still see the whole simulation at once: partitions speculate up to the next one, and run it once
+// all of them are done (quiescent). In between, GVT (the earliest time any partition could still be
+// rolled back to) is computed every GVT_INTERVAL of wall time, to free history and write out output.
+// Partitions do not run more than window ahead of the slowest busy one, which bounds rollback depth.
+class TimeWarpEngine {
+   public:
+    TimeWarpEngine(Context& global, const std::vector<std::unique_ptr<Context>>& partitions,
+                   size_t checkpointInterval, Time window, Time end);
+
+    ~TimeWarpEngine();
+
+    void run(const bool& stopped);
+
+   private:
+    static const int GVT_INTERVAL_MS = 50;
+
+    void worker(size_t idx);
+
+    // Speculate up to limit (exclusive) until every partition is done.
+    void run_epoch(Time limit);
+
+    // Pause every worker, fossil collect up to GVT and resume.
+    void collect();
+
+    // Wake workers waiting for messages, so that they look at the flags below.
+    void wake_all();
+
+    // Whether partition idx is too far ahead of the others to run an event at next.
+    bool throttled(size_t idx, Time next) const;
+
+    Context& _global;
+    const std::vector<std::unique_ptr<Context>>& _partitions;
+    const Time _window;
+    const Time _end;
+    PartitionedOutput _output;
+
+    std::vector<std::thread> _workers;
+    std::mutex _lock;
+    std::condition_variable _start;
+    std::condition_variable _done;
+    std::condition_variable _resume;
+    uint64_t _generation;
+    Time _limit;
+    size_t _running;  // Workers in the current epoch.
+    size_t _parked;   // Workers paused for GVT.
+    std::atomic<bool> _pause;
+    std::atomic<bool> _epochDone;
+    bool _quit;
+    // Partitions with work to do plus messages not yet received. Zero once all partitions are done.
+    std::atomic<int64_t> _busy;
+    // Next event time of each partition, as last seen by its worker.
+    std::unique_ptr<std::atomic<Time>[]> _clocks;
+
+    uint64_t _epochs;
+    uint64_t _gvts;
+    std::atomic<uint64_t> _throttled;
+};
+}
+#endif
@@ -0,0 +1,124 @@
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#ifndef __POOL_ALLOCATOR_H__
+#define __POOL_ALLOCATOR_H__
+
+namespace PILO {
+// Counts heap allocations made through the allocators below, i.e., by event queue storage.
+struct AllocationCounter {
+    static std::atomic<uint64_t> allocations;
+};
+
+// std::allocator that counts every allocation, for containers that should stop allocating once
+// they have grown to their working size.
+template <typename T>
+class CountingAllocator : public std::allocator<T> {
+   public:
+    template <typename U>
+    struct rebind {
+        typedef CountingAllocator<U> other;
+    };
+
+    CountingAllocator() {}
+
+    template <typename U>
+    CountingAllocator(const CountingAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        AllocationCounter::allocations.fetch_add(1, std::memory_order_relaxed);
+        return std::allocator<T>::allocate(n);
+    }
+};
+
+// Stateless allocator for node based containers (e.g., the Fibonacci heap) that recycles single
+// objects through a per-thread free list. Fresh objects are carved out of SLAB sized chunks, so
+// once a run reaches its steady state population nothing is allocated. Slabs are never returned
+// to the system: a node may be freed on a different thread than the one that allocated it.
+template <typename T>
+class PoolAllocator {
+   public:
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+
+    template <typename U>
+    struct rebind {
+        typedef PoolAllocator<U> other;
+    };
+
+    static const size_t SLAB = 256;
+
+    PoolAllocator() {}
+
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        if (n != 1) {
+            AllocationCounter::allocations.fetch_add(1, std::memory_order_relaxed);
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+        if (!_free) {
+            refill();
+        }
+        Slot* slot = _free;
+        _free = slot->next;
+        return reinterpret_cast<T*>(slot);
+    }
+
+    void deallocate(T* p, size_t n) {
+        if (n != 1) {
+            ::operator delete(p);
+            return;
+        }
+        Slot* slot = reinterpret_cast<Slot*>(p);
+        slot->next = _free;
+        _free = slot;
+    }
+
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args) {
+        new (p) U(std::forward<Args>(args)...);
+    }
+
+    template <typename U>
+    void destroy(U* p) {
+        p->~U();
+    }
+
+    size_t max_size() const { return size_t(-1) / sizeof(T); }
+
+    bool operator==(const PoolAllocator&) const { return true; }
+    bool operator!=(const PoolAllocator&) const { return false; }
+
+   private:
+    union Slot {
+        Slot* next;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type value;
+    };
+
+    static void refill() {
+        Slot* slab = static_cast<Slot*>(::operator new(SLAB * sizeof(Slot)));
+        AllocationCounter::allocations.fetch_add(1, std::memory_order_relaxed);
+        for (size_t i = 0; i < SLAB; i++) {
+            slab[i].next = (i + 1 < SLAB ? &slab[i + 1] : _free);
+        }
+        _free = slab;
+    }
+
+    static thread_local Slot* _free;
+};
+
+template <typename T>
+thread_local typename PoolAllocator<T>::Slot* PoolAllocator<T>::_free = nullptr;
+}
+#endif
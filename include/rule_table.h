@@ -0,0 +1,50 @@
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "ids.h"
+
+#ifndef __RULE_TABLE_H__
+#define __RULE_TABLE_H__
+namespace PILO {
+// A controller's copy of a switch's rules: flow to link, kept as one vector sorted by flow. Tables are
+// mostly rebuilt whole and compared against the previous one, which is a sort and a merge over contiguous
+// memory; single rule updates shift the rules after them, which is cheap at the sizes switch tables have.
+class RuleTable {
+   public:
+    typedef std::pair<FlowId, LinkId> Rule;
+    typedef std::vector<Rule>::const_iterator iterator;
+
+    size_t size() const { return _rules.size(); }
+    bool empty() const { return _rules.empty(); }
+    void clear() { _rules.clear(); }
+
+    iterator begin() const { return _rules.begin(); }
+    iterator end() const { return _rules.end(); }
+
+    // The link flow is forwarded on, Ids::NONE if it has no rule.
+    LinkId find(FlowId flow) const;
+
+    // Point flow at link (remove its rule if link is Ids::NONE), returns the link it had (Ids::NONE if none).
+    LinkId set(FlowId flow, LinkId link);
+
+    // Replace the table with rules, which may come in any order. Of rules for the same flow, the last
+    // one counts.
+    void assign(std::vector<Rule>&& rules);
+
+    // Keep only the rules keep returns true for.
+    template <typename Keep>
+    void filter(Keep keep) {
+        size_t out = 0;
+        for (auto& rule : _rules) {
+            if (keep(rule)) {
+                _rules[out++] = rule;
+            }
+        }
+        _rules.resize(out);
+    }
+
+   private:
+    std::vector<Rule> _rules;
+};
+}
+#endif
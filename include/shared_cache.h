@@ -0,0 +1,91 @@
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <boost/functional/hash.hpp>
+
+#ifndef __SHARED_CACHE_H__
+#define __SHARED_CACHE_H__
+namespace PILO {
+// Values computed from a key (a canonical encoding of everything they depend on), shared by every thread.
+// Keys are found by their digest and compared in full, so a hit is exactly what computing would give. Only
+// the most recently used capacity keys are kept, which is all it takes when most lookups are for a few views
+// many nodes share.
+template <typename Value>
+class SharedCache {
+   public:
+    typedef std::vector<uint64_t> Key;
+
+    explicit SharedCache(size_t capacity = 0) : _capacity(capacity), _clock(0), _hits(0), _misses(0) {}
+
+    // 0 turns the cache off.
+    void set_capacity(size_t capacity) {
+        std::lock_guard<std::mutex> guard(_lock);
+        _capacity = capacity;
+        _entries.clear();
+    }
+
+    bool enabled() const { return _capacity > 0; }
+
+    // The value for key, nullptr if it is not cached.
+    std::shared_ptr<const Value> find(const Key& key) {
+        size_t digest = boost::hash_range(key.begin(), key.end());
+        std::lock_guard<std::mutex> guard(_lock);
+        for (auto& entry : _entries) {
+            if (entry.digest == digest && entry.key == key) {
+                entry.used = ++_clock;
+                _hits++;
+                return entry.value;
+            }
+        }
+        _misses++;
+        return nullptr;
+    }
+
+    // Cache value for key, in place of the least recently used key if the cache is full.
+    void insert(const Key& key, std::shared_ptr<const Value> value) {
+        size_t digest = boost::hash_range(key.begin(), key.end());
+        std::lock_guard<std::mutex> guard(_lock);
+        if (_capacity == 0) {
+            return;
+        }
+        Entry* slot = nullptr;
+        for (auto& entry : _entries) {
+            if (entry.digest == digest && entry.key == key) {
+                return;  // Computed concurrently.
+            }
+            if (!slot || entry.used < slot->used) {
+                slot = &entry;
+            }
+        }
+        if (_entries.size() < _capacity) {
+            _entries.emplace_back();
+            slot = &_entries.back();
+        }
+        slot->digest = digest;
+        slot->key = key;
+        slot->value = std::move(value);
+        slot->used = ++_clock;
+    }
+
+    uint64_t hits() const { return _hits; }
+    uint64_t misses() const { return _misses; }
+
+   private:
+    struct Entry {
+        size_t digest;
+        Key key;
+        std::shared_ptr<const Value> value;
+        uint64_t used;
+    };
+
+    std::mutex _lock;
+    size_t _capacity;
+    std::vector<Entry> _entries;
+    uint64_t _clock;
+    std::atomic<uint64_t> _hits;
+    std::atomic<uint64_t> _misses;
+};
+}
+#endif
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <limits>
 #include <list>
 #include <unordered_map>
 #include <unordered_set>
@@ -7,8 +8,8 @@
 #include <boost/algorithm/string.hpp>
 #include <boost/random.hpp>
 #include <yaml-cpp/yaml.h>
-#include <igraph/igraph.h>  // Graph processing
 #include "context.h"
+#include "graph.h"
 #include "link.h"
 #include "node.h"
 #include "distributions.h"
@@ -17,6 +18,7 @@
 #include "controller.h"
 #include "te_controller.h"
 #include "coord_controller.h"
+#include "parallel.h"
 
 #ifndef __SIMULATION_H__
 #define __SIMULATION_H__
@@ -26,15 +28,24 @@ namespace PILO {
 class Simulation {
    public:
     Simulation(const uint32_t seed, const std::string& configuration, const std::string& topology, bool version,
-            const Time endTime, const Time refresh, const Time gossip, const BPS bw, const int limit,
-               std::unique_ptr<Distribution<bool>>&& drop, std::unique_ptr<Distribution<bool>>&& cdrop);
+               const Time endTime, const EventQueue::Type queue, const Time refresh, const Time gossip, const BPS bw,
+               const int limit, std::unique_ptr<Distribution<bool>>&& drop, std::unique_ptr<Distribution<bool>>&& cdrop,
+               const size_t partitions = 0, const bool optimistic = false, const size_t checkpointInterval = 1024,
+               const Time window = std::numeric_limits<Time>::infinity());
 
     // Run to completion
     inline void run() {
+        if (!_partitions.empty()) {
+            run_parallel();
+            return;
+        }
         while (!_stopped && _context.next())
             ;
     }
 
+    // Why this simulation cannot be run partitioned, empty if it can (or is not partitioned).
+    std::string check_partitioning() const;
+
     // Return a random link
     inline std::shared_ptr<PILO::Link> random_link() { return std::next(std::begin(_links), _linkRng.next())->second; }
 
@@ -96,16 +107,19 @@ class Simulation {
     
     void dump_table_changes() const;
 
+    // Event and packet counts, over all partitions.
+    void dump_event_stats() const;
+
     void reset_links();
 
     typedef std::unordered_map<std::string, std::shared_ptr<PILO::Node>> node_map;
     typedef std::unordered_map<std::string, std::shared_ptr<PILO::Link>> link_map;
     typedef std::unordered_map<std::string, std::shared_ptr<PILO::Switch>> switch_map;
     typedef std::unordered_map<std::string, std::shared_ptr<PILO::Controller>> controller_map;
-    typedef std::unordered_map<std::string, std::string> node_switch_map;
+    typedef std::vector<NodeId> node_switch_map;  // Indexed by node, Ids::ANY if not attached to a switch.
     typedef std::unordered_set<std::string> link_set;
 
-    virtual ~Simulation() { igraph_destroy(&_graph); }
+    virtual ~Simulation() {}
 
     inline boost::mt19937& rng() { return _rng; }
 
@@ -118,6 +132,19 @@ class Simulation {
     inline bool remove_host_graph_link(const std::shared_ptr<PILO::Link>& link);
     double compute_controller_diameter();
 
+    // Split nodes into partitions: switches are cut into connected chunks, hosts go with their switch
+    // and controllers are spread round robin.
+    std::unordered_map<std::string, size_t> partition_nodes(const size_t partitions) const;
+
+    // Context a node should be simulated by.
+    Context& context_for(const std::string& node);
+
+    // Give links and controllers private random streams and compute the lookahead. When optimistic,
+    // also tell each partition how to save and restore the state it owns.
+    void setup_partitions();
+
+    void run_parallel();
+
     node_map populate_nodes(const Time refresh, const Time gossip, const bool version);
 
     link_map populate_links(BPS bw);
@@ -132,13 +159,29 @@ class Simulation {
     std::unique_ptr<Distribution<bool>> _dropRng;
     std::unique_ptr<Distribution<bool>> _cdropRng;
 
-    igraph_t _graph;
+    Graph _graph;  // Switch links that are up.
+    uint64_t _topologyEpoch;  // Bumped whenever a link in _graph or a host link changes state.
+    // Hop counts from switches with hosts for check_routes, as of _distanceEpoch. _distanceRow is indexed by
+    // vertex, the row of _distances with hop counts from it (-1 if none).
+    mutable std::vector<std::vector<uint32_t>> _distances;
+    mutable std::vector<int32_t> _distanceRow;
+    mutable uint64_t _distanceEpoch;
 
     const YAML::Node _configuration;
     const YAML::Node _topology;
 
     Distribution<PILO::Time>* _latency;
     Distribution<PILO::Time>* _hlatency;
+    // Per partition contexts, empty unless running partitioned. Global events stay in _context.
+    std::vector<std::unique_ptr<Context>> _partitions;
+    std::unordered_map<std::string, size_t> _partitionOf;
+    // Random streams (and the distributions drawing from them) owned by individual nodes.
+    std::vector<std::unique_ptr<boost::mt19937>> _nodeRngs;
+    std::vector<std::unique_ptr<Distribution<bool>>> _nodeDrops;
+    Time _lookahead;
+    const bool _optimistic;
+    const size_t _checkpointInterval;
+    const Time _window;
     Controller::vertex_map _vmap;
     Controller::inv_vertex_map _ivmap;
     node_switch_map _nsmap;
@@ -150,7 +193,7 @@ class Simulation {
     link_set _controllerLinks;
     link_set _swControllerLinks;
     link_set _switchAndControllerLinks;
-    link_set _liveLinks;
+    std::vector<bool> _liveLinks;  // Indexed by link.
     link_map _links;
     UniformIntDistribution _cLinkRng;
     UniformIntDistribution _swLinkRng;
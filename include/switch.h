@@ -1,7 +1,10 @@
 #include "node.h"
 #include "link.h"
+#include "flow_table.h"
+#include <deque>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 #ifndef __SWITCH_H__
 #define __SWITCH_H__
 // Equivalent to LSSwitch in Python
@@ -12,7 +15,7 @@ class Switch : public Node {
    public:
     Switch(Context& context, const std::string& name, const bool version);
 
-    virtual void receive(std::shared_ptr<Packet> packet, Link* link);
+    virtual void receive(PacketPtr packet, Link* link);
 
     virtual void notify_link_existence(Link* link);
 
@@ -24,18 +27,66 @@ class Switch : public Node {
 
     virtual void silent_link_down(Link*);
 
-    void install_flow_table(const Packet::flowtable& table);
+    void install_flow_table(const std::vector<Packet::Rule>& table);
 
-    void install_flow_table(const Packet::flowtable& table, const std::unordered_set<std::string>& remove);
+    void install_flow_table(const std::vector<Packet::Rule>& table, const std::vector<FlowId>& remove);
+
+    // The link packets of flow are forwarded on: the flow's rule, else its destination's, else the default
+    // route. Ids::NONE if no rule matches.
+    LinkId lookup(FlowId flow) const;
+
+    virtual std::shared_ptr<State> save_state() const;
+
+    virtual void restore_state(const State& state);
 
    private:
-    bool install_flow_table_internal(const Packet::flowtable& table);
-    std::unordered_map<std::string, Link::State> _linkState;
-    std::unordered_map<std::string, int32_t> _linkStats;  // Assume < 2^31 paths through a link.
+    // A rule change, link is Ids::NONE for removals. version is the table version it was made in.
+    struct Change {
+        uint64_t version;
+        FlowId flow;
+        LinkId link;
+    };
+
+    // The journal keeps at least this many changes, and otherwise no more than the table has rules.
+    static const size_t JOURNAL_MIN = 64;
+
+    struct SwitchState : State {
+        std::vector<Link::State> linkState;
+        std::vector<int32_t> linkStats;
+        std::unordered_set<uint64_t> filter;
+        FlowTable forwardingTable;
+        size_t tableHash;
+        std::deque<Change> journal;
+        uint64_t journalStart;
+        uint64_t version;
+        uint64_t entries;
+        std::unordered_map<NodeId, uint64_t> patches;
+    };
+
+    bool install_flow_table_internal(const std::vector<Packet::Rule>& table);
+    // Move to the next table version, dropping changes the journal no longer has room for.
+    void next_version();
+    // The rules that changed since version since, as of now. False if the journal does not go back that
+    // far, or the changes are no smaller than the table.
+    bool changes_since(uint64_t since, Packet::Rules& rules) const;
+    // The port packets of flow leave on (see lookup), FlowTable::NONE if no rule matches.
+    FlowTable::Port output(FlowId flow) const;
+    // Point flow at link, or remove its rule if link is Ids::NONE, keeping stats, hash and journal up to date.
+    // Returns whether the table changed.
+    bool set_rule(FlowId flow, LinkId link);
+    // Indexed by port.
+    std::vector<Link::State> _linkState;
+    std::vector<int32_t> _linkStats;  // Assume < 2^31 paths through a link.
     std::unordered_set<uint64_t> _filter;
-    Packet::flowtable _forwardingTable;
+    FlowTable _forwardingTable;  // Flow to port.
+    size_t _tableHash;  // Controller::rule_hash of every rule, xored.
+    std::deque<Change> _journal;  // Oldest first.
+    uint64_t _journalStart;  // The journal has every change made after this version.
     uint64_t _version;  // A way to track the number of routing table changes.
     uint64_t _entries;  // Number of routing table entries
+    // Indexed by controller, the sequence number of the last rule change applied. Flooded copies arrive
+    // more than once and out of order, an older patch must not undo a newer one.
+    std::unordered_map<NodeId, uint64_t> _patches;
     bool _filter_version;
 };
 }
@@ -0,0 +1,162 @@
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#ifndef __TASK_H__
+#define __TASK_H__
+
+namespace PILO {
+typedef double Time;
+
+// Callable run by the event loop, taking the current time. Behaves like std::function<void(Time)>,
+// except that closures up to CAPACITY bytes (e.g., a this pointer plus a PacketPtr) are
+// stored inline rather than on the heap, so scheduling an event does not allocate. Larger closures
+// still work but are boxed, and counted so that we notice.
+class InlineTask {
+   public:
+    static const size_t CAPACITY = 32;
+
+    InlineTask() : _ops(nullptr) {}
+
+    InlineTask(std::nullptr_t) : _ops(nullptr) {}
+
+    template <typename F,
+              typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, InlineTask>::value>::type>
+    InlineTask(F&& f) {
+        typedef typename std::decay<F>::type Fn;
+        construct<Fn>(std::forward<F>(f), std::integral_constant<bool, fits<Fn>()>());
+    }
+
+    InlineTask(InlineTask&& other) noexcept : _ops(other._ops) {
+        if (_ops) {
+            _ops->move(&_storage, &other._storage);
+            other._ops = nullptr;
+        }
+    }
+
+    InlineTask(const InlineTask& other) : _ops(other._ops) {
+        if (_ops) {
+            _ops->copy(&_storage, &other._storage);
+        }
+    }
+
+    InlineTask& operator=(InlineTask&& other) noexcept {
+        if (this != &other) {
+            reset();
+            _ops = other._ops;
+            if (_ops) {
+                _ops->move(&_storage, &other._storage);
+                other._ops = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    InlineTask& operator=(const InlineTask& other) {
+        if (this != &other) {
+            InlineTask copy(other);
+            *this = std::move(copy);
+        }
+        return *this;
+    }
+
+    ~InlineTask() { reset(); }
+
+    inline void operator()(Time time) {
+        assert(_ops);
+        _ops->invoke(&_storage, time);
+    }
+
+    explicit operator bool() const { return _ops != nullptr; }
+
+    // Number of closures that were too large to store inline, since the process started.
+    static uint64_t heap_allocations() { return _heapAllocations.load(std::memory_order_relaxed); }
+
+   private:
+    typedef typename std::aligned_storage<CAPACITY, alignof(std::max_align_t)>::type Storage;
+
+    // Per closure type operations, one static instance per type.
+    struct Ops {
+        void (*invoke)(Storage*, Time);
+        void (*move)(Storage*, Storage*);
+        void (*copy)(Storage*, const Storage*);
+        void (*destroy)(Storage*);
+    };
+
+    template <typename Fn>
+    static constexpr bool fits() {
+        return sizeof(Fn) <= CAPACITY && alignof(Fn) <= alignof(Storage) &&
+               std::is_nothrow_move_constructible<Fn>::value;
+    }
+
+    // Closure stored in place.
+    template <typename Fn>
+    struct Inline {
+        static Fn* get(Storage* s) { return reinterpret_cast<Fn*>(s); }
+        static const Fn* get(const Storage* s) { return reinterpret_cast<const Fn*>(s); }
+        static void invoke(Storage* s, Time time) { (*get(s))(time); }
+        static void move(Storage* dst, Storage* src) {
+            new (dst) Fn(std::move(*get(src)));
+            get(src)->~Fn();
+        }
+        static void copy(Storage* dst, const Storage* src) { new (dst) Fn(*get(src)); }
+        static void destroy(Storage* s) { get(s)->~Fn(); }
+        static const Ops ops;
+    };
+
+    // Closure too big to fit, storage holds a pointer to it.
+    template <typename Fn>
+    struct Boxed {
+        static Fn*& get(Storage* s) { return *reinterpret_cast<Fn**>(s); }
+        static Fn* get(const Storage* s) { return *reinterpret_cast<Fn* const*>(s); }
+        static void invoke(Storage* s, Time time) { (*get(s))(time); }
+        static void move(Storage* dst, Storage* src) {
+            new (dst) Fn*(get(src));
+            get(src) = nullptr;
+        }
+        static void copy(Storage* dst, const Storage* src) {
+            _heapAllocations.fetch_add(1, std::memory_order_relaxed);
+            new (dst) Fn*(new Fn(*get(src)));
+        }
+        static void destroy(Storage* s) { delete get(s); }
+        static const Ops ops;
+    };
+
+    template <typename Fn, typename F>
+    void construct(F&& f, std::true_type) {
+        new (&_storage) Fn(std::forward<F>(f));
+        _ops = &Inline<Fn>::ops;
+    }
+
+    template <typename Fn, typename F>
+    void construct(F&& f, std::false_type) {
+        _heapAllocations.fetch_add(1, std::memory_order_relaxed);
+        new (&_storage) Fn*(new Fn(std::forward<F>(f)));
+        _ops = &Boxed<Fn>::ops;
+    }
+
+    inline void reset() {
+        if (_ops) {
+            _ops->destroy(&_storage);
+            _ops = nullptr;
+        }
+    }
+
+    const Ops* _ops;
+    Storage _storage;
+
+    static std::atomic<uint64_t> _heapAllocations;
+};
+
+template <typename Fn>
+const InlineTask::Ops InlineTask::Inline<Fn>::ops = {&Inline<Fn>::invoke, &Inline<Fn>::move, &Inline<Fn>::copy,
+                                                     &Inline<Fn>::destroy};
+
+template <typename Fn>
+const InlineTask::Ops InlineTask::Boxed<Fn>::ops = {&Boxed<Fn>::invoke, &Boxed<Fn>::move, &Boxed<Fn>::copy,
+                                                    &Boxed<Fn>::destroy};
+}
+#endif
@@ -2,13 +2,14 @@
 #include "link.h"
 #include "packet.h"
 #include "controller.h"
+#include <chrono>
+#include <set>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 #include <forward_list>
 #include <memory>
 #include <boost/algorithm/string.hpp>
-#include <igraph/igraph.h>  // Graph processing (for the masses).
 #ifndef __TE_CONTROLLER_H__
 #define __TE_CONTROLLER_H__
 
@@ -28,13 +29,100 @@ class TeController : public Controller {
     TeController(Context& context, const std::string& name, const Time referesh, const Time gossip, const int max_load,
                  Distribution<bool>* drop);
 
-    // igraph is not C++, and allocates memory. So be nice and remove things.
     virtual ~TeController() {}
 
+    // Whether link changes (forwarding per flow) only move the flows they affect, see update_paths.
+    static void set_incremental(bool incremental);
+
+    // Forwarding per flow, place flows on the first of k edge disjoint shortest paths between their switches
+    // with room left, rather than on a shortest path around full edges. 0 (the default) does the latter.
+    static void set_candidates(size_t k);
+
+    // Flows placed and rejected over all rounds of admission control, and the wall time they took.
+    struct TeStats {
+        uint64_t rounds = 0;
+        uint64_t incremental = 0;  // Rounds that only admitted flows again, see update_paths.
+        uint64_t admitted = 0;
+        uint64_t rejected = 0;
+        double seconds = 0;
+    };
+
+    const TeStats& te_stats() const { return _te; }
+
+    virtual std::shared_ptr<State> save_state() const;
+
+    virtual void restore_state(const State& state);
+
    protected:
+    // Where an admitted flow was placed: the edges (graph slots) it loads, and its rules (switch and link).
+    struct Placement {
+        std::vector<Graph::Slot> slots;
+        std::vector<std::pair<NodeId, LinkId>> rules;
+    };
+
+    struct TeControllerState : ControllerState {
+        std::unordered_map<FlowId, Placement> placements;
+        std::set<FlowId> rejected;
+        std::vector<int> load;
+        std::vector<std::vector<FlowId>> edgeFlows;
+        bool treesValid;
+        std::vector<LinkId> pendingLinks;
+        TeStats te;
+    };
+
+    // A candidate path between two switches: its vertices and the edges (slots) between them.
+    struct Candidate {
+        std::vector<VertexId> path;
+        std::vector<Graph::Slot> slots;
+    };
+
+    static bool _incremental;
+    static size_t _candidates;
+
     const int _maxLoad;
     // Compute paths, return a diff of what needs to be fixed.
     virtual std::pair<flowtable_db, deleted_entries> compute_paths();
+
+    // Forwarding per flow, only flows across links that went down are taken off their paths and admitted
+    // again, and links coming up only give rejected flows another try. Flows keep their paths otherwise, so
+    // these need not be the paths a full computation would pick.
+    virtual std::pair<flowtable_db, deleted_entries> update_paths();
+
+    // With placements kept (see update_paths), the rules placed at sw and those between its hosts.
+    virtual void switch_table(NodeId sw, RuleTable& table) const;
+
+    // Take flow off the edges it was placed on and remove its rules.
+    void release(FlowId flow, original_rules& original);
+
+    // Place flow from a switch to another on a shortest path over edges below _maxLoad (or the first candidate
+    // path that fits), returns false if there is none. full marks the edges at _maxLoad, parent is the BFS
+    // from source over them (rebuilt when stale).
+    bool admit(FlowId flow, NodeId source, NodeId destination, std::vector<char>& full,
+               std::vector<VertexId>& parent, VertexId& parentRoot, original_rules& original);
+
+    // Place flow along path (of switches, ending at the destination host's), returns whether an edge filled up.
+    bool place(FlowId flow, const std::vector<VertexId>& path, original_rules& original);
+
+    // Up to _candidates edge disjoint shortest paths from v0_idx to v1_idx, shortest first. Computed when first
+    // asked for and kept until the graph changes.
+    const std::vector<Candidate>& candidate_paths(VertexId v0_idx, VertexId v1_idx);
+
+    // The first of candidates with every edge below _maxLoad, nullptr if none is.
+    const Candidate* first_fit(const std::vector<Candidate>& candidates, const std::vector<int>& load) const;
+
+    // Print a round of admission control and add it to the statistics.
+    void report(bool incremental, uint64_t admitted, uint64_t rejected,
+                std::chrono::steady_clock::time_point start);
+
+    // As of the last computation, forwarding per flow. Flows between hosts at the same switch are left out.
+    std::unordered_map<FlowId, Placement> _placements;  // Admitted flows.
+    std::set<FlowId> _rejected;
+    std::vector<int> _load;                         // Indexed by slot, admitted flows across the edge.
+    std::vector<std::vector<FlowId>> _edgeFlows;    // Indexed by slot, the flows placed across the edge.
+
+    std::unordered_map<uint64_t, std::vector<Candidate>> _candidatePaths;  // Keyed by both vertices.
+    std::vector<char> _candidateState;  // Graph state the candidates were found on.
+    TeStats _te;
 };
 }
 #endif
@@ -0,0 +1,49 @@
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+namespace PILO {
+// Fixed set of helper threads for data parallel loops. Any number of threads (e.g., one per partition)
+// may call parallel_for at once; callers work on their own loop while they wait, so a pool without
+// helpers simply runs loops in the calling thread.
+class ThreadPool {
+   public:
+    explicit ThreadPool(size_t helpers);
+
+    ~ThreadPool();
+
+    // Call body(i) for every i in [0, n), in no particular order, and return once all calls are done.
+    void parallel_for(size_t n, const std::function<void(size_t)>& body);
+
+    size_t helpers() const { return _threads.size(); }
+
+   private:
+    struct Job {
+        const std::function<void(size_t)>* body;
+        size_t n;
+        std::atomic<size_t> next;
+        size_t done;     // Under _lock.
+        size_t workers;  // Helpers looking at the job, under _lock.
+    };
+
+    void helper();
+
+    // Run iterations of job until there are none left, returns how many ran.
+    static size_t run(Job& job);
+
+    std::vector<std::thread> _threads;
+    std::mutex _lock;
+    std::condition_variable _wake;
+    std::condition_variable _finished;
+    std::deque<Job*> _jobs;  // Jobs with iterations left to hand out.
+    bool _stop;
+};
+}
+#endif
@@ -0,0 +1,27 @@
+# Run the same simulation with --parallel 1..N, check that every run reports the same results as
+# the single partition run and print the speedup.
+# Usage: parallel_speedup.py <pilo> <max partitions> <pilo arguments...>
+import re
+import subprocess
+import sys
+
+wall_re = re.compile(r"Wall time ([0-9.e+-]+)")
+
+def run(pilo, partitions, args):
+    out = subprocess.check_output([pilo, "--parallel", str(partitions)] + args, universal_newlines=True)
+    results = [l for l in out.splitlines() if l.startswith(" !  ") or " bw " in l]
+    wall = float(wall_re.search(out).group(1))
+    return results, wall
+
+pilo = sys.argv[1]
+max_partitions = int(sys.argv[2])
+args = sys.argv[3:]
+reference, base = run(pilo, 1, args)
+print("partitions wall speedup")
+print("1 %f 1.0" % base)
+for partitions in range(2, max_partitions + 1):
+    results, wall = run(pilo, partitions, args)
+    if results != reference:
+        print("Results differ from the single partition run with %d partitions" % partitions)
+        sys.exit(1)
+    print("%d %f %f" % (partitions, wall, base / wall))
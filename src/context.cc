@@ -1,46 +1,387 @@
+#include <algorithm>
+#include <cassert>
 #include <iostream>
+#include <iomanip>
+#include <limits>
 #include "context.h"
 namespace PILO {
-Context::Context(Time end) : _time(0.0), _end(end), _lastMajor(0) {}
+Context::Context(Time end, EventQueue::Type queue)
+    : _queue(EventQueue::make(queue)),
+      _seq(0),
+      _scheduled(0),
+      _attributed(false),
+      _inbox(),
+      _incoming(),
+      _speculative(false),
+      _coasting(false),
+      _busy(NULL),
+      _output(NULL),
+      _outputBase(0),
+      _checkpointInterval(0),
+      _tracked(),
+      _touched(),
+      _history(),
+      _historyBase(0),
+      _checkpoints(),
+      _current(NULL),
+      _scratch(),
+      _cancelled(),
+      _stats{0, 0, 0, 0, 0, 0},
+      _time(0.0),
+      _end(end),
+      _lastMajor(0),
+      _trace(NULL) {}
 
 Time Context::get_time() const { return _time; }
 
 void Context::set_time(Time time) { _time = time; }
 
 bool Context::next() {
-    if (_queue.empty() || _time > _end) {
+    if (_queue->empty() || _time > _end) {
         return false;
     }
-    Time time;
-    std::function<void(Time)> task;
-    std::tie(time, task) = _queue.top();
-    _queue.pop();
-    _time = time;
+    Event event = _queue->pop();
+    _time = event.time;
+    if (_trace) {
+        *_trace << "p\n";
+    }
     if ((uint64_t)(_time) / 100 > _lastMajor) {
         _lastMajor = (uint64_t)(_time) / 100;
         std::cout << "Now executing for " << _time << std::endl;
     }
-    task(_time);
-    return (!_queue.empty() && _time <= _end);
+    event.task(_time);
+    return (!_queue->empty() && _time <= _end);
 }
 
-void Context::schedule(Time delta, std::function<void(Time)> task) {
-    _queue.emplace(std::make_tuple(_time + delta, task));
+void Context::enqueue(Time time, EventSource* source, Task&& task) {
+    uint64_t seq = (_attributed && source ? ((uint64_t)source->id << SOURCE_SHIFT) | source->count++ : _seq++);
+    if (_coasting) {
+        // Still queued from when the event was first executed.
+        return;
+    }
+    if (_trace) {
+        *_trace << "s " << time << "\n";
+    }
+    _scheduled++;
+    if (_current) {
+        _current->sent.emplace_back(this, std::make_pair(time, seq));
+    }
+    _queue->push(Event{time, seq, std::move(task)});
 }
 
-void Context::scheduleAbsolute(Time time, std::function<void(Time)> task) {
+void Context::schedule(Time delta, Task task) { enqueue(_time + delta, NULL, std::move(task)); }
+
+void Context::scheduleAbsolute(Time time, Task task) {
     //assert(time >= _time);
     if (time >= _time) {
-        _queue.emplace(std::make_tuple(time, task));
+        enqueue(time, NULL, std::move(task));
     } else {
         // OK let us just run it.
-        _queue.emplace(std::make_tuple(_time, task));
+        enqueue(_time, NULL, std::move(task));
+    }
+}
+
+void Context::schedule(Time delta, EventSource& source, Task task) {
+    enqueue(_time + delta, &source, std::move(task));
+}
+
+void Context::scheduleAbsolute(Time time, EventSource& source, Task task) {
+    enqueue(std::max(time, _time), &source, std::move(task));
+}
+
+void Context::send(Context& target, Time time, EventSource& source, Task task) {
+    if (&target == this) {
+        scheduleAbsolute(time, source, std::move(task));
+        return;
+    }
+    assert(time >= _time);
+    uint64_t seq = ((uint64_t)source.id << SOURCE_SHIFT) | source.count++;
+    if (_coasting) {
+        return;
+    }
+    _scheduled++;
+    if (_current) {
+        _current->sent.emplace_back(&target, std::make_pair(time, seq));
+    }
+    post(target, Event{time, seq, std::move(task)});
+}
+
+void Context::post(Context& target, Event&& event) {
+    if (_busy) {
+        _busy->fetch_add(1);
+    }
+    {
+        std::lock_guard<std::mutex> guard(target._inboxLock);
+        target._inbox.push_back(std::move(event));
+    }
+    if (_speculative) {
+        target._inboxSignal.notify_one();
+    }
+}
+
+void Context::drain() {
+    {
+        std::lock_guard<std::mutex> guard(_inboxLock);
+        _incoming.swap(_inbox);
+    }
+    for (auto& event : _incoming) {
+        if (_trace) {
+            *_trace << "s " << event.time << "\n";
+        }
+        if (_speculative) {
+            if (!event.task) {
+                cancel(event.time, event.seq);
+                continue;
+            }
+            // Roll back to the first executed event that should have run after this one. Executed
+            // events are in time order, so only those at or after its time need to be looked at.
+            uint64_t position = _historyBase + _history.size();
+            for (size_t i = _history.size(); i-- > 0 && _history[i].event.time >= event.time;) {
+                if (EventCompare()(_history[i].event, event)) {
+                    position = _historyBase + i;
+                }
+            }
+            if (position < _historyBase + _history.size()) {
+                rollback(position);
+            }
+            // A sender that rolled back can send an event again with the (time, seq) it cancelled.
+            if (!_cancelled.empty() && _cancelled.count(std::make_pair(event.time, event.seq))) {
+                std::vector<std::pair<Time, uint64_t>> cancelled;
+                remove_pending(cancelled);
+            }
+        }
+        _queue->push(std::move(event));
+    }
+    if (_busy) {
+        _busy->fetch_sub(_incoming.size());
+    }
+    _incoming.clear();
+}
+
+void Context::track_state(uint32_t owner, StateSaver saver) {
+    _tracked.push_back(Tracked{owner, std::move(saver), nullptr});
+    if (owner >= _touched.size()) {
+        _touched.resize(owner + 1, true);
+    }
+}
+
+void Context::touch_all() { _touched.assign(_touched.size(), true); }
+
+void Context::speculate(std::string* output, std::atomic<int64_t>* busy, size_t checkpointInterval) {
+    _speculative = true;
+    _output = output;
+    _busy = busy;
+    _checkpointInterval = std::max<size_t>(1, checkpointInterval);
+}
+
+void Context::checkpoint() {
+    Checkpoint checkpoint{_historyBase + _history.size(), _time, {}};
+    checkpoint.restore.reserve(_tracked.size());
+    for (auto& tracked : _tracked) {
+        if (!tracked.restore || touched(tracked.owner)) {
+            tracked.restore = tracked.save();
+        }
+        checkpoint.restore.push_back(tracked.restore);
+    }
+    _touched.assign(_touched.size(), false);
+    _checkpoints.push_back(std::move(checkpoint));
+    _stats.checkpoints++;
+}
+
+void Context::commit() {
+    _historyBase += _history.size();
+    _history.clear();
+    _checkpoints.clear();
+    touch_all();
+    checkpoint();
+}
+
+void Context::step() {
+    if (_historyBase + _history.size() - _checkpoints.back().position >= _checkpointInterval) {
+        checkpoint();
+    }
+    _history.push_back(Processed{_queue->pop(), output_position(), {}});
+    drop_cancelled();
+    _current = &_history.back();
+    _time = _current->event.time;
+    touch((uint32_t)(_current->event.seq >> SOURCE_SHIFT));
+    if (_trace) {
+        *_trace << "p\n";
+    }
+    // Keep the original, it is executed again when coasting forward.
+    Task task = _current->event.task;
+    task(_time);
+    _current = NULL;
+    _stats.executed++;
+}
+
+void Context::rollback(uint64_t position) {
+    size_t first = position - _historyBase;
+    assert(first < _history.size());
+    _stats.rollbacks++;
+    _stats.rolledBack += _history.size() - first;
+
+    // Cancel everything the undone events sent. Local events are either still pending, or were
+    // executed and are being undone too.
+    std::vector<std::pair<Time, uint64_t>> cancelled;
+    for (size_t i = first; i < _history.size(); i++) {
+        for (auto& sent : _history[i].sent) {
+            if (sent.first == this) {
+                cancelled.push_back(sent.second);
+            } else {
+                post(*sent.first, Event{sent.second.first, sent.second.second, Task()});
+                _stats.cancelled++;
+            }
+        }
+    }
+    std::sort(cancelled.begin(), cancelled.end());
+    for (size_t i = first; i < _history.size(); i++) {
+        Event& event = _history[i].event;
+        if (!std::binary_search(cancelled.begin(), cancelled.end(), std::make_pair(event.time, event.seq))) {
+            _queue->push(std::move(event));
+        }
+    }
+    remove_pending(cancelled);
+    size_t output = _history[first].output;
+    _history.erase(_history.begin() + first, _history.end());
+
+    // Restore the last checkpoint before position, and bring it up to date.
+    while (_checkpoints.back().position > position) {
+        _checkpoints.pop_back();
+    }
+    const Checkpoint& checkpoint = _checkpoints.back();
+    for (auto& restore : checkpoint.restore) {
+        restore();
+    }
+    touch_all();
+    _time = checkpoint.time;
+    _coasting = true;
+    for (size_t i = checkpoint.position - _historyBase; i < _history.size(); i++) {
+        Task task = _history[i].event.task;
+        _time = _history[i].event.time;
+        task(_time);
+        _stats.coasted++;
+    }
+    _coasting = false;
+    // Output is not suppressed while coasting, drop it along with that of the undone events.
+    _output->resize(output - _outputBase);
+}
+
+void Context::cancel(Time time, uint64_t seq) {
+    for (size_t i = _history.size(); i-- > 0 && _history[i].event.time >= time;) {
+        if (_history[i].event.time == time && _history[i].event.seq == seq) {
+            rollback(_historyBase + i);
+            break;
+        }
+    }
+    _cancelled.emplace(time, seq);
+    drop_cancelled();
+}
+
+void Context::remove_pending(std::vector<std::pair<Time, uint64_t>>& events) {
+    if (events.empty() && _cancelled.empty()) {
+        return;
+    }
+    _scratch.clear();
+    while (!_queue->empty()) {
+        _scratch.push_back(_queue->pop());
+    }
+    for (auto& event : _scratch) {
+        auto key = std::make_pair(event.time, event.seq);
+        if (!std::binary_search(events.begin(), events.end(), key) && !_cancelled.erase(key)) {
+            _queue->push(std::move(event));
+        }
+    }
+    _scratch.clear();
+    _cancelled.clear();
+}
+
+void Context::drop_cancelled() {
+    while (!_cancelled.empty() && !_queue->empty()) {
+        auto found = _cancelled.find(std::make_pair(_queue->top().time, _queue->top().seq));
+        if (found == _cancelled.end()) {
+            break;
+        }
+        _cancelled.erase(found);
+        _queue->pop();
+    }
+}
+
+void Context::fossil_collect(Time gvt, std::streambuf* out) {
+    size_t final = 0;
+    while (final < _history.size() && _history[final].event.time < gvt) {
+        final++;
+    }
+    // Keep the last checkpoint a rollback (to final or later) could need, and the history after it.
+    while (_checkpoints.size() > 1 && _checkpoints[1].position <= _historyBase + final) {
+        _checkpoints.pop_front();
+    }
+    size_t output = (final < _history.size() ? _history[final].output : output_position());
+    size_t drop = _checkpoints.front().position - _historyBase;
+    _history.erase(_history.begin(), _history.begin() + drop);
+    _historyBase += drop;
+    out->sputn(_output->data(), output - _outputBase);
+    _output->erase(0, output - _outputBase);
+    _outputBase = output;
+    // Nothing before gvt is pending any more, so neither are the cancelled events before it.
+    _cancelled.erase(_cancelled.begin(), _cancelled.lower_bound(std::make_pair(gvt, uint64_t(0))));
+}
+
+Time Context::inbox_time() {
+    std::lock_guard<std::mutex> guard(_inboxLock);
+    Time time = std::numeric_limits<Time>::infinity();
+    for (auto& event : _inbox) {
+        time = std::min(time, event.time);
+    }
+    return time;
+}
+
+bool Context::inbox_empty() {
+    std::lock_guard<std::mutex> guard(_inboxLock);
+    return _inbox.empty();
+}
+
+void Context::wait_for_messages(const std::function<bool()>& wake) {
+    std::unique_lock<std::mutex> guard(_inboxLock);
+    _inboxSignal.wait(guard, [&] { return !_inbox.empty() || wake(); });
+}
+
+void Context::notify() {
+    {
+        std::lock_guard<std::mutex> guard(_inboxLock);
+    }
+    _inboxSignal.notify_all();
+}
+
+Time Context::next_time() const {
+    return (_queue->empty() ? std::numeric_limits<Time>::infinity() : _queue->top().time);
+}
+
+void Context::run_until(Time limit) {
+    while (!_queue->empty() && _queue->top().time < limit) {
+        Event event = _queue->pop();
+        _time = event.time;
+        if (_trace) {
+            *_trace << "p\n";
+        }
+        event.task(_time);
     }
 }
 
 void Context::reset() {
-    _queue.clear();
+    _queue->clear();
     _time = 0.0;
 }
 
+void Context::record_trace(std::ostream* trace) {
+    _trace = trace;
+    if (_trace) {
+        *_trace << std::setprecision(std::numeric_limits<Time>::max_digits10);
+    }
+}
+
+void Context::dump_event_stats() const {
+    std::cout << _time << " events " << _scheduled << " boxed closures " << InlineTask::heap_allocations()
+              << " queue allocations " << EventQueue::allocations() << std::endl;
+}
 }
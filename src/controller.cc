@@ -1,40 +1,99 @@
 #include "controller.h"
 #include "packet.h"
+#include "switch.h"
 #include <algorithm>
-#include <boost/functional/hash.hpp>
+#include <functional>
+#include <queue>
 // I know these are unnecessary here, but I was having some fun.
 #define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 namespace PILO {
+std::unique_ptr<ThreadPool> Controller::_routePool;
+Time Controller::_holdDown = 0.0;
+bool Controller::_gossipDigests = false;
+Controller::Forwarding Controller::_forwarding = Controller::PER_FLOW;
+SharedCache<Controller::Routes> Controller::_routeCache;
+const uint32_t Controller::UNREACHABLE;
+
 Controller::Controller(Context& context, const std::string& name, const Time refresh, const Time gossip,
                        Distribution<bool>* drop)
     : Node(context, name),
       _drop(drop),
-      _controllers(),
       _switches(),
-      _nodes(),
       _links(),
       _linkVersion(),
       _hostAtSwitch(),
       _hostAtSwitchCount(),
       _vertices(),
+      _ivertices(),
+      _graph(),
+      _trees(),
+      _treesValid(false),
+      _pendingLinks(),
       _filter(),
+      _existingLinks(),
       _refresh(refresh),
       _gossip(gossip),
       _log(),
-      _flow_version() {
-    // Create an empty graph
-    igraph_empty(&_graph, 0, IGRAPH_UNDIRECTED);
+      _flow_version(),
+      _recompute(),
+      _patchSeq(0) {
     _usedVertices = 0;
     std::cout << _name << " scheduling refresh for " << _refresh << std::endl;
-    _context.schedule(_refresh, [&](double) { this->send_switch_info_request(); });
+    _context.schedule(_refresh, _events, [&](double) { this->send_switch_info_request(); });
     std::cout << _name << " scheduling routing table refresh for " << _refresh << std::endl;
-    _context.schedule(_refresh, [&](double) { this->send_routing_request(); });
+    _context.schedule(_refresh, _events, [&](double) { this->send_routing_request(); });
     std::cout << _name << " scheduling gossip for " << _gossip << std::endl;
-    _context.schedule(_gossip, [&](double) { this->send_gossip_request(); });
+    _context.schedule(_gossip, _events, [&](double) { this->send_gossip_request(); });
+}
+
+std::shared_ptr<Node::State> Controller::save_state() const {
+    auto state = std::make_shared<ControllerState>();
+    save_state(*state);
+    return state;
 }
 
-void Controller::receive(std::shared_ptr<Packet> packet, Link* link) {
+void Controller::save_state(ControllerState& state) const {
+    state.events = _events;
+    state.links = _links;
+    state.linkVersion = _linkVersion;
+    state.hostAtSwitch = _hostAtSwitch;
+    state.hostAtSwitchCount = _hostAtSwitchCount;
+    state.graph = _graph.state();
+    state.flowDb = _flowDb;
+    state.flowHash = _flowHash;
+    state.kept = _kept;
+    state.filter = _filter;
+    state.existingLinks = _existingLinks;
+    state.log = _log;
+    state.flowVersion = _flow_version;
+    state.recompute = _recompute;
+    state.patchSeq = _patchSeq;
+}
+
+void Controller::restore_state(const State& state) {
+    auto& saved = static_cast<const ControllerState&>(state);
+    _events = saved.events;
+    _links = saved.links;
+    _linkVersion = saved.linkVersion;
+    _hostAtSwitch = saved.hostAtSwitch;
+    _hostAtSwitchCount = saved.hostAtSwitchCount;
+    _graph.restore(saved.graph);
+    // Path trees are not saved, the next update recomputes everything.
+    _treesValid = false;
+    _pendingLinks.clear();
+    _flowDb = saved.flowDb;
+    _flowHash = saved.flowHash;
+    _kept = saved.kept;
+    _filter = saved.filter;
+    _existingLinks = saved.existingLinks;
+    _log = saved.log;
+    _flow_version = saved.flowVersion;
+    _recompute = saved.recompute;
+    _patchSeq = saved.patchSeq;
+}
+
+void Controller::receive(PacketPtr packet, Link* link) {
     // Make sure we have not already received this packet.
     if (_filter.find(packet->_id) != _filter.end()) {
         return;
@@ -49,7 +108,7 @@ void Controller::receive(std::shared_ptr<Packet> packet, Link* link) {
         return;
     }
     if (packet->_type >= Packet::CONTROL &&
-        (packet->_destination == _name || packet->_destination == Packet::WILDCARD)) {
+        (packet->_destination == _id || packet->_destination == Packet::WILDCARD)) {
         //std::cout << _context.now() << " " << _name << " Processing packet " << packet->_id << " from "
                   //<< packet->_source << std::endl;
         // If the packet is intended for the controller, process it.
@@ -75,112 +134,294 @@ void Controller::receive(std::shared_ptr<Packet> packet, Link* link) {
             case Packet::SWITCH_TABLE_RESP:
                 handle_routing_resp(packet);
                 break;
+            case Packet::GOSSIP_DIGEST:
+                handle_gossip_digest(packet);
+                break;
             default:
                 std::cout << _context.now() << " " << _name << " received unknown packet type " << packet->_type
-                          << " from " << packet->_source << " to " << packet->_destination
-                          << std::endl;
+                          << " from " << Ids::node_name(packet->_source) << " to "
+                          << Ids::node_name(packet->_destination) << std::endl;
                 break;
                 // Do nothing
         }
     }
 }
 
-void Controller::handle_switch_information(const std::shared_ptr<Packet>& packet) {
+void Controller::handle_switch_information(const PacketPtr& packet) {
     bool changes = false;
-    for (auto lv : packet->data.linkVersion) {
-        if (lv.second > _linkVersion.at(lv.first)) {
+    for (auto& report : packet->link_reports()) {
+        if (report.version > _linkVersion.at(report.link)) {
             changes = true;
-            if (packet->data.linkState.at(lv.first) == Link::UP) {
-                add_link(lv.first, lv.second);
-            } else if (packet->data.linkState.at(lv.first) == Link::DOWN) {
-                remove_link(lv.first, lv.second);
+            if (report.state == Link::UP) {
+                add_link(report.link, report.version);
+            } else if (report.state == Link::DOWN) {
+                remove_link(report.link, report.version);
             }
         }
     }
     if (changes) {
-        auto patch = compute_paths();
-        apply_patch(patch);
+        schedule_recompute();
     }
 }
 
-void Controller::handle_routing_resp(const std::shared_ptr<Packet>& packet) {
+void Controller::handle_routing_resp(const PacketPtr& packet) {
     auto swtch = packet->_source;
-    auto version = compute_hash(_flowDb.at(swtch));
-    if (version != packet->data.version)
-        std::cout << _name << " " << "Updating " << swtch << " version to " << packet->data.version << std::endl;
+    if (_flowHash.at(swtch) != packet->data.hash)
+        std::cout << _name << " " << "Updating " << Ids::node_name(swtch) << " version to " << packet->data.version
+                  << std::endl;
+    auto& rules = packet->rules();
+    size_t hash = _flowHash[swtch];
+    if (packet->data.since == Packet::FULL_TABLE) {
+        // Copy rather than swap: the same packet is flooded to every controller.
+        _flowDb[swtch].assign(std::vector<RuleTable::Rule>(rules.rules.begin(), rules.rules.end()));
+        _flowHash[swtch] = compute_hash(_flowDb[swtch]);
+    } else {
+        if (packet->data.since > _flow_version[swtch] || packet->data.version < _flow_version[swtch]) {
+            // Changes to a table we do not have, or older than the one we have.
+            return;
+        }
+        // Rules the switch did not change since are as we last heard, were since changed by us, or were
+        // removed by us without telling it.
+        for (auto& rule : _kept[swtch]) {
+            set_flow(_flowDb[swtch], _flowHash[swtch], rule.first, rule.second);
+        }
+        for (auto& rule : rules.rules) {
+            set_flow(_flowDb[swtch], _flowHash[swtch], rule.first, rule.second);
+        }
+        for (auto flow : rules.removed) {
+            set_flow(_flowDb[swtch], _flowHash[swtch], flow, Ids::NONE);
+        }
+        if (_flowHash[swtch] != packet->data.hash) {
+            // Rule updates we sent were lost (or are still on their way), start over from the whole table.
+            request_table(swtch, Packet::FULL_TABLE);
+            return;
+        }
+    }
+    _kept[swtch].clear();
     _flow_version[swtch] = packet->data.version;
-    _flowDb[swtch].swap(packet->data.table);
-    auto patch = compute_paths();
-    apply_patch(patch);
+    // The table is what we last computed for it, nothing to fix.
+    if (_flowHash[swtch] != hash) {
+        if (std::find(_recompute.refreshed.begin(), _recompute.refreshed.end(), swtch) == _recompute.refreshed.end()) {
+            _recompute.refreshed.push_back(swtch);
+        }
+        schedule_recompute();
+    }
 }
 
-void Controller::handle_link_up(const std::shared_ptr<Packet>& packet) {
+void Controller::handle_link_up(const PacketPtr& packet) {
     // std::cout << _context.get_time() << " " << _name << " responding to link up" << std::endl;
     auto link = packet->data.link;
     if (add_link(link, packet->data.version)) {
-        auto patch = compute_paths();
-        apply_patch(patch);
+        schedule_recompute();
     }
 }
 
-void Controller::handle_link_down(const std::shared_ptr<Packet>& packet) {
+void Controller::handle_link_down(const PacketPtr& packet) {
     //std::cout << _context.get_time() << " " << _name << " responding to link down" << std::endl;
     auto link = packet->data.link;
     if (remove_link(link, packet->data.version)) {
-        auto patch = compute_paths();
-        apply_patch(patch);
+        schedule_recompute();
     }
 }
 
-void Controller::handle_gossip(const std::shared_ptr<Packet>& packet) {
+void Controller::handle_gossip(const PacketPtr& packet) {
+    _log.learn_marks(packet);
     auto response = _log.compute_response(packet);
     if (response.size() > 0) {
         // std::cout << _context.now() << " " << _name << " sending gossip response " << std::endl;
-        auto rpacket = Packet::make_packet(_name, packet->_source, Packet::GOSSIP_REP,
-                                           Packet::HEADER + response.size() * (64 + 64 + 8));
-        rpacket->data.gossipResponse = std::move(response);
+        auto rpacket = Packet::make_packet(_id, packet->_source, Packet::GOSSIP_REP);
+        rpacket->gossip_log() = std::move(response);
         flood(rpacket);
     }
 }
 
-void Controller::handle_gossip_rep(const std::shared_ptr<Packet>& packet) {
+void Controller::handle_gossip_rep(const PacketPtr& packet) {
     // std::cout << _context.get_time() << " " << _name << " handle_gossip_rep" << std::endl;
     _log.merge_logs(packet);
 }
 
+void Controller::handle_gossip_digest(const PacketPtr& packet) {
+    // Send back the nodes below those that differ, and ask for the logs of links that differ. Whichever side
+    // reaches the links asks the other for what it is missing.
+    auto reply = Packet::make_packet(_id, packet->_source, Packet::GOSSIP_DIGEST);
+    std::vector<LinkId> differ;
+    for (auto& node : packet->digests()) {
+        if (_log.digest(node.level, node.index) == node.hash) {
+            _log.peer_matches(packet->_source, node.level, node.index);
+            continue;
+        }
+        if (node.level == 0) {
+            if (_links[node.index]) {
+                differ.push_back(node.index);
+            }
+            continue;
+        }
+        uint32_t first, last;
+        std::tie(first, last) = _log.digest_children(node.level, node.index);
+        for (uint32_t index = first; index < last; index++) {
+            reply->digests().push_back(Packet::Digest{node.level - 1, index, _log.digest(node.level - 1, index)});
+        }
+    }
+    if (!reply->digests().empty()) {
+        flood(std::move(reply));
+    }
+    if (!differ.empty()) {
+        auto req = Packet::make_packet(_id, packet->_source, Packet::GOSSIP);
+        _log.compute_gaps(req, differ);
+        flood(std::move(req));
+    }
+}
+
+void Controller::set_hold_down(Time hold_down) { _holdDown = hold_down; }
+
+void Controller::set_gossip_digests(bool digests) { _gossipDigests = digests; }
+
+void Controller::set_forwarding(Forwarding forwarding) { _forwarding = forwarding; }
+
+void Controller::set_route_cache(size_t views) { _routeCache.set_capacity(views); }
+
+uint64_t Controller::route_cache_hits() { return _routeCache.hits(); }
+
+uint64_t Controller::route_cache_misses() { return _routeCache.misses(); }
+
+void Controller::schedule_recompute() {
+    _recompute.requests++;
+    if (_holdDown <= 0.0) {
+        recompute();
+    } else if (!_recompute.pending) {
+        // Anything else that changes before this runs is picked up by the same recomputation.
+        _recompute.pending = true;
+        _context.schedule(_holdDown, _events, [&](double) { this->recompute(); });
+    }
+}
+
+void Controller::recompute() {
+    _recompute.pending = false;
+    _recompute.runs++;
+    auto patch = update_paths();
+    refresh_tables(patch);
+    apply_patch(patch);
+}
+
+void Controller::refresh_tables(std::pair<flowtable_db, deleted_entries>& patch) {
+    if (_recompute.refreshed.empty()) {
+        return;
+    }
+    // Aggregated forwarding always starts from scratch (see update_paths), which leaves nothing here.
+    for (auto sw : _recompute.refreshed) {
+        RuleTable table;
+        switch_table(sw, table);
+        size_t hash = compute_hash(table);
+        Packet::flowtable added;
+        std::unordered_map<FlowId, LinkId> removed;
+        diff(_flowDb[sw], table, added, removed);
+        // Changes are from the table update_paths left, which already has its own changes.
+        for (auto& rule : added) {
+            patch.first[sw][rule.first] = rule.second;
+            patch.second[sw].erase(rule.first);
+        }
+        for (auto& rule : removed) {
+            patch.first[sw].erase(rule.first);
+            patch.second[sw].emplace(rule);
+        }
+        _flowDb[sw] = std::move(table);
+        _flowHash[sw] = hash;
+    }
+    _recompute.refreshed.clear();
+}
+
+void Controller::switch_table(NodeId sw, RuleTable& table) const {
+    // Rules for sw are read off every tree the same way compute_routes does.
+    VertexId s = _vertices[sw];
+    std::vector<RuleTable::Rule> rules;
+    for (VertexId root = 0; root < _usedVertices; root++) {
+        const PathTree& tree = _trees[root];
+        NodeId v0 = _ivertices[root];
+        if (tree.dist.empty() || tree.dist[s] == UNREACHABLE) {
+            continue;
+        }
+        if (_forwarding != PER_FLOW) {
+            if (root == s) {
+                for (auto h1 : _hostAtSwitch[v0]) {
+                    rules.emplace_back(Ids::destination(h1), Ids::between(sw, h1));
+                }
+            } else {
+                LinkId link = Ids::between(sw, _ivertices[tree.parent[s]]);
+                for (auto h1 : _hostAtSwitch[v0]) {
+                    rules.emplace_back(Ids::destination(h1), link);
+                }
+            }
+            continue;
+        }
+        for (VertexId v1_idx = 0; v1_idx < _usedVertices; v1_idx++) {
+            NodeId v1 = _ivertices[v1_idx];
+            if (_hostAtSwitch[v1].empty() || tree.dist[v1_idx] == UNREACHABLE || tree.dist[v1_idx] < tree.dist[s]) {
+                continue;
+            }
+            if (v1_idx == root) {
+                for (auto h0 : _hostAtSwitch[v0]) {
+                    for (auto h1 : _hostAtSwitch[v1]) {
+                        if (h0 != h1) {
+                            rules.emplace_back(Ids::flow(h0, h1), Ids::between(sw, h1));
+                        }
+                    }
+                }
+                continue;
+            }
+            // Walk back up the tree from the destination to sw's level, the path goes through sw if it is there.
+            VertexId below = -1, v = v1_idx;
+            while (tree.dist[v] > tree.dist[s]) {
+                below = v;
+                v = tree.parent[v];
+            }
+            if (v != s) {
+                continue;
+            }
+            for (auto h0 : _hostAtSwitch[v0]) {
+                for (auto h1 : _hostAtSwitch[v1]) {
+                    NodeId nh = (below < 0 ? h1 : _ivertices[below]);
+                    rules.emplace_back(Ids::flow(h0, h1), Ids::between(sw, nh));
+                }
+            }
+        }
+    }
+    table.assign(std::move(rules));
+}
+
 void Controller::apply_patch(std::pair<flowtable_db, deleted_entries>& patch) {
-    flowtable_db diff;
-    deleted_entries remove;
-    std::tie(diff, remove) = patch;
+    flowtable_db& diff = patch.first;
+    deleted_entries& remove = patch.second;
     size_t rule_updates = 0;
     bool sent = false;
-    for (auto part : diff) {
-        auto dest = part.first;
-        auto patch = part.second;
-        size_t patch_size = patch.size();
-
-        // Add the size of negation
-        if (remove.find(dest) != remove.end()) {
-            patch_size += remove.at(dest).size();
+    for (auto dest : _switches) {
+        auto& patch = diff[dest];
+        // Only switches with new rules get a patch, the others keep rules we would have removed: our view may
+        // be behind, and removing rules other controllers placed could break working routes.
+        if (patch.empty()) {
+            for (auto& rule : remove[dest]) {
+                _kept[dest][rule.first] = rule.second;
+            }
+            continue;
         }
-
-        rule_updates += patch_size;
+        // Add the size of negation
+        rule_updates += patch.size() + remove[dest].size();
         // std::cout << _context.get_time() << " " << _name << " sending a patch to " << dest << std::endl;
-        // Each rule is header + link to go out
-        size_t packet_size = Packet::HEADER + patch_size * (64 + Packet::HEADER);
-        auto update = Packet::make_packet(_name, dest, Packet::CHANGE_RULES, packet_size);
-        update->data.table.swap(patch);
-        if (remove.find(dest) != remove.end()) {
-            update->data.deleteEntries.swap(remove.at(dest));
-        }
-        if (patch_size > 0) {
-            _flow_version[dest] += 1; // Increment version since we are changing something
-            sent = true;
-            flood(std::move(update));
+        auto update = Packet::make_packet(_id, dest, Packet::CHANGE_RULES);
+        update->data.version = ++_patchSeq;
+        auto& rules = update->rules();
+        rules.rules.assign(patch.begin(), patch.end());
+        for (auto& rule : remove[dest]) {
+            rules.removed.push_back(rule.first);
         }
+        std::sort(rules.removed.begin(), rules.removed.end());
+        sent = true;
+        _recompute.patches++;
+        flood(std::move(update));
     }
-    if (sent)
+    if (sent) {
+        _recompute.floods++;
         std::cout << _context.get_time() << "  " << _name << " patch_size " << rule_updates << std::endl;
+    }
 }
 
 void Controller::notify_link_existence(Link* link) { Node::notify_link_existence(link); }
@@ -193,21 +434,21 @@ void Controller::silent_link_up(Link* link) { Node::silent_link_up(link); }
 
 void Controller::silent_link_down(Link* link) { Node::silent_link_down(link); }
 
-void Controller::add_new_link(const std::string& link, uint64_t version) {
-    _links.emplace(link);
-    _linkVersion.emplace(std::make_pair(link, version));
+void Controller::add_new_link(LinkId link, uint64_t version) {
+    _links[link] = true;
+    _linkVersion[link] = version;
     _log.open_log_link(link);
 }
 
-inline bool Controller::add_host_link(const std::string& link) {
-    std::string v0, v1;
-    std::tie(v0, v1) = split_parts(link);
-    if (_nodes.find(v0) != _nodes.end()) {
-        assert(_nodes.find(v1) == _nodes.end());
+inline bool Controller::add_host_link(LinkId link) {
+    NodeId v0, v1;
+    std::tie(v0, v1) = Ids::ends(link);
+    if (!is_switch(v0)) {
+        assert(is_switch(v1));
         _hostAtSwitch.at(v1).push_front(v0);
         _hostAtSwitchCount[v1] += 1;
         return true;
-    } else if (_nodes.find(v1) != _nodes.end()) {
+    } else if (!is_switch(v1)) {
         _hostAtSwitch.at(v0).push_front(v1);
         _hostAtSwitchCount[v0] += 1;
         return true;
@@ -215,15 +456,15 @@ inline bool Controller::add_host_link(const std::string& link) {
     return false;
 }
 
-inline bool Controller::remove_host_link(const std::string& link) {
-    std::string v0, v1;
-    std::tie(v0, v1) = split_parts(link);
-    if (_nodes.find(v0) != _nodes.end()) {
-        assert(_nodes.find(v1) == _nodes.end());
+inline bool Controller::remove_host_link(LinkId link) {
+    NodeId v0, v1;
+    std::tie(v0, v1) = Ids::ends(link);
+    if (!is_switch(v0)) {
+        assert(is_switch(v1));
         _hostAtSwitch.at(v1).remove(v0);
         _hostAtSwitchCount[v1]--;
         return true;
-    } else if (_nodes.find(v1) != _nodes.end()) {
+    } else if (!is_switch(v1)) {
         _hostAtSwitch.at(v0).remove(v1);
         _hostAtSwitchCount[v0]--;
         return true;
@@ -231,13 +472,13 @@ inline bool Controller::remove_host_link(const std::string& link) {
     return false;
 }
 
-bool Controller::add_link(const std::string& link, uint64_t version) {
-    std::cout << _context.now() << " " << _name << " " << link << " up " << std::endl;
-    if (_links.find(link) == _links.end()) {
+bool Controller::add_link(LinkId link, uint64_t version) {
+    std::cout << _context.now() << " " << _name << " " << Ids::link_name(link) << " up " << std::endl;
+    if (!_links.at(link)) {
         add_new_link(link, version);
     } else {
         // We have already seen this link state update (or a newer one)
-        if (version <= _linkVersion.at(link)) {
+        if (version <= _linkVersion[link]) {
             // std::cout << _context.get_time() << "  " << _name << " rejected due to version " << std::endl;
             return false;
         }
@@ -247,21 +488,22 @@ bool Controller::add_link(const std::string& link, uint64_t version) {
     _linkVersion[link] = version;
     _log.add_link_event(link, version, Link::UP);
     // This is mostly to prevent adding a single link many times.
-    if (_existingLinks.find(link) != _existingLinks.end()) {
+    if (_existingLinks[link]) {
         return false;
     }
-    _existingLinks.emplace(link);
+    _existingLinks[link] = true;
 
     if (!add_host_link(link)) {
-        std::string v0, v1;
-        std::tie(v0, v1) = split_parts(link);
-        igraph_add_edge(&_graph, _vertices.at(v0), _vertices.at(v1));
+        _graph.set_link(link, true);
+        _pendingLinks.push_back(link);
+    } else {
+        _treesValid = false;
     }
     return true;
 }
 
-bool Controller::remove_link(const std::string& link, uint64_t version) {
-    std::cout << _context.now() << " " << _name << " " << link << " down " << std::endl;
+bool Controller::remove_link(LinkId link, uint64_t version) {
+    std::cout << _context.now() << " " << _name << " " << Ids::link_name(link) << " down " << std::endl;
     if (version <= _linkVersion.at(link)) {
         return false;
     }
@@ -269,308 +511,1003 @@ bool Controller::remove_link(const std::string& link, uint64_t version) {
     _linkVersion[link] = version;
     _log.add_link_event(link, version, Link::DOWN);
 
-    if (_existingLinks.find(link) == _existingLinks.end()) {
+    if (!_existingLinks[link]) {
         return false;
     }
 
-    _existingLinks.erase(link);
+    _existingLinks[link] = false;
     if (!remove_host_link(link)) {
-        std::string v0, v1;
-        std::tie(v0, v1) = split_parts(link);
-
-        igraph_integer_t eid;
-        igraph_get_eid(&_graph, &eid, _vertices.at(v0), _vertices.at(v1), IGRAPH_UNDIRECTED, 0);
-        assert(eid != -1);
-        igraph_delete_edges(&_graph, igraph_ess_1(eid));
+        _graph.set_link(link, false);
+        _pendingLinks.push_back(link);
+    } else {
+        _treesValid = false;
     }
     return true;
 }
 
+void Controller::size_tables() {
+    // Start with version 0
+    _links.resize(Ids::links(), false);
+    _linkVersion.resize(Ids::links(), 0);
+    _existingLinks.resize(Ids::links(), false);
+    _hostAtSwitch.resize(Ids::nodes());
+    _hostAtSwitchCount.resize(Ids::nodes(), 0);
+    _vertices.resize(Ids::nodes(), -1);
+    _flowDb.resize(Ids::nodes());
+    _flowHash.resize(Ids::nodes(), 0);
+    _kept.resize(Ids::nodes());
+    _flow_version.resize(Ids::nodes(), 0);
+    _linkTrees.resize(Ids::links());
+    _log.resize(Ids::links());
+}
+
 void Controller::add_controllers(controller_map controllers) {
-    // int count = 0;
-    for (auto controller : controllers) {
-        _controllers.emplace(controller.first);
-        _nodes.emplace(controller.first);
+    // Anything that is not a switch is treated as a host.
+    size_tables();
+    std::vector<NodeId> peers;
+    for (auto& controller : controllers) {
+        if (controller.second->_id != _id) {
+            peers.push_back(controller.second->_id);
+        }
     }
+    _log.set_peers(peers);
 }
 
 void Controller::add_switches(switch_map switches) {
+    size_tables();
     int count = 0;
     for (auto sw : switches) {
-        _switches.emplace(sw.first);
-        _hostAtSwitch.emplace(std::make_pair(sw.first, std::forward_list<std::string>()));
-        _hostAtSwitchCount.emplace(std::make_pair(sw.first, 0ll));
-        _flowDb.emplace(std::make_pair(sw.first, Packet::flowtable()));
-        igraph_integer_t idx = count + _usedVertices;
-        _vertices[sw.first] = idx;
-        _ivertices[idx] = sw.first;
-        // Start with version 0
-        _flow_version.emplace(std::make_pair(sw.first, 0));
+        NodeId id = sw.second->_id;
+        _switches.push_back(id);
+        VertexId idx = count + _usedVertices;
+        _vertices[id] = idx;
+        _ivertices.push_back(id);
         count++;
     }
-    igraph_add_vertices(&_graph, count, NULL);
     _usedVertices += count;
+    _graph.build(_usedVertices, _vertices);
+    _trees.resize(_usedVertices);
+    _oldParent.resize(_usedVertices);
 }
 
-void Controller::add_nodes(node_map nodes) {
-    // int count = 0;
-    for (auto node : nodes) {
-        _nodes.emplace(node.first);
+void Controller::add_nodes(node_map nodes) { size_tables(); }
+
+void Controller::build_tree(VertexId root, PathTree& tree, std::vector<VertexId>& queue) const {
+    tree.dist.assign(_usedVertices, UNREACHABLE);
+    tree.parent.assign(_usedVertices, -1);
+    tree.dist[root] = 0;
+    queue.clear();
+    queue.push_back(root);
+    for (size_t head = 0; head < queue.size(); head++) {
+        VertexId u = queue[head];
+        for (auto v : _graph.neighbours(u)) {
+            if (tree.dist[v] == UNREACHABLE) {
+                tree.dist[v] = tree.dist[u] + 1;
+                queue.push_back(v);
+            }
+        }
+    }
+    for (auto v : queue) {
+        tree.parent[v] = tree_parent(tree, root, v);
+    }
+}
+
+VertexId Controller::tree_parent(const PathTree& tree, VertexId root, VertexId v) const {
+    if (v == root || tree.dist[v] == UNREACHABLE) {
+        return -1;
+    }
+    for (auto u : _graph.neighbours(v)) {
+        if (tree.dist[u] + 1 == tree.dist[v]) {
+            return u;
+        }
+    }
+    assert(false);
+    return -1;
+}
+
+void Controller::set_route_threads(size_t threads) {
+    _routePool.reset(threads > 1 ? new ThreadPool(threads - 1) : nullptr);
+}
+
+void Controller::route_parallel_for(size_t n, const std::function<void(size_t)>& body) {
+    if (_routePool) {
+        _routePool->parallel_for(n, body);
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            body(i);
+        }
     }
 }
 
 std::pair<Controller::flowtable_db, Controller::deleted_entries> Controller::compute_paths() {
-    igraph_vector_t path;
-    flowtable_db diffs;
-    deleted_entries diffs_negative;
-    flowtable_db new_table;
-    igraph_t workingCopy;
+    flowtable_db diffs(_flowDb.size());
+    deleted_entries diffs_negative(_flowDb.size());
+    rule_db new_table(_flowDb.size());
+    flowtable_version new_hash(_flowDb.size(), 0);
     //std::cout << _name << " Beginning computation " << std::endl;
-    igraph_copy(&workingCopy, &_graph);
-    igraph_to_directed(&workingCopy, IGRAPH_TO_DIRECTED_MUTUAL);
 
-    for (auto sw: _switches) {
-        new_table.emplace(std::make_pair(sw, Packet::flowtable()));
-        diffs_negative.emplace(std::make_pair(sw, std::unordered_set<std::string>())); 
+    // Controllers that see the same network compute the same routes, only their diffs differ.
+    SharedCache<Routes>::Key key;
+    std::shared_ptr<const Routes> cached;
+    if (_routeCache.enabled()) {
+        view_key(key);
+        cached = _routeCache.find(key);
     }
+    if (cached) {
+        new_table = cached->tables;
+        new_hash = cached->hashes;
+        _trees = cached->trees;
+        _linkTrees = cached->linkTrees;
+    } else {
+        compute_routes(new_table, new_hash);
+        if (_routeCache.enabled()) {
+            auto routes = std::make_shared<Routes>();
+            routes->tables = new_table;
+            routes->hashes = new_hash;
+            routes->trees = _trees;
+            routes->linkTrees = _linkTrees;
+            _routeCache.insert(key, std::move(routes));
+        }
+    }
+    _treesValid = true;
+    _pendingLinks.clear();
+    _recompute.refreshed.clear();
+    std::vector<char> heard;
+    if (_forwarding == AGGREGATED) {
+        heard = heard_hosts();
+    }
+    route_parallel_for(_switches.size(), [&](size_t idx) {
+        NodeId sw = _switches[idx];
+        if (_forwarding == AGGREGATED) {
+            keep_rules(_flowDb[sw], new_table[sw], new_hash[sw], heard);
+        }
+        diff(_flowDb[sw], new_table[sw], diffs[sw], diffs_negative[sw]);
+    });
+    _flowDb.swap(new_table); // Update the table
+    _flowHash.swap(new_hash);
+    return std::make_pair(diffs, diffs_negative);
+}
 
-    for (int v0_idx = 0; v0_idx < _usedVertices; v0_idx++) {
-        std::string v0 = _ivertices.at(v0_idx);
+void Controller::compute_routes(rule_db& new_table, flowtable_version& new_hash) {
+    // One shortest path tree per source switch, every destination's path is read off it. Sources are
+    // independent, so trees and the rules they give are computed concurrently.
+    std::vector<std::vector<RouteRule>> rules(_usedVertices);
+    route_parallel_for(_usedVertices, [&](size_t v0_idx) {
+        static thread_local std::vector<VertexId> queue;
+        NodeId v0 = _ivertices[v0_idx];
+        PathTree& tree = _trees[v0_idx];
+        std::vector<RouteRule>& out = rules[v0_idx];
 
-        if (_hostAtSwitch.at(v0).empty()) {
-            continue;
+        if (_hostAtSwitch[v0].empty()) {
+            tree.dist.clear();
+            tree.parent.clear();
+            return;
         }
 
+        build_tree(v0_idx, tree, queue);
+        if (_forwarding != PER_FLOW) {
+            // The tree is also every switch's shortest path to the root, so with rules matching on
+            // destination only switches forward to their parent.
+            for (int v_idx = 0; v_idx < _usedVertices; v_idx++) {
+                if (tree.parent[v_idx] < 0) {
+                    continue;
+                }
+                NodeId sw = _ivertices[v_idx];
+                LinkId link = Ids::between(sw, _ivertices[tree.parent[v_idx]]);
+                for (auto h1 : _hostAtSwitch[v0]) {
+                    out.push_back({sw, link, Ids::destination(h1)});
+                }
+            }
+            for (auto h1 : _hostAtSwitch[v0]) {
+                out.push_back({v0, Ids::between(v0, h1), Ids::destination(h1)});
+            }
+            return;
+        }
         for (int v1_idx = 0; v1_idx < _usedVertices; v1_idx++) {
-            std::string v1 = _ivertices.at(v1_idx);
-            if ((!_hostAtSwitch.at(v1).empty())) {
-                if (v0_idx != v1_idx) {
-                    igraph_vector_init(&path, 0);
-                    igraph_get_shortest_path(&workingCopy, &path, NULL, v0_idx, v1_idx, IGRAPH_ALL);
-                    for (auto h0 : _hostAtSwitch.at(v0)) {
-                        for (auto h1 : _hostAtSwitch.at(v1)) {
-                            std::string psig = Packet::generate_signature(h0, h1, Packet::DATA);
-                            int path_len = igraph_vector_size(&path);
-
-
-                            for (int k = 0; k < path_len; k++) {
-                                std::string sw = _ivertices.at(VECTOR(path)[k]);
-                                std::string nh;
-                                if (k + 1 < path_len) {
-                                    nh = _ivertices.at(VECTOR(path)[k + 1]);
-                                } else {
-                                    nh = h1;
-                                }
-                                std::string link = sw + "-" + nh;
-
-                                // Cannonicalize
-                                if (_links.find(link) == _links.end()) {
-                                    link = nh + "-" + sw;
-                                }
-                                assert(_links.find(link) != _links.end());
-                                new_table[sw][psig] = link;
-                                auto rule = _flowDb.at(sw).find(psig);
-                                if (rule == _flowDb.at(sw).end() || rule->second != link) {
-                                    _flowDb[sw][psig] = link;
-                                    diffs[sw][psig] = link;
-                                }
-                            }
+            NodeId v1 = _ivertices[v1_idx];
+            if (_hostAtSwitch[v1].empty() || tree.dist[v1_idx] == UNREACHABLE) {
+                continue;
+            }
+            if ((VertexId)v0_idx != v1_idx) {
+                for (auto h0 : _hostAtSwitch[v0]) {
+                    for (auto h1 : _hostAtSwitch[v1]) {
+                        FlowId flow = Ids::flow(h0, h1);
+                        // Walk back up the tree from the destination.
+                        NodeId nh = h1;
+                        for (VertexId v = v1_idx; v >= 0; v = tree.parent[v]) {
+                            NodeId sw = _ivertices[v];
+                            out.push_back({sw, Ids::between(sw, nh), flow});
+                            nh = sw;
                         }
                     }
-                    igraph_vector_destroy(&path);
-                } else if (v0_idx == v1_idx) {
-                    // Set up paths between things connected to the same switch.
-                    for (auto h0 : _hostAtSwitch.at(v0)) {
-                        for (auto h1 : _hostAtSwitch.at(v1)) {
-                            if (h0 == h1) {
-                                continue;
-                            }
-                            std::string psig = Packet::generate_signature(h0, h1, Packet::DATA);
-                            std::string link = v0 + "-" + h1;
-                            auto sw = v0;
-                            // Cannonicalize
-                            if (_links.find(link) == _links.end()) {
-                                link = h1 + "-" + v0;
-                            }
-                            assert(_links.find(link) != _links.end());
-                            new_table[sw][psig] = link;
-                            auto rule = _flowDb.at(sw).find(psig);
-                            if (rule == _flowDb.at(sw).end() || rule->second != link) {
-                                _flowDb[sw][psig] = link;
-                                diffs[sw][psig] = link;
-                            }
+                }
+            } else {
+                // Set up paths between things connected to the same switch.
+                for (auto h0 : _hostAtSwitch[v0]) {
+                    for (auto h1 : _hostAtSwitch[v1]) {
+                        if (h0 == h1) {
+                            continue;
                         }
+                        out.push_back({v0, Ids::between(v0, h1), Ids::flow(h0, h1)});
                     }
                 }
             }
         }
+    });
+    for (auto& roots : _linkTrees) {
+        roots.clear();
+    }
+    for (VertexId root = 0; root < _usedVertices; root++) {
+        for (size_t v = 0; v < _trees[root].parent.size(); v++) {
+            index_tree_edge(root, v, _trees[root].parent[v], true);
+        }
+    }
+
+    // Group rules by switch, in source order, so each switch's tables can be updated on their own.
+    std::vector<size_t> start(_flowDb.size() + 1, 0);
+    for (auto& source : rules) {
+        for (auto& rule : source) {
+            start[rule.sw + 1]++;
+        }
+    }
+    for (size_t sw = 0; sw < _flowDb.size(); sw++) {
+        start[sw + 1] += start[sw];
+    }
+    std::vector<RouteRule> by_switch(start.back());
+    std::vector<size_t> fill(start.begin(), start.end() - 1);
+    for (auto& source : rules) {
+        for (auto& rule : source) {
+            by_switch[fill[rule.sw]++] = rule;
+        }
+    }
+
+    std::vector<NodeId> hosts = routed_hosts();
+    route_parallel_for(_switches.size(), [&](size_t idx) {
+        NodeId sw = _switches[idx];
+        std::vector<RuleTable::Rule> table;
+        table.reserve(start[sw + 1] - start[sw]);
+        for (size_t r = start[sw]; r < start[sw + 1]; r++) {
+            const RouteRule& rule = by_switch[r];
+            assert(rule.link != Ids::NONE && _links[rule.link]);
+            table.emplace_back(rule.flow, rule.link);
+        }
+        new_table[sw].assign(std::move(table));
+        new_hash[sw] = compute_hash(new_table[sw]);
+        if (_forwarding == AGGREGATED) {
+            aggregate(new_table[sw], new_hash[sw], hosts);
+        }
+    });
+}
+
+void Controller::view_key(SharedCache<Routes>::Key& key) const {
+    key.clear();
+    key.push_back(_forwarding);
+    key.insert(key.end(), _ivertices.begin(), _ivertices.end());
+    // Edge states, a bit each.
+    const std::vector<char>& up = _graph.state();
+    for (size_t slot = 0; slot < up.size(); slot += 64) {
+        uint64_t word = 0;
+        for (size_t bit = 0; bit < 64 && slot + bit < up.size(); bit++) {
+            word |= (uint64_t)(up[slot + bit] != 0) << bit;
+        }
+        key.push_back(word);
+    }
+    for (auto sw : _switches) {
+        key.push_back(_hostAtSwitchCount[sw]);
+        key.insert(key.end(), _hostAtSwitch[sw].begin(), _hostAtSwitch[sw].end());
+    }
+}
+
+std::pair<Controller::flowtable_db, Controller::deleted_entries> Controller::update_paths() {
+    if (!_treesValid || _forwarding == AGGREGATED) {
+        // Host changes. Aggregation looks at whole tables, and what it keeps depends on every table before.
+        _pendingLinks.clear();
+        return compute_paths();
+    }
+
+    // Several links may have changed at once (e.g., from SWITCH_INFORMATION, or during a hold-down): replay
+    // them in order, so each repair sees the graph the trees were built on plus one link.
+    original_rules original;
+    std::vector<VertexId> roots;
+    for (auto link : rewind_pending_links()) {
+        bool added = _existingLinks[link];
+        _graph.set_link(link, added);
+        NodeId v0, v1;
+        std::tie(v0, v1) = Ids::ends(link);
+        VertexId a = _vertices[v0], b = _vertices[v1];
+        roots.clear();
+        if (added) {
+            // Any tree may get shorter paths, repair_tree tells quickly which do not.
+            for (VertexId root = 0; root < _usedVertices; root++) {
+                roots.push_back(root);
+            }
+        } else {
+            // Removing an edge no tree uses changes neither distances nor parents.
+            roots = _linkTrees[link];
+            std::sort(roots.begin(), roots.end());
+        }
+        for (auto root : roots) {
+            PathTree& tree = _trees[root];
+            if (tree.dist.empty()) {
+                continue;
+            }
+            repair_tree(root, tree, a, b, added);
+            if (!_changedVertices.empty()) {
+                reroute(root, tree, original);
+            }
+        }
     }
-    igraph_destroy(&workingCopy);
-    for (auto swtable : _flowDb) {
-        auto sw = swtable.first;
-        auto table = swtable.second;
-        for (auto match_action : table) {
-            auto sig = match_action.first;
-            if (new_table.find(sw) == new_table.end() || new_table.at(sw).find(sig) == new_table.at(sw).end()) {
-                // OK, remove this signature
-                diffs_negative[sw].emplace(sig);
+    return diff_rules(original);
+}
+
+std::pair<Controller::flowtable_db, Controller::deleted_entries> Controller::diff_rules(
+    const original_rules& original) const {
+    flowtable_db diffs(_flowDb.size());
+    deleted_entries diffs_negative(_flowDb.size());
+    for (auto& entry : original) {
+        NodeId sw = entry.first.first;
+        FlowId flow = entry.first.second;
+        LinkId current = _flowDb[sw].find(flow);
+        if (current != Ids::NONE) {
+            if (current != entry.second) {
+                diffs[sw][flow] = current;
             }
+        } else if (entry.second != Ids::NONE) {
+            diffs_negative[sw].emplace(flow, entry.second);
         }
     }
-    _flowDb.swap(new_table); // Update the table
     return std::make_pair(diffs, diffs_negative);
 }
 
+void Controller::repair_tree(VertexId root, PathTree& tree, VertexId a, VertexId b,
+                             bool added) {
+    auto& dist = tree.dist;
+    _changed.clear(_usedVertices);
+    _changedVertices.clear();
+    if (dist[a] > dist[b]) {
+        std::swap(a, b);
+    }
+    // b is the far end. An edge between vertices at the same distance is on no shortest path.
+    if (dist[a] == UNREACHABLE || dist[a] == dist[b]) {
+        return;
+    }
+
+    // Vertices whose distance changed, their parent and their neighbours' parents need a look.
+    _scratch.clear();
+    if (added) {
+        if (dist[b] > dist[a] + 1) {
+            // Closer now, push the improvement outwards.
+            dist[b] = dist[a] + 1;
+            _scratch.push_back(b);
+            for (size_t head = 0; head < _scratch.size(); head++) {
+                VertexId u = _scratch[head];
+                for (auto v : _graph.neighbours(u)) {
+                    if (dist[v] > dist[u] + 1) {
+                        dist[v] = dist[u] + 1;
+                        _scratch.push_back(v);
+                    }
+                }
+            }
+        }
+    } else if (dist[b] == dist[a] + 1) {
+        // Find vertices left without a neighbour one hop closer that keeps its distance, level by level
+        // starting at b: those are the ones that get further away.
+        _affected.clear(_usedVertices);
+        _queued.clear(_usedVertices);
+        std::vector<VertexId>& queue = _scratch;
+        queue.push_back(b);
+        _queued.set(b);
+        for (size_t head = 0; head < queue.size(); head++) {
+            VertexId v = queue[head];
+            bool supported = false;
+            for (auto u : _graph.neighbours(v)) {
+                if (dist[u] + 1 == dist[v] && !_affected.test(u)) {
+                    supported = true;
+                    break;
+                }
+            }
+            if (supported) {
+                continue;
+            }
+            _affected.set(v);
+            for (auto w : _graph.neighbours(v)) {
+                if (dist[w] == dist[v] + 1 && !_queued.test(w)) {
+                    _queued.set(w);
+                    queue.push_back(w);
+                }
+            }
+        }
+        // Keep only affected vertices, and settle their new distances from the unaffected ones.
+        queue.erase(std::remove_if(queue.begin(), queue.end(),
+                                   [&](VertexId v) { return !_affected.test(v); }),
+                    queue.end());
+        typedef std::pair<uint32_t, VertexId> Entry;
+        std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> frontier;
+        for (auto v : queue) {
+            dist[v] = UNREACHABLE;
+            for (auto u : _graph.neighbours(v)) {
+                if (!_affected.test(u) && dist[u] != UNREACHABLE && dist[u] + 1 < dist[v]) {
+                    dist[v] = dist[u] + 1;
+                }
+            }
+            if (dist[v] != UNREACHABLE) {
+                frontier.emplace(dist[v], v);
+            }
+        }
+        while (!frontier.empty()) {
+            Entry top = frontier.top();
+            frontier.pop();
+            if (top.first != dist[top.second]) {
+                continue;
+            }
+            for (auto w : _graph.neighbours(top.second)) {
+                if (_affected.test(w) && dist[w] > top.first + 1) {
+                    dist[w] = top.first + 1;
+                    frontier.emplace(dist[w], w);
+                }
+            }
+        }
+    }
+
+    auto update = [&](VertexId v) {
+        if (_changed.test(v)) {
+            return;
+        }
+        VertexId parent = tree_parent(tree, root, v);
+        if (parent != tree.parent[v]) {
+            _changed.set(v);
+            _changedVertices.push_back(v);
+            _oldParent[v] = tree.parent[v];
+            index_tree_edge(root, v, tree.parent[v], false);
+            index_tree_edge(root, v, parent, true);
+            tree.parent[v] = parent;
+        }
+    };
+    update(b);
+    for (auto v : _scratch) {
+        update(v);
+        for (auto w : _graph.neighbours(v)) {
+            update(w);
+        }
+    }
+}
+
+void Controller::index_tree_edge(VertexId root, VertexId v, VertexId parent, bool add) {
+    if (parent < 0) {
+        return;
+    }
+    auto& roots = _linkTrees[Ids::between(_ivertices[v], _ivertices[parent])];
+    if (add) {
+        roots.push_back(root);
+    } else {
+        auto it = std::find(roots.begin(), roots.end(), root);
+        assert(it != roots.end());
+        *it = roots.back();
+        roots.pop_back();
+    }
+}
+
+std::vector<LinkId> Controller::rewind_pending_links() {
+    // Every entry is a change of state, so links listed an even number of times are back where they were.
+    std::vector<LinkId> changed;
+    for (auto link : _pendingLinks) {
+        auto it = std::find(changed.begin(), changed.end(), link);
+        if (it == changed.end()) {
+            changed.push_back(link);
+        } else {
+            changed.erase(it);
+        }
+    }
+    _pendingLinks.clear();
+    for (auto link : changed) {
+        _graph.set_link(link, !_existingLinks[link]);
+    }
+    return changed;
+}
+
+void Controller::set_rule(NodeId sw, FlowId flow, LinkId link, original_rules& original) {
+    auto& table = _flowDb[sw];
+    original.emplace(std::make_pair(sw, flow), table.find(flow));
+    assert(link == Ids::NONE || _links[link]);
+    set_flow(table, _flowHash[sw], flow, link);
+}
+
+void Controller::reroute(VertexId root, const PathTree& tree, original_rules& original) {
+    auto old_parent = [&](VertexId v) { return (_changed.test(v) ? _oldParent[v] : tree.parent[v]); };
+
+    NodeId v0 = _ivertices[root];
+    if (_forwarding != PER_FLOW) {
+        // Only switches whose parent changed forward root's hosts elsewhere.
+        for (auto v : _changedVertices) {
+            NodeId sw = _ivertices[v];
+            VertexId parent = tree.parent[v];
+            LinkId link = parent < 0 ? Ids::NONE : Ids::between(sw, _ivertices[parent]);
+            for (auto h1 : _hostAtSwitch[v0]) {
+                set_rule(sw, Ids::destination(h1), link, original);
+            }
+        }
+        return;
+    }
+
+    // Destinations whose path changed: everything below a vertex whose parent changed in the new tree.
+    // Vertices that are now unreachable have no children.
+    _queued.clear(_usedVertices);
+    _scratch.clear();
+    for (auto v : _changedVertices) {
+        _queued.set(v);
+        _scratch.push_back(v);
+    }
+    for (size_t head = 0; head < _scratch.size(); head++) {
+        VertexId u = _scratch[head];
+        for (auto w : _graph.neighbours(u)) {
+            if (tree.parent[w] == u && !_queued.test(w)) {
+                _queued.set(w);
+                _scratch.push_back(w);
+            }
+        }
+    }
+
+    std::vector<VertexId> newPath, oldPath;
+    for (auto v1_idx : _scratch) {
+        NodeId v1 = _ivertices[v1_idx];
+        if (v1_idx == root || _hostAtSwitch[v1].empty()) {
+            continue;
+        }
+        newPath.clear();
+        oldPath.clear();
+        if (tree.dist[v1_idx] != UNREACHABLE) {
+            for (VertexId v = v1_idx; v >= 0; v = tree.parent[v]) {
+                newPath.push_back(v);
+            }
+        }
+        // Unreachable vertices had no parent before if they had no path then either.
+        for (VertexId v = v1_idx; v >= 0; v = old_parent(v)) {
+            oldPath.push_back(v);
+        }
+        if (oldPath.back() != root) {
+            oldPath.clear();
+        }
+        _affected.clear(_usedVertices);
+        for (auto v : newPath) {
+            _affected.set(v);
+        }
+        for (auto h0 : _hostAtSwitch[v0]) {
+            for (auto h1 : _hostAtSwitch[v1]) {
+                FlowId flow = Ids::flow(h0, h1);
+                NodeId nh = h1;
+                for (auto v : newPath) {
+                    NodeId sw = _ivertices[v];
+                    set_rule(sw, flow, Ids::between(sw, nh), original);
+                    nh = sw;
+                }
+                for (auto v : oldPath) {
+                    if (!_affected.test(v)) {
+                        set_rule(_ivertices[v], flow, Ids::NONE, original);
+                    }
+                }
+            }
+        }
+    }
+}
+
 void Controller::send_routing_request() {
     std::cout << _context.now() << " " << _name << " sending routing request " << std::endl;
-    for (auto sv : _flow_version) {
-        auto req = Packet::make_packet(_name, sv.first, Packet::SWITCH_TABLE_REQ, Packet::HEADER);
-        req->data.version = compute_hash(_flowDb.at(sv.first));;
-        flood(std::move(req));
+    for (auto sw : _switches) {
+        request_table(sw, _flow_version[sw]);
     }
     std::cout << _name << " scheduling routing request for " << _refresh << std::endl;
-    _context.schedule(_refresh, [&](double) { this->send_routing_request(); });
+    _context.schedule(_refresh, _events, [&](double) { this->send_routing_request(); });
+}
+
+void Controller::request_table(NodeId sw, uint64_t since) {
+    auto req = Packet::make_packet(_id, sw, Packet::SWITCH_TABLE_REQ);
+    req->data.version = _flowHash[sw];
+    req->data.since = since;
+    flood(std::move(req));
 }
 
 void Controller::send_switch_info_request() {
     // std::cout << _context.get_time() << " " << _name << " switch info request starting " << std::endl;
     std::cout << _context.now() << " " << _name << " sending refresh request " << std::endl;
-    auto req = Packet::make_packet(_name, Packet::SWITCH_INFORMATION_REQ, Packet::HEADER);
+    auto req = Packet::make_packet(_id, Packet::SWITCH_INFORMATION_REQ);
     flood(std::move(req));
     std::cout << _name << " scheduling refresh for " << _refresh << std::endl;
-    _context.schedule(_refresh, [&](double) { this->send_switch_info_request(); });
+    _context.schedule(_refresh, _events, [&](double) { this->send_switch_info_request(); });
 }
 
 void Controller::send_gossip_request() {
     std::cout << _name << " " << _context.now() << " sending gossip " << _gossip << std::endl;
-    auto req = Packet::make_packet(_name, Packet::GOSSIP, Packet::HEADER);
-    _log.compute_gaps(req);
-    flood(std::move(req));
-    _context.schedule(_gossip, [&](double) { this->send_gossip_request(); });
+    if (_gossipDigests) {
+        // Just the root, anyone whose log differs answers.
+        auto req = Packet::make_packet(_id, Packet::GOSSIP_DIGEST);
+        uint32_t root = _log.digest_root();
+        req->digests().push_back(Packet::Digest{root, 0, _log.digest(root, 0)});
+        flood(std::move(req));
+    } else {
+        auto req = Packet::make_packet(_id, Packet::GOSSIP);
+        _log.compute_gaps(req);
+        flood(std::move(req));
+    }
+    _context.schedule(_gossip, _events, [&](double) { this->send_gossip_request(); });
 }
 
 
-size_t Controller::compute_hash(const Packet::flowtable& f) {
+size_t Controller::compute_hash(const RuleTable& f) {
     size_t h = 0;
-    for (auto e : f) {
-	    boost::hash_combine(h, std::hash<std::string>()(e.first));
-	    boost::hash_combine(h, std::hash<std::string>()(e.second));
+    for (auto& e : f) {
+        h ^= rule_hash(e.first, e.second);
     }
     return h;
 }
 
-Log::Log() : _log(), _commit(), _marked(), _sizes(), _max() {}
+std::vector<NodeId> Controller::routed_hosts() const {
+    std::vector<NodeId> hosts;
+    for (auto sw : _switches) {
+        hosts.insert(hosts.end(), _hostAtSwitch[sw].begin(), _hostAtSwitch[sw].end());
+    }
+    return hosts;
+}
 
-void Log::open_log_link(const std::string& link) {
-    _log.emplace(std::make_pair(link, std::vector<Link::State>(INITIAL_SIZE)));
-    _commit.emplace(std::make_pair(link, std::vector<bool>(INITIAL_SIZE)));
-    // Nothing has been marked yet
-    _max.emplace(std::make_pair(link, 0));
-    _marked.emplace(std::make_pair(link, 1));
-    _sizes.emplace(std::make_pair(link, INITIAL_SIZE));
-
-    _log.at(link).emplace(_log[link].begin(), Link::DOWN);
-    _commit.at(link).emplace(_commit[link].begin(), true);
-}
-
-void Log::add_link_event(const std::string& link, uint64_t version, Link::State state) {
-    assert(_log.find(link) != _log.end());
-    while (unlikely(version >= _sizes.at(link))) {
-        // std::cout << "Growing log" << std::endl;
-        size_t new_size;
-        size_t size = _sizes.at(link);
-        if (likely(size < HWM)) {
-            new_size = size * 2;
+std::vector<char> Controller::heard_hosts() const {
+    std::vector<char> heard(Ids::nodes(), false);
+    for (LinkId link = 0; link < _links.size(); link++) {
+        if (_links[link] && is_host_link(link)) {
+            NodeId a, b;
+            std::tie(a, b) = Ids::ends(link);
+            heard[is_switch(a) ? b : a] = true;
+        }
+    }
+    return heard;
+}
+
+void Controller::keep_rules(const RuleTable& from, RuleTable& table, size_t& hash, const std::vector<char>& heard) {
+    LinkId fallback = table.find(Ids::DEFAULT_ROUTE);
+    for (auto& rule : from) {
+        if (rule.first == Ids::DEFAULT_ROUTE || table.find(rule.first) != Ids::NONE) {
+            continue;
+        }
+        NodeId destination = Ids::flow_destination(rule.first);
+        if (!heard[destination]) {
+            set_flow(table, hash, rule.first, rule.second);
+        } else if (fallback != Ids::NONE && rule.second != fallback) {
+            set_flow(table, hash, rule.first, fallback);
+        }
+    }
+}
+
+void Controller::aggregate(RuleTable& table, size_t& hash, const std::vector<NodeId>& hosts) {
+    for (auto host : hosts) {
+        if (table.find(Ids::destination(host)) == Ids::NONE) {
+            return;
+        }
+    }
+    // The most common next hop, the lowest numbered on ties.
+    std::map<LinkId, size_t> count;
+    for (auto& rule : table) {
+        count[rule.second]++;
+    }
+    LinkId best = Ids::NONE;
+    size_t most = 1;
+    for (auto& next : count) {
+        if (next.second > most) {
+            best = next.first;
+            most = next.second;
+        }
+    }
+    if (best == Ids::NONE) {
+        return;
+    }
+    table.filter([&](const RuleTable::Rule& rule) {
+        if (rule.second != best) {
+            return true;
+        }
+        hash ^= rule_hash(rule.first, rule.second);
+        return false;
+    });
+    set_flow(table, hash, Ids::DEFAULT_ROUTE, best);
+}
+
+void Controller::set_flow(RuleTable& table, size_t& hash, FlowId flow, LinkId link) {
+    LinkId old = table.set(flow, link);
+    if (old != Ids::NONE) {
+        hash ^= rule_hash(flow, old);
+    }
+    if (link != Ids::NONE) {
+        hash ^= rule_hash(flow, link);
+    }
+}
+
+void Controller::diff(const RuleTable& from, const RuleTable& to, Packet::flowtable& added,
+                      std::unordered_map<FlowId, LinkId>& removed) {
+    // Both are sorted by flow, walk them side by side.
+    auto old = from.begin();
+    for (auto& rule : to) {
+        for (; old != from.end() && old->first < rule.first; ++old) {
+            removed.emplace(old->first, old->second);
+        }
+        if (old != from.end() && old->first == rule.first) {
+            if (old->second != rule.second) {
+                added.emplace_hint(added.end(), rule);
+            }
+            ++old;
         } else {
-            // Be cowardly and prevent unbounded growth.
-            new_size = version + GROW;
+            added.emplace_hint(added.end(), rule);
         }
-        _log.at(link).resize(new_size);
-        _commit.at(link).resize(new_size);
-        _sizes[link] = new_size;
     }
-    _log[link].emplace(_log[link].begin() + version, state);
-    _commit[link].emplace(_commit[link].begin() + version, true);
-    if (_max.at(link) < version) {
-        _max[link] = version;
+    for (; old != from.end(); ++old) {
+        removed.emplace(old->first, old->second);
+    }
+}
+
+const uint32_t Log::DIGEST_FANOUT;
+
+// Digest of a single log entry (splitmix64 finalizer).
+static inline uint64_t entry_digest(LinkId link, uint64_t version, Link::State state) {
+    uint64_t x = (((uint64_t)link << 1 | state) * 0x9e3779b97f4a7c15ull) ^ version;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+Log::Log() : _open(), _links(), _digests(), _peer(), _peerMarked(), _compacted(0) {}
+
+void Log::resize(size_t links) {
+    if (links <= _links.size() && !_digests.empty()) {
+        return;
+    }
+    _links.resize(std::max(links, _links.size()));
+    for (auto& marked : _peerMarked) {
+        marked.resize(_links.size(), 0);
+    }
+    // Rebuild the tree above the links' digests, links that are new have none.
+    std::vector<uint64_t> leaves(_links.size(), 0);
+    if (!_digests.empty()) {
+        std::copy(_digests[0].begin(), _digests[0].end(), leaves.begin());
+    }
+    _digests.assign(1, std::move(leaves));
+    while (_digests.back().size() > 1) {
+        auto& below = _digests.back();
+        std::vector<uint64_t> level((below.size() + DIGEST_FANOUT - 1) / DIGEST_FANOUT, 0);
+        for (size_t index = 0; index < below.size(); index++) {
+            level[index / DIGEST_FANOUT] ^= below[index];
+        }
+        _digests.push_back(std::move(level));
+    }
+}
+
+std::pair<uint32_t, uint32_t> Log::digest_children(uint32_t level, uint32_t index) const {
+    assert(level > 0);
+    uint32_t first = index * DIGEST_FANOUT;
+    return std::make_pair(first, std::min<uint32_t>(first + DIGEST_FANOUT, _digests[level - 1].size()));
+}
+
+void Log::update_digest(LinkId link, uint64_t delta) {
+    size_t index = link;
+    for (auto& level : _digests) {
+        level[index] ^= delta;
+        index /= DIGEST_FANOUT;
+    }
+}
+
+void Log::set_entry(LinkId link, uint64_t version, Link::State state) {
+    LinkLog& log = _links[link];
+    if ((version >> 6) < log.first) {
+        // Everyone already has it.
+        return;
     }
+    uint64_t delta = entry_digest(link, version, state);
+    if (log.has(version)) {
+        delta ^= entry_digest(link, version, log.state(version));
+    }
+    log.set(version, state);
+    update_digest(link, delta);
 }
 
-void Log::compute_gaps(const std::shared_ptr<Packet>& packet) {
-    size_t packet_size = 0;
-    for (auto l : _max) {
-        packet_size += (64 + 64);  // 64 bit for link ID, 64 bit for version
-        packet->data.logMax.emplace(l.first, l.second);
-        size_t gap_size;
-        packet->data.gaps.emplace(l.first, std::move(compute_link_gap(l.first, gap_size)));
-        packet_size += (gap_size * 2 * 64);  // 64 bit for each side of the gap
+void Log::set_peers(const std::vector<NodeId>& peers) {
+    _peer.assign(Ids::nodes(), -1);
+    _peerMarked.assign(peers.size(), std::vector<uint64_t>(_links.size(), 0));
+    for (size_t idx = 0; idx < peers.size(); idx++) {
+        _peer[peers[idx]] = idx;
+    }
+}
+
+uint64_t Log::prefix(LinkId link) const {
+    const LinkLog& log = _links[link];
+    return log.find(std::min(log.marked, log.max + 1), log.max + 1, false);
+}
+
+void Log::peer_marked(NodeId peer, LinkId link, uint64_t marked) {
+    if (peer >= _peer.size() || _peer[peer] < 0 || _links[link].committed.empty()) {
+        return;
+    }
+    uint64_t& known = _peerMarked[_peer[peer]][link];
+    if (marked <= known) {
+        return;
+    }
+    known = marked;
+    uint64_t everyone = prefix(link);
+    for (auto& peer_marked : _peerMarked) {
+        everyone = std::min(everyone, peer_marked[link]);
+    }
+    // Keep the newest version everyone has: peers may ask for entries from their max on.
+    if (everyone > 0) {
+        _compacted += _links[link].drop((everyone - 1) >> 6);
+    }
+}
+
+void Log::learn_marks(const PacketPtr& packet) {
+    auto& gossip = packet->gossip();
+    for (auto& summary : gossip.links) {
+        uint64_t marked = summary.gapsBegin < summary.gapsEnd ? gossip.gaps[summary.gapsBegin] : summary.max + 1;
+        peer_marked(packet->_source, summary.link, marked);
+    }
+}
+
+void Log::peer_matches(NodeId peer, uint32_t level, uint32_t index) {
+    uint64_t span = 1;
+    for (uint32_t l = 0; l < level; l++) {
+        span *= DIGEST_FANOUT;
+    }
+    uint64_t end = std::min<uint64_t>((index + 1) * span, _links.size());
+    for (uint64_t link = index * span; link < end; link++) {
+        peer_marked(peer, link, prefix(link));
     }
-    packet->_size += packet_size;
 }
 
-std::vector<uint64_t> Log::compute_link_gap(const std::string& link, size_t& gaps_found) {
-    std::vector<uint64_t> gaps;
-    uint64_t i = _marked.at(link);
-    bool first = true;
-    gaps_found = 0;
-    while (i < _max.at(link)) {
-        // Increment i until we find a missing piece.
-        while (_commit.at(link).at(i)) i++;
-        if (first) {
-            _marked[link] = i;
-            first = false;
+size_t Log::words() const {
+    size_t words = 0;
+    for (auto& log : _links) {
+        words += log.committed.size() + log.up.size();
+    }
+    return words;
+}
+
+size_t Log::LinkLog::drop(uint64_t word) {
+    if (word <= first) {
+        return 0;
+    }
+    size_t count = std::min<uint64_t>(word - first, committed.size());
+    committed.erase(committed.begin(), committed.begin() + count);
+    up.erase(up.begin(), up.begin() + count);
+    first = word;
+    return count;
+}
+
+void Log::LinkLog::set(uint64_t version, Link::State state) {
+    size_t word = (version >> 6) - first;
+    uint64_t bit = 1ull << (version & 63);
+    if (word >= committed.size()) {
+        committed.resize(word + 1, 0);
+        up.resize(word + 1, 0);
+    }
+    committed[word] |= bit;
+    if (state == Link::UP) {
+        up[word] |= bit;
+    } else {
+        up[word] &= ~bit;
+    }
+    if (max < version) {
+        max = version;
+    }
+}
+
+uint64_t Log::LinkLog::find(uint64_t from, uint64_t to, bool known) const {
+    while (from < to) {
+        uint64_t word = from >> 6;
+        uint64_t bits;
+        if (word < first) {
+            bits = ~0ull;
+        } else {
+            bits = word - first < committed.size() ? committed[word - first] : 0;
+        }
+        if (!known) {
+            bits = ~bits;
         }
-        if (i < _max.at(link)) {
-            // std::cout << "Found gap" << std::endl;
-            // Found a gap
-            gaps.push_back(i);
-            // Figure out where gap ends
-            while (!_commit.at(link).at(i) && i < _max.at(link)) i++;
-            assert(i <= _max.at(link));
-            gaps.push_back(i);
-            gaps_found += 1;
+        bits &= ~0ull << (from & 63);
+        if (bits) {
+            return std::min(to, (word << 6) + __builtin_ctzll(bits));
         }
+        from = (word + 1) << 6;
+    }
+    return to;
+}
+
+void Log::open_log_link(LinkId link) {
+    if (link >= _links.size()) {
+        resize(link + 1);
+    }
+    _open.push_back(link);
+    LinkLog& log = _links[link];
+    log.committed.clear();
+    log.up.clear();
+    log.first = 0;
+    for (auto& marked : _peerMarked) {
+        marked[link] = 0;
     }
-    return gaps;
+    update_digest(link, _digests[0][link]);
+    // Nothing has been marked yet
+    log.max = 0;
+    log.marked = 1;
+    set_entry(link, 0, Link::DOWN);
+}
+
+void Log::add_link_event(LinkId link, uint64_t version, Link::State state) {
+    assert(link < _links.size() && !_links[link].committed.empty());
+    set_entry(link, version, state);
 }
 
-std::vector<Packet::GossipLog> Log::compute_response(const std::shared_ptr<Packet>& packet) {
+void Log::compute_gaps(const PacketPtr& packet) { compute_gaps(packet, _open); }
+
+void Log::compute_gaps(const PacketPtr& packet, const std::vector<LinkId>& links) {
+    auto& gossip = packet->gossip();
+    for (auto link : links) {
+        uint32_t begin = gossip.gaps.size();
+        compute_link_gap(link, gossip.gaps);
+        gossip.links.push_back(Packet::Gossip::Summary{link, _links[link].max, begin, (uint32_t)gossip.gaps.size()});
+    }
+}
+
+void Log::compute_link_gap(LinkId link, std::vector<uint64_t>& gaps) {
+    LinkLog& log = _links.at(link);
+    if (log.marked >= log.max) {
+        return;
+    }
+    // Nothing is known past max, so this stops there at the latest.
+    uint64_t i = log.find(log.marked, log.max + 1, false);
+    log.marked = i;
+    while (i < log.max) {
+        // Found a gap, figure out where it ends.
+        gaps.push_back(i);
+        i = log.find(i, log.max, true);
+        gaps.push_back(i);
+        i = log.find(i, log.max + 1, false);
+    }
+}
+
+void Log::append_entries(LinkId link, uint64_t begin, uint64_t end, std::vector<Packet::GossipLog>& log) const {
+    const LinkLog& entries = _links[link];
+    end = std::min(end, (entries.first + entries.committed.size()) << 6);
+    for (uint64_t word = std::max(begin >> 6, entries.first); (word << 6) < end; word++) {
+        uint64_t bits = entries.committed[word - entries.first];
+        if ((word << 6) < begin) {
+            bits &= ~0ull << (begin & 63);
+        }
+        if (((word + 1) << 6) > end) {
+            bits &= ~(~0ull << (end & 63));
+        }
+        for (; bits; bits &= bits - 1) {
+            uint64_t version = (word << 6) + __builtin_ctzll(bits);
+            log.emplace_back(Packet::GossipLog{.link = link, .state = entries.state(version), .version = version});
+        }
+    }
+}
+
+std::vector<Packet::GossipLog> Log::compute_response(const PacketPtr& packet) {
     assert(packet->_type == Packet::GOSSIP);
     std::vector<Packet::GossipLog> log;
-    for (auto lv : packet->data.logMax) {
+    auto& gossip = packet->gossip();
+    for (auto& summary : gossip.links) {
         // Newer entries than are known
-        auto link = lv.first;
-        if (lv.second < _max.at(link)) {
-            for (uint64_t i = lv.second; i <= _max.at(link); i++) {
-                if (_commit.at(link).at(i)) {
-                    log.emplace_back(Packet::GossipLog{.link = lv.first, .state = _log.at(link).at(i), .version = i});
-                }
-            }
+        auto link = summary.link;
+        uint64_t max = _links.at(link).max;
+        if (summary.max < max) {
+            append_entries(link, summary.max, max + 1, log);
         }
 
         // See if we can fill any gaps
-        for (size_t idx = 0; idx < packet->data.gaps.at(link).size(); idx += 2) {
-            uint64_t begin = packet->data.gaps.at(link).at(idx);
-            uint64_t end = std::min(packet->data.gaps.at(link).at(idx + 1), _max.at(link));
-            for (uint64_t i = begin; i < end; i++) {
-                if (_commit.at(link).at(i)) {
-                    log.emplace_back(Packet::GossipLog{.link = lv.first, .state = _log.at(link).at(i), .version = i});
-                }
-            }
+        for (size_t idx = summary.gapsBegin; idx < summary.gapsEnd; idx += 2) {
+            append_entries(link, gossip.gaps[idx], std::min(gossip.gaps[idx + 1], max), log);
         }
     }
     return log;
 }
 
-void Log::merge_logs(const std::shared_ptr<Packet>& packet) {
+void Log::merge_logs(const PacketPtr& packet) {
     assert(packet->_type == Packet::GOSSIP_REP);
-    for (auto log : packet->data.gossipResponse) {
-        if (!_commit.at(log.link).at(log.version)) {
-            _commit.at(log.link)[log.version] = true;
-            _log.at(log.link)[log.version] = log.state;
-            if (_max.at(log.link) < log.version) {
-                _max[log.link] = log.version;
-            }
+    for (auto& log : packet->gossip_log()) {
+        LinkLog& entries = _links.at(log.link);
+        if (!entries.has(log.version)) {
+            set_entry(log.link, log.version, log.state);
         }
     }
 }
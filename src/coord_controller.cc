@@ -14,7 +14,7 @@ void Coordinator::set_context(Context* context) {
     _lastTime = _context->now();
 }
 
-void Coordinator::receive(CoordinationController* controller, std::shared_ptr<Packet> packet, Link* link) {
+void Coordinator::receive(CoordinationController* controller, PacketPtr packet, Link* link) {
     if (_lastSeen[packet->_destination] < packet->_id) {
         // New information.
         _lastSeen[packet->_destination] = packet->_id;
@@ -28,7 +28,7 @@ void Coordinator::receive(CoordinationController* controller, std::shared_ptr<Pa
     }
 }
 
-void Coordinator::send_to_controller(std::shared_ptr<Packet> packet, Link* link) {
+void Coordinator::send_to_controller(PacketPtr packet, Link* link) {
     for (auto controller : _controllers) {
         CoordinationController* c = controller;
         _context->schedule(0.0, [c, packet, link](Time) mutable { c->receive_coordinator(packet, link); });
@@ -42,11 +42,11 @@ CoordinationController::CoordinationController(Context& context, const std::stri
     std::cout << "Creating coordination" << std::endl;
 }
 
-void CoordinationController::receive(std::shared_ptr<Packet> packet, Link* link) {
+void CoordinationController::receive(PacketPtr packet, Link* link) {
     _coordinator->receive(this, packet, link);
 }
 
-void CoordinationController::receive_coordinator(std::shared_ptr<Packet> packet, Link* link) {
+void CoordinationController::receive_coordinator(PacketPtr packet, Link* link) {
     std::cout << _context.now() << " " << this->_name << " coordinator sent information " << std::endl;
     Controller::receive(packet, link);
     std::cout << _context.now() << " " << this->_name << " done processing coordinator information " << std::endl;
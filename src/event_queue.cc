@@ -0,0 +1,172 @@
+#include <cassert>
+#include <algorithm>
+#include <cmath>
+#include "event_queue.h"
+
+namespace PILO {
+std::atomic<uint64_t> AllocationCounter::allocations(0);
+std::atomic<uint64_t> InlineTask::_heapAllocations(0);
+
+const std::string EventQueue::IType[] = {"fibonacci", "dary", "calendar"};
+const size_t CalendarQueue::WIDTH_SAMPLES;
+
+std::unique_ptr<EventQueue> EventQueue::make(EventQueue::Type type) {
+    switch (type) {
+        case DARY_HEAP:
+            return std::unique_ptr<EventQueue>(new DaryHeapQueue());
+        case CALENDAR:
+            return std::unique_ptr<EventQueue>(new CalendarQueue());
+        case FIBONACCI:
+        default:
+            return std::unique_ptr<EventQueue>(new FibonacciQueue());
+    }
+}
+
+bool EventQueue::parse_type(const std::string& name, EventQueue::Type& type) {
+    for (int i = FIBONACCI; i <= CALENDAR; i++) {
+        if (IType[i] == name) {
+            type = (Type)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+Event FibonacciQueue::pop() {
+    // The heap will not touch the node again before freeing it, so it is safe to steal the task.
+    Event event = std::move(const_cast<Event&>(_heap.top()));
+    _heap.pop();
+    return event;
+}
+
+Event DaryHeapQueue::pop() {
+    Event event = std::move(const_cast<Event&>(_heap.top()));
+    _heap.pop();
+    return event;
+}
+
+CalendarQueue::CalendarQueue()
+    : _buckets(MIN_BUCKETS), _nbuckets(MIN_BUCKETS), _size(0), _width(1.0), _day(0), _top(0), _topValid(false) {}
+
+void CalendarQueue::clear() {
+    for (auto& bucket : _buckets) {
+        bucket.clear();
+    }
+    _nbuckets = MIN_BUCKETS;
+    _size = 0;
+    _width = 1.0;
+    _day = 0;
+    _topValid = false;
+}
+
+void CalendarQueue::insert(Event&& event) {
+    uint64_t d = day(event.time);
+    size_t idx = d % _nbuckets;
+    Bucket& bucket = _buckets[idx];
+    if (d < _day) {
+        // Scheduled in the past, rewind.
+        _day = d;
+        _topValid = false;
+    }
+    if (_topValid && EventCompare()(_buckets[_top].back(), event)) {
+        _top = idx;
+    }
+    // Most events land after everything already in their bucket, i.e., towards the front.
+    bucket.insert(std::upper_bound(bucket.begin(), bucket.end(), event, EventCompare()), std::move(event));
+}
+
+void CalendarQueue::push(Event&& event) {
+    insert(std::move(event));
+    _size++;
+    if (_size > 2 * _nbuckets) {
+        resize(2 * _nbuckets);
+    }
+}
+
+size_t CalendarQueue::locate() const {
+    if (_topValid) {
+        return _top;
+    }
+    const size_t n = _nbuckets;
+    // Walk one year worth of days looking for an event that falls on its day.
+    for (size_t k = 0; k < n; k++) {
+        size_t idx = (_day + k) % n;
+        if (!_buckets[idx].empty() && day(_buckets[idx].back().time) == _day + k) {
+            _day += k;
+            _top = idx;
+            _topValid = true;
+            return _top;
+        }
+    }
+    // Nothing in the coming year, so fall back to a direct search.
+    bool found = false;
+    for (size_t idx = 0; idx < n; idx++) {
+        if (!_buckets[idx].empty() && (!found || EventCompare()(_buckets[_top].back(), _buckets[idx].back()))) {
+            _top = idx;
+            found = true;
+        }
+    }
+    assert(found);
+    _day = day(_buckets[_top].back().time);
+    _topValid = true;
+    return _top;
+}
+
+const Event& CalendarQueue::top() const { return _buckets[locate()].back(); }
+
+Event CalendarQueue::pop() {
+    Bucket& bucket = _buckets[locate()];
+    Event event = std::move(bucket.back());
+    bucket.pop_back();
+    _size--;
+    _topValid = false;
+    if (_nbuckets > MIN_BUCKETS && _size < _nbuckets / 2) {
+        resize(_nbuckets / 2);
+    }
+    return event;
+}
+
+void CalendarQueue::resize(size_t buckets) {
+    auto& events = _resize;
+    for (size_t idx = 0; idx < _nbuckets; idx++) {
+        auto& bucket = _buckets[idx];
+        std::move(bucket.begin(), bucket.end(), std::back_inserter(events));
+        bucket.clear();
+    }
+
+    // Estimate a new day width from the spacing of the earliest few events, ignoring outliers.
+    size_t samples = std::min(events.size(), WIDTH_SAMPLES);
+    if (samples > 1) {
+        std::partial_sort(events.begin(), events.begin() + samples, events.end(),
+                          [](const Event& e1, const Event& e2) { return EventCompare()(e2, e1); });
+        Time average = (events[samples - 1].time - events[0].time) / (samples - 1);
+        Time total = 0.0;
+        size_t count = 0;
+        for (size_t i = 1; i < samples; i++) {
+            Time separation = events[i].time - events[i - 1].time;
+            if (separation <= 2.0 * average) {
+                total += separation;
+                count++;
+            }
+        }
+        Time width = (count > 0 ? 3.0 * total / count : 0.0);
+        if (width > 0.0 && std::isfinite(width)) {
+            // Keep the current day anchored to the same point in time.
+            Time now = _day * _width;
+            _width = width;
+            _day = day(now);
+        }
+    }
+
+    // Buckets are never freed, so the ring only allocates when it grows beyond its peak.
+    if (buckets > _buckets.size()) {
+        _buckets.resize(buckets);
+    }
+    _nbuckets = buckets;
+    _topValid = false;
+    for (auto& event : events) {
+        insert(std::move(event));
+    }
+    events.clear();
+}
+}
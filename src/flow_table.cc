@@ -0,0 +1,60 @@
+#include "flow_table.h"
+
+namespace PILO {
+const FlowTable::Port FlowTable::NONE;
+const unsigned FlowTable::MIN_BITS;
+const size_t FlowTable::MIN_SLOTS;
+
+FlowTable::Port FlowTable::set(FlowId flow, Port port) {
+    size_t s = home(flow);
+    for (; _slots[s].port != NONE; s = (s + 1) & mask()) {
+        if (_slots[s].flow == flow) {
+            Port old = _slots[s].port;
+            _slots[s].port = port;
+            return old;
+        }
+    }
+    _slots[s] = Entry{flow, port};
+    if (++_size * 2 > _slots.size()) {
+        grow();
+    }
+    return NONE;
+}
+
+FlowTable::Port FlowTable::erase(FlowId flow) {
+    size_t s = home(flow);
+    for (; _slots[s].port != NONE && _slots[s].flow != flow; s = (s + 1) & mask()) {
+    }
+    Port old = _slots[s].port;
+    if (old == NONE) {
+        return NONE;
+    }
+    // Move back later entries of the run that probing would no longer reach past the hole.
+    size_t hole = s;
+    for (size_t next = (s + 1) & mask(); _slots[next].port != NONE; next = (next + 1) & mask()) {
+        size_t want = home(_slots[next].flow);
+        if (((next - want) & mask()) >= ((next - hole) & mask())) {
+            _slots[hole] = _slots[next];
+            hole = next;
+        }
+    }
+    _slots[hole].port = NONE;
+    _size--;
+    return old;
+}
+
+void FlowTable::grow() {
+    std::vector<Entry> old(_slots.size() * 2, Entry{0, NONE});
+    old.swap(_slots);
+    _shift--;
+    for (auto& entry : old) {
+        if (entry.port != NONE) {
+            size_t s = home(entry.flow);
+            while (_slots[s].port != NONE) {
+                s = (s + 1) & mask();
+            }
+            _slots[s] = entry;
+        }
+    }
+}
+}
@@ -0,0 +1,123 @@
+#include "graph.h"
+#include <algorithm>
+#include <cassert>
+#include <tuple>
+
+namespace PILO {
+const Graph::Slot Graph::NONE;
+const uint32_t Graph::UNREACHABLE;
+
+void Graph::build(size_t vertices, const std::vector<VertexId>& vertex) {
+    std::vector<std::vector<std::pair<VertexId, LinkId>>> adjacent(vertices);
+    for (LinkId link = 0; link < Ids::links(); link++) {
+        NodeId a, b;
+        std::tie(a, b) = Ids::ends(link);
+        if (vertex[a] >= 0 && vertex[b] >= 0) {
+            adjacent[vertex[a]].emplace_back(vertex[b], link);
+            adjacent[vertex[b]].emplace_back(vertex[a], link);
+        }
+    }
+    _first.assign(1, 0);
+    _target.clear();
+    _slots.assign(Ids::links(), NONE);
+    _reverse.assign(Ids::links(), NONE);
+    for (size_t v = 0; v < vertices; v++) {
+        std::sort(adjacent[v].begin(), adjacent[v].end());
+        for (auto& edge : adjacent[v]) {
+            NodeId a = Ids::ends(edge.second).first;
+            (vertex[a] == (VertexId)v ? _slots : _reverse)[edge.second] = _target.size();
+            _target.push_back(edge.first);
+        }
+        _first.push_back(_target.size());
+    }
+    _up.assign(_target.size(), false);
+}
+
+bool Graph::set_link(LinkId link, bool up) {
+    if (_slots[link] == NONE || _up[_slots[link]] == up) {
+        return false;
+    }
+    _up[_slots[link]] = up;
+    _up[_reverse[link]] = up;
+    return true;
+}
+
+Graph::Slot Graph::slot(VertexId a, VertexId b) const {
+    auto begin = _target.begin() + _first[a];
+    auto end = _target.begin() + _first[a + 1];
+    auto it = std::lower_bound(begin, end, b);
+    return (it != end && *it == b) ? it - _target.begin() : NONE;
+}
+
+void Graph::bfs(VertexId root, std::vector<VertexId>& parent, const std::vector<char>* removed) const {
+    static thread_local std::vector<VertexId> queue;
+    parent.assign(vertices(), -1);
+    parent[root] = root;
+    queue.clear();
+    queue.push_back(root);
+    for (size_t head = 0; head < queue.size(); head++) {
+        VertexId u = queue[head];
+        for (Slot s = _first[u]; s < _first[u + 1]; s++) {
+            VertexId v = _target[s];
+            if (_up[s] && parent[v] < 0 && !(removed && (*removed)[s])) {
+                parent[v] = u;
+                queue.push_back(v);
+            }
+        }
+    }
+}
+
+void Graph::distances(const std::vector<VertexId>& roots, std::vector<std::vector<uint32_t>>& dist) const {
+    size_t n = vertices();
+    dist.resize(roots.size());
+    std::vector<uint64_t> seen(n), frontier(n), next(n);
+    for (size_t batch = 0; batch < roots.size(); batch += 64) {
+        size_t count = std::min<size_t>(64, roots.size() - batch);
+        std::fill(seen.begin(), seen.end(), 0);
+        std::fill(frontier.begin(), frontier.end(), 0);
+        for (size_t i = 0; i < count; i++) {
+            dist[batch + i].assign(n, UNREACHABLE);
+            dist[batch + i][roots[batch + i]] = 0;
+            seen[roots[batch + i]] |= (uint64_t)1 << i;
+            frontier[roots[batch + i]] |= (uint64_t)1 << i;
+        }
+        for (uint32_t level = 1;; level++) {
+            bool reached = false;
+            for (size_t v = 0; v < n; v++) {
+                uint64_t word = 0;
+                for (Slot s = _first[v]; s < _first[v + 1]; s++) {
+                    if (_up[s]) {
+                        word |= frontier[_target[s]];
+                    }
+                }
+                next[v] = word & ~seen[v];
+                reached = reached || next[v];
+            }
+            if (!reached) {
+                break;
+            }
+            for (size_t v = 0; v < n; v++) {
+                seen[v] |= next[v];
+                for (uint64_t word = next[v]; word; word &= word - 1) {
+                    dist[batch + __builtin_ctzll(word)][v] = level;
+                }
+            }
+            frontier.swap(next);
+        }
+    }
+}
+
+void Graph::shortest_path(VertexId a, VertexId b, std::vector<VertexId>& path) const {
+    std::vector<VertexId> parent;
+    bfs(a, parent);
+    path.clear();
+    if (parent[b] < 0) {
+        return;
+    }
+    for (VertexId v = b; v != a; v = parent[v]) {
+        path.push_back(v);
+    }
+    path.push_back(a);
+    std::reverse(path.begin(), path.end());
+}
+}
@@ -0,0 +1,41 @@
+#include <cassert>
+#include "ids.h"
+
+namespace PILO {
+const NodeId Ids::ANY;
+const LinkId Ids::NONE;
+const FlowId Ids::DEFAULT_ROUTE;
+std::vector<std::string> Ids::_nodeNames;
+std::unordered_map<std::string, NodeId> Ids::_nodeIds;
+std::vector<Ids::LinkInfo> Ids::_links;
+std::unordered_map<std::string, LinkId> Ids::_linkIds;
+std::unordered_map<uint64_t, LinkId> Ids::_linkBetween;
+
+NodeId Ids::node(const std::string& name) {
+    auto id = _nodeIds.emplace(name, (NodeId)_nodeNames.size());
+    if (id.second) {
+        _nodeNames.push_back(name);
+    }
+    return id.first->second;
+}
+
+const std::string& Ids::node_name(NodeId node) {
+    static const std::string ANY_NAME = "ALL";
+    return (node == ANY ? ANY_NAME : _nodeNames[node]);
+}
+
+LinkId Ids::link(const std::string& name, NodeId a, NodeId b) {
+    auto id = _linkIds.emplace(name, (LinkId)_links.size());
+    if (id.second) {
+        _links.push_back(LinkInfo{name, a, b});
+        _linkBetween.emplace(key(a, b), id.first->second);
+    }
+    assert(_links[id.first->second].a == a && _links[id.first->second].b == b);
+    return id.first->second;
+}
+
+LinkId Ids::between(NodeId a, NodeId b) {
+    auto link = _linkBetween.find(key(a, b));
+    return (link == _linkBetween.end() ? NONE : link->second);
+}
+}
@@ -3,6 +3,7 @@
 #include "node.h"
 #include <iostream>
 #include <algorithm>
+#include <boost/functional/hash.hpp>
 
 namespace PILO {
 Link::Link(Context& context, const std::string& name,
@@ -12,6 +13,7 @@ Link::Link(Context& context, const std::string& name,
            std::shared_ptr<Node> b, Distribution<bool>* drop)
     : _context(context),
       _name(name),
+      _id(Ids::link(name, a->_id, b->_id)),
       _latency(latency),
       _bandwidth(bandwidth),
       _drop(drop),
@@ -33,18 +35,95 @@ Link::Link(Context& context, const std::string& name,
     }
 }
 
-void Link::send(Node* sender, std::shared_ptr<Packet> packet) {
+void Link::partition(uint32_t seed) {
+    for (int d = 0; d < 2; d++) {
+        size_t stream = seed;
+        boost::hash_combine(stream, _name);
+        boost::hash_combine(stream, d);
+        std::unique_ptr<Direction> direction(new Direction());
+        direction->rng.reset(new boost::mt19937((uint32_t)stream));
+        direction->latency.reset(_latency->clone(*direction->rng));
+        direction->drop.reset(_drop->clone(*direction->rng));
+        direction->nextSchedulable = 0.;
+        direction->totalBits = 0;
+        direction->bitByType.resize(Packet::END, 0);
+        _directions[d] = std::move(direction);
+    }
+}
+
+void Link::reset() {
+    _nextSchedulableA = 0.;
+    _nextSchedulableB = 0.;
+    _aQueue = 0;
+    _bQueue = 0;
+    for (auto& direction : _directions) {
+        if (direction) {
+            direction->nextSchedulable = 0.;
+            direction->inFlight.clear();
+        }
+    }
+}
+
+std::function<void()> Link::save_direction(const Node* sender, bool sending) const {
+    Direction* direction = _directions[_a.get() == sender ? 0 : 1].get();
+    if (sending) {
+        struct Sending {
+            boost::mt19937 rng;
+            Time nextSchedulable;
+            std::deque<Time> inFlight;
+        };
+        auto saved =
+            std::make_shared<Sending>(Sending{*direction->rng, direction->nextSchedulable, direction->inFlight});
+        return [direction, saved]() {
+            *direction->rng = saved->rng;
+            direction->nextSchedulable = saved->nextSchedulable;
+            direction->inFlight = saved->inFlight;
+        };
+    }
+    auto saved = std::make_shared<std::pair<size_t, std::vector<size_t>>>(direction->totalBits, direction->bitByType);
+    return [direction, saved]() {
+        direction->totalBits = saved->first;
+        direction->bitByType = saved->second;
+    };
+}
+
+size_t Link::total_bits() const {
+    size_t bits = _totalBits;
+    for (auto& direction : _directions) {
+        if (direction) {
+            bits += direction->totalBits;
+        }
+    }
+    return bits;
+}
+
+size_t Link::bits_by_type(int type) const {
+    size_t bits = _bitByType.at(type);
+    for (auto& direction : _directions) {
+        if (direction) {
+            bits += direction->bitByType.at(type);
+        }
+    }
+    return bits;
+}
+
+void Link::send(Node* sender, PacketPtr packet) {
     // This link fails "atomically". No packets scheduled for delivery after failure are delivered.
     if (_state == DOWN) {
         return;
     }
 
+    if (_directions[0]) {
+        send_partitioned(sender, std::move(packet));
+        return;
+    }
+
     if (!(_drop->next())) {
         std::cout << "VVV dropping" << std::endl;
         return;
     }
 
-    Time end_delay = ((Time)packet->_size) / (_bandwidth);
+    Time end_delay = ((Time)packet->size()) / (_bandwidth);
     //end_delay += _latency->next();
     if (_a.get() == sender) {
     	// Limit queuing to some small number of packets.
@@ -60,8 +139,8 @@ void Link::send(Node* sender, std::shared_ptr<Packet> packet) {
         _context.scheduleAbsolute(end_time, [this, packet](float) mutable {
             this->_aQueue -= 1;
             if (_state == UP) {
-                this->_totalBits += packet->_size;
-                this->_bitByType[packet->_type] += packet->_size;
+                this->_totalBits += packet->size();
+                this->_bitByType[packet->_type] += packet->size();
                 this->_b->receive(std::move(packet), this);
             }
         });
@@ -78,14 +157,51 @@ void Link::send(Node* sender, std::shared_ptr<Packet> packet) {
         _context.scheduleAbsolute(end_time, [this, packet](float) mutable {
             if (_state == UP) {
                 this->_bQueue -= 1;
-                this->_totalBits += packet->_size;
-                this->_bitByType[packet->_type] += packet->_size;
+                this->_totalBits += packet->size();
+                this->_bitByType[packet->_type] += packet->size();
                 this->_a->receive(std::move(packet), this);
             }
         });
     }
 }
 
+void Link::send_partitioned(Node* sender, PacketPtr&& packet) {
+    int d = (_a.get() == sender ? 0 : 1);
+    assert(d == 0 || _b.get() == sender);
+    Direction& direction = *_directions[d];
+    if (!(direction.drop->next())) {
+        std::cout << "VVV dropping" << std::endl;
+        return;
+    }
+
+    Context& context = sender->_context;
+    Time now = context.now();
+    while (!direction.inFlight.empty() && direction.inFlight.front() <= now) {
+        direction.inFlight.pop_front();
+    }
+    // Limit queuing to some small number of packets.
+    if (direction.inFlight.size() > 50) return;
+    Time end_time = std::max(direction.nextSchedulable, now + direction.latency->next()) +
+                    ((Time)packet->size()) / (_bandwidth);
+    direction.nextSchedulable = end_time;
+    direction.inFlight.push_back(end_time);
+    Node* receiver = (d == 0 ? _b : _a).get();
+    if (&receiver->_context != &context) {
+        // Reference counts are not atomic, the other partition gets a packet of its own.
+        packet = Packet::copy(*packet);
+    }
+    context.send(receiver->_context, end_time, sender->_events, [this, d, packet](Time) mutable {
+        if (_state == UP) {
+            Node* receiver = (d == 0 ? this->_b : this->_a).get();
+            receiver->_context.touch(receiver->_events.id);
+            Direction& direction = *this->_directions[d];
+            direction.totalBits += packet->size();
+            direction.bitByType[packet->_type] += packet->size();
+            receiver->receive(std::move(packet), this);
+        }
+    });
+}
+
 void Link::set_up() {
     _state = UP;
     _version++;
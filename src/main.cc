@@ -1,6 +1,8 @@
 #include <stdio.h>
+#include <chrono>
 #include <iostream>
 #include <iomanip>
+#include <fstream>
 #include <list>
 #include <limits>
 #include <unordered_map>
@@ -11,6 +13,8 @@
 #include <yaml-cpp/yaml.h>
 #include "context.h"
 #include "simulation.h"
+#include "controller.h"
+#include "te_controller.h"
 #include "link.h"
 #include "node.h"
 #include "distributions.h"
@@ -44,6 +48,18 @@ int main(int argc, char* argv[]) {
     std::unique_ptr<PILO::Distribution<bool>> ctrl_drop_distribution;
     bool versioned;
     uint32_t converge;
+    std::string queue_name;
+    std::string forwarding;
+    std::string queue_trace;
+    PILO::EventQueue::Type queue;
+    std::ofstream queue_trace_file;
+    size_t partitions = 0;
+    size_t checkpoint_interval;
+    PILO::Time optimism_window;
+    size_t route_threads;
+    PILO::Time hold_down;
+    size_t te_paths;
+    size_t route_cache;
     //
     // Argument parsing
     po::options_description args("PILO simulation");
@@ -69,7 +85,31 @@ int main(int argc, char* argv[]) {
         ("ctfail", po::value<int>(&interctrl_link)->default_value(0), "Links to fail between control link failures")
         ("versioned,v", "Use version information to reduce the number of flow table messages")
         ("window",  po::value<PILO::Time>(&window)->default_value(0.0), "Window in which to measure bandwidth")
-        ("converge", po::value<uint32_t>(&converge), "Compute convergence time");
+        ("converge", po::value<uint32_t>(&converge), "Compute convergence time")
+        ("queue", po::value<std::string>(&queue_name)->default_value("fibonacci"),
+         "Event queue engine (fibonacci, dary, calendar)")
+        ("queue-trace", po::value<std::string>(&queue_trace), "Record event queue operations for queue_bench")
+        ("parallel", po::value<size_t>(&partitions), "Partition the network across this many threads")
+        ("optimistic", "Run partitions optimistically (Time Warp) rather than in lockstep")
+        ("checkpoint-interval", po::value<size_t>(&checkpoint_interval)->default_value(1024),
+         "Events between checkpoints when running optimistically")
+        ("optimism-window", po::value<PILO::Time>(&optimism_window)->default_value(0.001),
+         "How far a partition may run ahead of the others when running optimistically")
+        ("route-threads", po::value<size_t>(&route_threads)->default_value(1),
+         "Threads controllers compute routes on (shared by all controllers)")
+        ("route-cache", po::value<size_t>(&route_cache)->default_value(8),
+         "Share full route computations between controllers with the same view of the network, keeping this "
+         "many views (0 for none)")
+        ("hold-down", po::value<PILO::Time>(&hold_down)->default_value(0.0),
+         "Batch the route recomputations controllers need within this long of the first one")
+        ("digest-gossip", "Gossip log hash trees, exchanging only the logs of links that differ")
+        ("forwarding", po::value<std::string>(&forwarding)->default_value("flow"),
+         "What rules match on (flow, destination, or aggregated: destination with default routes)")
+        ("te-incremental", "TE controllers move only flows across failed links, and retry rejected flows when "
+         "links come up, rather than admitting every flow again")
+        ("te-paths", po::value<size_t>(&te_paths)->default_value(0),
+         "TE controllers place flows on the first of this many edge disjoint shortest paths with room left (0 "
+         "routes around full edges instead)");
     po::variables_map vmap;
     po::store(po::command_line_parser(argc, argv).options(args).run(), vmap);
     po::notify(vmap);
@@ -88,6 +128,33 @@ int main(int argc, char* argv[]) {
         return 0;
     }
 
+    if (!PILO::EventQueue::parse_type(queue_name, queue)) {
+        std::cerr << "Unknown event queue " << queue_name << std::endl;
+        return 0;
+    }
+
+    PILO::Controller::Forwarding forwarding_mode;
+    if (forwarding == "flow") {
+        forwarding_mode = PILO::Controller::PER_FLOW;
+    } else if (forwarding == "destination") {
+        forwarding_mode = PILO::Controller::DESTINATION;
+    } else if (forwarding == "aggregated") {
+        forwarding_mode = PILO::Controller::AGGREGATED;
+    } else {
+        std::cerr << "Unknown forwarding " << forwarding << std::endl;
+        return 0;
+    }
+
+    if (vmap.count("parallel") && (partitions == 0 || vmap.count("converge"))) {
+        std::cerr << "--parallel needs at least one partition and cannot be combined with --converge" << std::endl;
+        return 0;
+    }
+
+    if (vmap.count("optimistic") && (!vmap.count("parallel") || checkpoint_interval == 0)) {
+        std::cerr << "--optimistic needs --parallel and a positive checkpoint interval" << std::endl;
+        return 0;
+    }
+
     fastforward = !(!vmap.count("fastforward"));
     te = !(!vmap.count("te"));
 
@@ -116,8 +183,25 @@ int main(int argc, char* argv[]) {
     crit_link = vmap.count("critlinks");
 
     std::cout << "Simulation setting limit to " << flow_limit << std::endl;
-    PILO::Simulation simulation(seed, configuration, topology, versioned, end_time, refresh, gossip, bw, flow_limit,
-                                std::move(link_drop_distribution), std::move(ctrl_drop_distribution));
+    PILO::Controller::set_route_threads(route_threads);
+    PILO::Controller::set_route_cache(route_cache);
+    PILO::Controller::set_hold_down(hold_down);
+    PILO::Controller::set_gossip_digests(vmap.count("digest-gossip") > 0);
+    PILO::Controller::set_forwarding(forwarding_mode);
+    PILO::TeController::set_incremental(vmap.count("te-incremental") > 0);
+    PILO::TeController::set_candidates(te_paths);
+    std::cout << "Event queue " << PILO::EventQueue::IType[queue] << std::endl;
+    PILO::Simulation simulation(seed, configuration, topology, versioned, end_time, queue, refresh, gossip, bw,
+                                flow_limit, std::move(link_drop_distribution), std::move(ctrl_drop_distribution),
+                                partitions, vmap.count("optimistic") > 0, checkpoint_interval, optimism_window);
+    if (!simulation.check_partitioning().empty()) {
+        std::cerr << simulation.check_partitioning() << std::endl;
+        return 0;
+    }
+    if (vmap.count("queue-trace")) {
+        queue_trace_file.open(queue_trace);
+        simulation._context.record_trace(&queue_trace_file);
+    }
     simulation.set_all_links_up_silent();
     simulation.install_all_routes();
     double r, g, n, d;
@@ -157,6 +241,7 @@ int main(int argc, char* argv[]) {
             simulation.run();
             std::cout << "CONVERGE " << link->name() << " " << simulation._context.now() << std::endl;
         }
+        simulation.dump_event_stats();
         return 1;
     } else {
         do {
@@ -220,8 +305,11 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    auto start = std::chrono::steady_clock::now();
     simulation.run();
     std::cout << "Fin." << std::endl;
+    std::cout << "Wall time " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()
+              << std::endl;
     std::cout << "Convergence " << std::endl;
     for (auto time : samples) {
         std::cout << " !  " << std::setprecision(5) << time << " " << std::setprecision(5) << converged.at(time)
@@ -233,5 +321,6 @@ int main(int argc, char* argv[]) {
     }
 
     simulation.dump_bw_used();
+    simulation.dump_event_stats();
     return 0;
 }
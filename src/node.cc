@@ -2,30 +2,58 @@
 #include "node.h"
 
 namespace PILO {
-Node::Node(Context& context, const std::string& name) : _context(context), _name(name), _links() { (void)_context; }
+// Source id 0 is left for events that do not belong to any node.
+uint32_t Node::_count = 0;
 
-void Node::receive(std::shared_ptr<Packet> packet, Link* link) {
+Node::Node(Context& context, const std::string& name)
+    : _context(context), _name(name), _id(Ids::node(name)), _events{++_count, 0}, _links() {
+    (void)_context;
+}
+
+void Node::receive(PacketPtr packet, Link* link) {
     // std::cout << _context.now() << "   " <<  _name << " received packet "
     //<< packet->_sig << " of size " << packet->_size << " (" << packet.use_count() << ")" << std::endl;
 }
 
+std::shared_ptr<Node::State> Node::save_state() const {
+    auto state = std::make_shared<State>();
+    state->events = _events;
+    return state;
+}
+
+void Node::restore_state(const State& state) { _events = state.events; }
+
 void Node::notify_link_existence(Link* link) {
     // Add link
-    _links.emplace(std::make_pair(link->name(), link));
+    _links.push_back(link);
+}
+
+Link* Node::link(LinkId link) const {
+    size_t p = port(link);
+    return (p < _links.size() ? _links[p] : NULL);
+}
+
+size_t Node::port(LinkId link) const {
+    // Nodes have few links, a scan beats hashing.
+    size_t p = 0;
+    while (p < _links.size() && _links[p]->id() != link) {
+        p++;
+    }
+    return p;
 }
 
-void Node::flood(std::shared_ptr<Packet> packet) {
+void Node::flood(PacketPtr packet) {
     for (auto link : _links) {
-        link.second->send(this, packet);
+        link->send(this, packet);
     }
 }
 
-void Node::flood(std::shared_ptr<Packet> packet, const std::string& l) {
+void Node::flood(PacketPtr packet, LinkId l) {
     for (auto link : _links) {
-        if (link.first == l) {
+        if (link->id() == l) {
             continue;
         }
-        link.second->send(this, packet);
+        link->send(this, packet);
     }
 }
 }
@@ -1,8 +1,10 @@
 #include "packet.h"
 #include "node.h"
+#include <new>
 namespace PILO {
-const std::string Packet::WILDCARD = "ALL";
-uint64_t Packet::pid = 0;
+const NodeId Packet::WILDCARD;
+const size_t Packet::FULL_TABLE;
+thread_local uint64_t Packet::pid = 0;
 const std::string Packet::IType[] = {"DATA",
                                      "NOP",
                                      "ECHO",
@@ -15,21 +17,218 @@ const std::string Packet::IType[] = {"DATA",
                                      "GOSSIP_REP",
                                      "SWITCH_TABLE_REQ",
                                      "SWITCH_TABLE_RESP",
+                                     "GOSSIP_DIGEST",
                                      "END"};
-std::shared_ptr<Packet> Packet::make_packet(std::shared_ptr<Node> src, std::shared_ptr<Node> dest, Packet::Type type,
-                                            size_t size) {
-    return Packet::make_packet(src->_name, dest->_name, type, size);
+thread_local Packet::Pool* Packet::_pool = NULL;
+std::atomic<int64_t> Packet::_live(0);
+std::atomic<int64_t> Packet::_peak(0);
+std::atomic<uint64_t> Packet::_allocated(0);
+
+Packet::Pool& Packet::pool() {
+    if (!_pool) {
+        _pool = new Pool();
+    }
+    return *_pool;
+}
+
+Packet::Payload Packet::payload(Type type) {
+    switch (type) {
+        case CHANGE_RULES:
+        case SWITCH_TABLE_RESP:
+            return RULES;
+        case SWITCH_INFORMATION:
+            return LINK_REPORTS;
+        case GOSSIP:
+            return GOSSIP_SUMMARY;
+        case GOSSIP_REP:
+            return GOSSIP_LOG;
+        case GOSSIP_DIGEST:
+            return DIGESTS;
+        default:
+            return NO_PAYLOAD;
+    }
+}
+
+Packet::Packet(Pool* owner, Type type) : _type(type), _refs(0), _owner(owner) {
+    switch (payload(type)) {
+        case RULES:
+            new (&_payload.rules) Rules();
+            break;
+        case LINK_REPORTS:
+            new (&_payload.reports) std::vector<LinkReport>();
+            break;
+        case GOSSIP_SUMMARY:
+            new (&_payload.gossip) Gossip();
+            break;
+        case GOSSIP_LOG:
+            new (&_payload.log) std::vector<GossipLog>();
+            break;
+        case DIGESTS:
+            new (&_payload.digests) std::vector<Digest>();
+            break;
+        case NO_PAYLOAD:
+            break;
+    }
+}
+
+Packet::~Packet() {
+    switch (payload(_type)) {
+        case RULES:
+            _payload.rules.~Rules();
+            break;
+        case LINK_REPORTS:
+            _payload.reports.~vector();
+            break;
+        case GOSSIP_SUMMARY:
+            _payload.gossip.~Gossip();
+            break;
+        case GOSSIP_LOG:
+            _payload.log.~vector();
+            break;
+        case DIGESTS:
+            _payload.digests.~vector();
+            break;
+        case NO_PAYLOAD:
+            break;
+    }
+}
+
+void Packet::clear() {
+    switch (payload(_type)) {
+        case RULES:
+            _payload.rules.rules.clear();
+            _payload.rules.removed.clear();
+            break;
+        case LINK_REPORTS:
+            _payload.reports.clear();
+            break;
+        case GOSSIP_SUMMARY:
+            _payload.gossip.links.clear();
+            _payload.gossip.gaps.clear();
+            break;
+        case GOSSIP_LOG:
+            _payload.log.clear();
+            break;
+        case DIGESTS:
+            _payload.digests.clear();
+            break;
+        case NO_PAYLOAD:
+            break;
+    }
 }
 
-std::shared_ptr<Packet> Packet::make_packet(std::shared_ptr<Node> src, Packet::Type type, size_t size) {
-    return Packet::make_packet(src->_name, WILDCARD, type, size);
+size_t Packet::size() const {
+    switch (_type) {
+        case LINK_UP:
+        case LINK_DOWN:
+            return HEADER + 64 + 64;  // 64 bit link ID + 64 bit version
+        case CHANGE_RULES:
+            // 64 bit sequence number, then each rule as below
+            return HEADER + 64 + (_payload.rules.rules.size() + _payload.rules.removed.size()) * (64 + HEADER);
+        case SWITCH_TABLE_RESP:
+            // Each rule (added or removed) is a header + link to go out
+            return HEADER + (_payload.rules.rules.size() + _payload.rules.removed.size()) * (64 + HEADER);
+        case SWITCH_INFORMATION:
+            return HEADER + _payload.reports.size() * (64 + 64 + 8);
+        case GOSSIP:
+            // 64 bit link ID and version per link, 64 bit for each side of a gap
+            return HEADER + _payload.gossip.links.size() * (64 + 64) + _payload.gossip.gaps.size() * 64;
+        case GOSSIP_REP:
+            return HEADER + _payload.log.size() * (64 + 64 + 8);
+        case GOSSIP_DIGEST:
+            // 32 bit tree node (level and index) and 64 bit hash per node
+            return HEADER + _payload.digests.size() * (32 + 64);
+        default:
+            return HEADER;
+    }
 }
 
-std::shared_ptr<Packet> Packet::make_packet(std::string src, Packet::Type type, size_t size) {
-    return std::make_shared<Packet>(src, WILDCARD, type, size);
+Packet* Packet::acquire(Type type) {
+    Pool& owner = pool();
+    auto& free = owner.free[type];
+    if (free.empty()) {
+        std::lock_guard<std::mutex> guard(owner.lock);
+        free.swap(owner.returned[type]);
+    }
+    Packet* packet;
+    if (free.empty()) {
+        packet = new Packet(&owner, type);
+        _allocated.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        packet = free.back();
+        free.pop_back();
+    }
+    int64_t live = _live.fetch_add(1, std::memory_order_relaxed) + 1;
+    int64_t peak = _peak.load(std::memory_order_relaxed);
+    while (live > peak && !_peak.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+    }
+    assert(packet->_type == type);
+    return packet;
+}
+
+void Packet::release(Packet* packet) {
+    // Empty the payload but keep its storage around for the next packet of this type.
+    packet->clear();
+    _live.fetch_sub(1, std::memory_order_relaxed);
+    Pool* owner = packet->_owner;
+    if (owner == _pool) {
+        owner->free[packet->_type].push_back(packet);
+    } else {
+        std::lock_guard<std::mutex> guard(owner->lock);
+        owner->returned[packet->_type].push_back(packet);
+    }
+}
+
+PacketPtr Packet::make_packet(std::shared_ptr<Node> src, std::shared_ptr<Node> dest, Packet::Type type) {
+    return Packet::make_packet(src->_id, dest->_id, type);
+}
+
+PacketPtr Packet::make_packet(std::shared_ptr<Node> src, Packet::Type type) {
+    return Packet::make_packet(src->_id, WILDCARD, type);
+}
+
+PacketPtr Packet::make_packet(NodeId src, Packet::Type type) { return Packet::make_packet(src, WILDCARD, type); }
+
+PacketPtr Packet::make_packet(NodeId src, NodeId dest, Packet::Type type) {
+    Packet* packet = acquire(type);
+    packet->_source = src;
+    packet->_destination = dest;
+    packet->_flow = Ids::flow(src, dest);
+    packet->_id = pid;
+    pid++;
+    packet->data.link = Ids::NONE;
+    packet->data.version = 0;
+    packet->data.since = 0;
+    packet->data.hash = 0;
+    return PacketPtr(packet);
 }
 
-std::shared_ptr<Packet> Packet::make_packet(std::string src, std::string dest, Packet::Type type, size_t size) {
-    return std::make_shared<Packet>(src, dest, type, size);
+PacketPtr Packet::copy(const Packet& packet) {
+    Packet* clone = acquire(packet._type);
+    clone->_source = packet._source;
+    clone->_destination = packet._destination;
+    clone->_flow = packet._flow;
+    clone->_id = packet._id;
+    clone->data = packet.data;
+    switch (payload(packet._type)) {
+        case RULES:
+            clone->_payload.rules = packet._payload.rules;
+            break;
+        case LINK_REPORTS:
+            clone->_payload.reports = packet._payload.reports;
+            break;
+        case GOSSIP_SUMMARY:
+            clone->_payload.gossip = packet._payload.gossip;
+            break;
+        case GOSSIP_LOG:
+            clone->_payload.log = packet._payload.log;
+            break;
+        case DIGESTS:
+            clone->_payload.digests = packet._payload.digests;
+            break;
+        case NO_PAYLOAD:
+            break;
+    }
+    return PacketPtr(clone);
 }
 }
@@ -0,0 +1,375 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include "packet.h"
+#include "parallel.h"
+
+namespace PILO {
+thread_local std::string* PartitionedOutput::_buffer = NULL;
+const int TimeWarpEngine::GVT_INTERVAL_MS;
+
+PartitionedOutput::PartitionedOutput(std::ostream& stream, size_t partitions)
+    : _stream(stream), _target(stream.rdbuf()), _buffers(partitions) {
+    _stream.rdbuf(this);
+}
+
+PartitionedOutput::~PartitionedOutput() {
+    flush();
+    _stream.rdbuf(_target);
+}
+
+void PartitionedOutput::flush() {
+    for (auto& buffer : _buffers) {
+        _target->sputn(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+    _target->pubsync();
+}
+
+int PartitionedOutput::overflow(int c) {
+    if (c == traits_type::eof()) {
+        return traits_type::not_eof(c);
+    }
+    if (_buffer) {
+        _buffer->push_back(traits_type::to_char_type(c));
+        return c;
+    }
+    return _target->sputc(traits_type::to_char_type(c));
+}
+
+std::streamsize PartitionedOutput::xsputn(const char* s, std::streamsize n) {
+    if (_buffer) {
+        _buffer->append(s, n);
+        return n;
+    }
+    return _target->sputn(s, n);
+}
+
+int PartitionedOutput::sync() { return (_buffer ? 0 : _target->pubsync()); }
+
+ParallelEngine::ParallelEngine(Context& global, const std::vector<std::unique_ptr<Context>>& partitions,
+                               Time lookahead, Time end)
+    : _global(global),
+      _partitions(partitions),
+      _lookahead(lookahead),
+      _end(end),
+      _output(std::cout, partitions.size()),
+      _workers(),
+      _generation(0),
+      _pending(0),
+      _limit(0),
+      _quit(false),
+      _windows(0),
+      _globalSteps(0) {
+    for (size_t i = 0; i < _partitions.size(); i++) {
+        _workers.emplace_back(&ParallelEngine::worker, this, i);
+    }
+}
+
+ParallelEngine::~ParallelEngine() {
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _quit = true;
+    }
+    _start.notify_all();
+    for (auto& worker : _workers) {
+        worker.join();
+    }
+}
+
+void ParallelEngine::worker(size_t idx) {
+    // Packet ids only need to be unique, give each partition its own range.
+    Packet::pid = (uint64_t)(idx + 1) << 48;
+    _output.attach(idx);
+    uint64_t generation = 0;
+    while (true) {
+        Time limit;
+        {
+            std::unique_lock<std::mutex> guard(_lock);
+            _start.wait(guard, [&] { return _quit || _generation != generation; });
+            if (_quit) {
+                return;
+            }
+            generation = _generation;
+            limit = _limit;
+        }
+        _partitions[idx]->run_until(limit);
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            _pending--;
+        }
+        _done.notify_one();
+    }
+}
+
+void ParallelEngine::run_window(Time limit) {
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _limit = limit;
+        _pending = _workers.size();
+        _generation++;
+    }
+    _start.notify_all();
+    std::unique_lock<std::mutex> guard(_lock);
+    _done.wait(guard, [&] { return _pending == 0; });
+}
+
+void ParallelEngine::run(const bool& stopped) {
+    const Time horizon = std::nextafter(_end, std::numeric_limits<Time>::infinity());
+    uint64_t lastMajor = 0;
+    while (!stopped) {
+        Time first = std::numeric_limits<Time>::infinity();
+        for (auto& partition : _partitions) {
+            partition->drain();
+            first = std::min(first, partition->next_time());
+        }
+        Time global = _global.next_time();
+        Time now = std::min(first, global);
+        if (now > _end) {
+            break;
+        }
+        if ((uint64_t)(now) / 100 > lastMajor) {
+            lastMajor = (uint64_t)(now) / 100;
+            std::cout << "Now executing for " << now << std::endl;
+        }
+        if (global <= first) {
+            // Global events see every partition at the same time.
+            for (auto& partition : _partitions) {
+                partition->set_time(global);
+            }
+            _global.run_until(std::nextafter(global, std::numeric_limits<Time>::infinity()));
+            _globalSteps++;
+        } else {
+            Time limit = std::min(std::min(first + _lookahead, global), horizon);
+            run_window(std::max(limit, std::nextafter(first, std::numeric_limits<Time>::infinity())));
+            _output.flush();
+            _windows++;
+        }
+    }
+    std::cout << "Parallel partitions " << _partitions.size() << " lookahead " << _lookahead << " windows "
+              << _windows << " global steps " << _globalSteps << std::endl;
+}
+
+TimeWarpEngine::TimeWarpEngine(Context& global, const std::vector<std::unique_ptr<Context>>& partitions,
+                               size_t checkpointInterval, Time window, Time end)
+    : _global(global),
+      _partitions(partitions),
+      _window(window),
+      _end(end),
+      _output(std::cout, partitions.size()),
+      _workers(),
+      _generation(0),
+      _limit(0),
+      _running(0),
+      _parked(0),
+      _pause(false),
+      _epochDone(false),
+      _quit(false),
+      _busy(0),
+      _clocks(new std::atomic<Time>[partitions.size()]),
+      _epochs(0),
+      _gvts(0),
+      _throttled(0) {
+    for (size_t i = 0; i < _partitions.size(); i++) {
+        _clocks[i] = 0;
+        _partitions[i]->speculate(_output.buffer(i), &_busy, checkpointInterval);
+    }
+    for (size_t i = 0; i < _partitions.size(); i++) {
+        _workers.emplace_back(&TimeWarpEngine::worker, this, i);
+    }
+}
+
+TimeWarpEngine::~TimeWarpEngine() {
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _quit = true;
+    }
+    _start.notify_all();
+    for (auto& worker : _workers) {
+        worker.join();
+    }
+}
+
+void TimeWarpEngine::wake_all() {
+    for (auto& partition : _partitions) {
+        partition->notify();
+    }
+}
+
+bool TimeWarpEngine::throttled(size_t idx, Time next) const {
+    for (size_t i = 0; i < _partitions.size(); i++) {
+        if (i != idx && next > _clocks[i].load(std::memory_order_relaxed) + _window) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void TimeWarpEngine::worker(size_t idx) {
+    Packet::pid = (uint64_t)(idx + 1) << 48;
+    _output.attach(idx);
+    Context& context = *_partitions[idx];
+    uint64_t generation = 0;
+    while (true) {
+        Time limit;
+        {
+            std::unique_lock<std::mutex> guard(_lock);
+            _start.wait(guard, [&] { return _quit || _generation != generation; });
+            if (_quit) {
+                return;
+            }
+            generation = _generation;
+            limit = _limit;
+        }
+        context.commit();
+        bool idle = false;
+        while (true) {
+            if (_pause) {
+                std::unique_lock<std::mutex> guard(_lock);
+                _parked++;
+                _done.notify_all();
+                _resume.wait(guard, [&] { return !_pause; });
+                _parked--;
+                continue;
+            }
+            if (_epochDone) {
+                break;
+            }
+            if (!context.inbox_empty()) {
+                if (idle) {
+                    // Count ourselves before the messages we are about to receive stop being counted.
+                    _busy++;
+                    idle = false;
+                }
+                context.drain();
+            }
+            if (!idle) {
+                Time next = context.next_time();
+                _clocks[idx].store(next, std::memory_order_relaxed);
+                if (next < limit) {
+                    // The partition furthest behind is never throttled, so someone always makes progress.
+                    if (throttled(idx, next)) {
+                        _throttled.fetch_add(1, std::memory_order_relaxed);
+                        std::this_thread::yield();
+                    } else {
+                        context.step();
+                    }
+                    continue;
+                }
+                idle = true;
+                if (_busy.fetch_sub(1) == 1) {
+                    std::lock_guard<std::mutex> guard(_lock);
+                    _done.notify_all();
+                }
+            }
+            context.wait_for_messages([&] { return _pause || _epochDone; });
+        }
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            _running--;
+        }
+        _done.notify_all();
+    }
+}
+
+void TimeWarpEngine::collect() {
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _pause = true;
+    }
+    wake_all();
+    {
+        std::unique_lock<std::mutex> guard(_lock);
+        _done.wait(guard, [&] { return _parked == _workers.size(); });
+    }
+    // Every message is either queued or in an inbox, nothing earlier can show up anymore.
+    Time gvt = std::numeric_limits<Time>::infinity();
+    for (auto& partition : _partitions) {
+        gvt = std::min(gvt, std::min(partition->next_time(), partition->inbox_time()));
+    }
+    for (auto& partition : _partitions) {
+        partition->fossil_collect(gvt, _output.target());
+    }
+    _gvts++;
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _pause = false;
+    }
+    _resume.notify_all();
+}
+
+void TimeWarpEngine::run_epoch(Time limit) {
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _limit = limit;
+        _epochDone = false;
+        _running = _workers.size();
+        _busy += _workers.size();
+        _generation++;
+    }
+    _start.notify_all();
+    {
+        std::unique_lock<std::mutex> guard(_lock);
+        while (!_done.wait_for(guard, std::chrono::milliseconds(GVT_INTERVAL_MS), [&] { return _busy == 0; })) {
+            guard.unlock();
+            collect();
+            guard.lock();
+        }
+    }
+    _epochDone = true;
+    wake_all();
+    {
+        std::unique_lock<std::mutex> guard(_lock);
+        _done.wait(guard, [&] { return _running == 0; });
+    }
+    for (auto& partition : _partitions) {
+        partition->fossil_collect(limit, _output.target());
+    }
+    _output.target()->pubsync();
+}
+
+void TimeWarpEngine::run(const bool& stopped) {
+    const Time horizon = std::nextafter(_end, std::numeric_limits<Time>::infinity());
+    uint64_t lastMajor = 0;
+    while (!stopped) {
+        Time first = std::numeric_limits<Time>::infinity();
+        for (auto& partition : _partitions) {
+            first = std::min(first, std::min(partition->next_time(), partition->inbox_time()));
+        }
+        Time global = _global.next_time();
+        Time now = std::min(first, global);
+        if (now > _end) {
+            break;
+        }
+        if ((uint64_t)(now) / 100 > lastMajor) {
+            lastMajor = (uint64_t)(now) / 100;
+            std::cout << "Now executing for " << now << std::endl;
+        }
+        if (global <= first) {
+            for (auto& partition : _partitions) {
+                partition->set_time(global);
+            }
+            _global.run_until(std::nextafter(global, std::numeric_limits<Time>::infinity()));
+        } else {
+            run_epoch(std::min(global, horizon));
+            _epochs++;
+        }
+    }
+    Context::SpeculationStats total{0, 0, 0, 0, 0, 0};
+    for (auto& partition : _partitions) {
+        auto& stats = partition->speculation_stats();
+        total.executed += stats.executed;
+        total.rollbacks += stats.rollbacks;
+        total.rolledBack += stats.rolledBack;
+        total.coasted += stats.coasted;
+        total.cancelled += stats.cancelled;
+        total.checkpoints += stats.checkpoints;
+    }
+    std::cout << "Optimistic partitions " << _partitions.size() << " window " << _window << " epochs " << _epochs
+              << " gvt rounds " << _gvts << " throttled " << _throttled << " executed " << total.executed << " rollbacks " << total.rollbacks << " rolled back "
+              << total.rolledBack << " coasted " << total.coasted << " cancelled " << total.cancelled
+              << " checkpoints " << total.checkpoints << std::endl;
+}
+}
@@ -0,0 +1,51 @@
+#include "rule_table.h"
+#include <algorithm>
+
+namespace PILO {
+namespace {
+inline bool before(const RuleTable::Rule& rule, FlowId flow) { return rule.first < flow; }
+}
+
+LinkId RuleTable::find(FlowId flow) const {
+    auto rule = std::lower_bound(_rules.begin(), _rules.end(), flow, before);
+    return (rule != _rules.end() && rule->first == flow) ? rule->second : Ids::NONE;
+}
+
+LinkId RuleTable::set(FlowId flow, LinkId link) {
+    auto rule = std::lower_bound(_rules.begin(), _rules.end(), flow, before);
+    if (rule != _rules.end() && rule->first == flow) {
+        LinkId old = rule->second;
+        if (link == Ids::NONE) {
+            _rules.erase(rule);
+        } else {
+            rule->second = link;
+        }
+        return old;
+    }
+    if (link != Ids::NONE) {
+        _rules.emplace(rule, flow, link);
+    }
+    return Ids::NONE;
+}
+
+void RuleTable::assign(std::vector<Rule>&& rules) {
+    _rules = std::move(rules);
+    auto by_flow = [](const Rule& a, const Rule& b) { return a.first < b.first; };
+    // Rules from switches come sorted already.
+    if (std::adjacent_find(_rules.begin(), _rules.end(), [](const Rule& a, const Rule& b) {
+            return a.first >= b.first;
+        }) == _rules.end()) {
+        return;
+    }
+    std::stable_sort(_rules.begin(), _rules.end(), by_flow);
+    // Keep the last of each run of rules for the same flow.
+    size_t out = 0;
+    for (size_t i = 0; i < _rules.size(); i++) {
+        if (i + 1 < _rules.size() && _rules[i + 1].first == _rules[i].first) {
+            continue;
+        }
+        _rules[out++] = _rules[i];
+    }
+    _rules.resize(out);
+}
+}
@@ -1,3 +1,5 @@
+#include <deque>
+#include <boost/functional/hash.hpp>
 #include "simulation.h"
 namespace {
 const std::string LINKS_KEY = "links";
@@ -12,18 +14,35 @@ const std::string CONTROLLER_TYPE = "LSGossipControl";
 const std::string TE_CONTROLLER_TYPE = "LSTEControl";
 const std::string COORD_CONTROLLER_TYPE = "CoordinationOracleControl";
 const std::string SWITCH_TYPE = "LinkStateSwitch";
+
+std::vector<std::unique_ptr<PILO::Context>> make_partitions(const size_t partitions, const PILO::Time endTime,
+                                                            const PILO::EventQueue::Type queue) {
+    std::vector<std::unique_ptr<PILO::Context>> contexts;
+    for (size_t i = 0; i < partitions; i++) {
+        contexts.emplace_back(new PILO::Context(endTime, queue));
+        // Before any node gets to schedule something.
+        contexts.back()->attribute_events();
+    }
+    return contexts;
+}
 }
 
 namespace PILO {
 Simulation::Simulation(const uint32_t seed, const std::string& configuration, const std::string& topology, bool version,
-                       const Time endTime, const Time refresh, const Time gossip, const BPS bw, const int limit,
-                       std::unique_ptr<Distribution<bool>>&& drop, std::unique_ptr<Distribution<bool>>&& cdrop)
-    : _context(endTime),
+                       const Time endTime, const EventQueue::Type queue, const Time refresh, const Time gossip,
+                       const BPS bw, const int limit, std::unique_ptr<Distribution<bool>>&& drop,
+                       std::unique_ptr<Distribution<bool>>&& cdrop, const size_t partitions,
+                       const bool optimistic, const size_t checkpointInterval, const Time window)
+    : _context(endTime, queue),
       _flowLimit(limit),
       _seed(seed),
       _rng(_seed),
       _dropRng(std::move(drop)),
       _cdropRng(std::move(cdrop)),
+      _topologyEpoch(1),
+      _distances(),
+      _distanceRow(),
+      _distanceEpoch(0),
       _configuration(YAML::LoadFile(configuration)),
       _topology(YAML::LoadFile(topology)),
       _latency(Distribution<PILO::Time>::get_distribution(_configuration["data_link_latency"], _rng)),
@@ -31,6 +50,14 @@ Simulation::Simulation(const uint32_t seed, const std::string& configuration, co
                                                                ? _configuration["data_link_hlatency"]
                                                                : _configuration["data_link_latency"],
                                                            _rng)),
+      _partitions(make_partitions(partitions, endTime, queue)),
+      _partitionOf(partitions ? partition_nodes(partitions) : std::unordered_map<std::string, size_t>()),
+      _nodeRngs(),
+      _nodeDrops(),
+      _lookahead(std::numeric_limits<Time>::infinity()),
+      _optimistic(optimistic),
+      _checkpointInterval(checkpointInterval),
+      _window(window),
       _vmap(),
       _ivmap(),
       _nsmap(),
@@ -49,8 +76,6 @@ Simulation::Simulation(const uint32_t seed, const std::string& configuration, co
       _linkRng(0, _links.size() - 1, _rng),
       _nodeRng(0, _nodes.size() - 1, _rng),
       _stopped(false) {
-    // Do not print igraph warnings
-    igraph_set_warning_handler(igraph_warning_handler_ignore);
     std::cout << "PILO simulation set limit = " << _flowLimit << "    " << limit << std::endl;
     // Populate controller information
     Coordinator::GetInstance()->set_context(&_context);
@@ -60,12 +85,174 @@ Simulation::Simulation(const uint32_t seed, const std::string& configuration, co
         cobj->add_switches(_switches);
         cobj->add_nodes(_others);
     }
+    setup_partitions();
+}
+
+std::unordered_map<std::string, size_t> Simulation::partition_nodes(const size_t partitions) const {
+    std::vector<std::string> switches;
+    std::vector<std::string> controllers;
+    std::vector<std::string> others;
+    std::unordered_map<std::string, std::vector<std::string>> adjacent;
+    for (auto& node : _topology) {
+        std::string node_str = node.first.as<std::string>();
+        if (node_str == LINKS_KEY || node_str == FAIL_KEY || node_str == RUNFILE_KEY || node_str == CRIT_KEY ||
+            node_str == HLAT_LINKS_KEY) {
+            continue;
+        }
+        std::string type_str = node.second[TYPE_KEY].as<std::string>();
+        if (type_str == SWITCH_TYPE) {
+            switches.push_back(node_str);
+        } else if (type_str == TE_CONTROLLER_TYPE || type_str == CONTROLLER_TYPE ||
+                   type_str == COORD_CONTROLLER_TYPE) {
+            controllers.push_back(node_str);
+        } else {
+            others.push_back(node_str);
+        }
+    }
+    for (auto& key : {LINKS_KEY, HLAT_LINKS_KEY}) {
+        if (!_topology[key]) {
+            continue;
+        }
+        for (auto link : _topology[key]) {
+            std::vector<std::string> parts;
+            boost::split(parts, link.as<std::string>(), boost::is_any_of("-"));
+            adjacent[parts[0]].push_back(parts[1]);
+            adjacent[parts[1]].push_back(parts[0]);
+        }
+    }
+
+    // Breadth first order keeps neighbouring switches together, so chunks of it cut few links.
+    std::unordered_map<std::string, size_t> partitionOf;
+    std::unordered_set<std::string> switchSet(switches.begin(), switches.end());
+    std::unordered_set<std::string> visited;
+    std::vector<std::string> order;
+    for (auto& root : switches) {
+        if (!visited.emplace(root).second) {
+            continue;
+        }
+        std::deque<std::string> frontier{root};
+        while (!frontier.empty()) {
+            std::string sw = frontier.front();
+            frontier.pop_front();
+            order.push_back(sw);
+            for (auto& neighbor : adjacent[sw]) {
+                if (switchSet.count(neighbor) && visited.emplace(neighbor).second) {
+                    frontier.push_back(neighbor);
+                }
+            }
+        }
+    }
+    size_t chunk = std::max<size_t>(1, (order.size() + partitions - 1) / partitions);
+    for (size_t i = 0; i < order.size(); i++) {
+        partitionOf.emplace(order[i], i / chunk);
+    }
+    // Controllers do most of the work (route computation), spread them out.
+    for (size_t i = 0; i < controllers.size(); i++) {
+        partitionOf.emplace(controllers[i], i % partitions);
+    }
+    for (auto& other : others) {
+        size_t partition = 0;
+        for (auto& neighbor : adjacent[other]) {
+            if (switchSet.count(neighbor)) {
+                partition = partitionOf.at(neighbor);
+                break;
+            }
+        }
+        partitionOf.emplace(other, partition);
+    }
+    return partitionOf;
+}
+
+Context& Simulation::context_for(const std::string& node) {
+    return (_partitions.empty() ? _context : *_partitions[_partitionOf.at(node)]);
+}
+
+void Simulation::setup_partitions() {
+    if (_partitions.empty()) {
+        return;
+    }
+    for (auto link : _links) {
+        link.second->partition(_seed);
+        if (_partitionOf.at(link.second->_a->_name) != _partitionOf.at(link.second->_b->_name)) {
+            _lookahead = std::min(_lookahead, link.second->lookahead());
+        }
+    }
+    // Controllers share the control drop distribution, which would make draws depend on thread timing.
+    for (auto controller : _controllers) {
+        size_t stream = _seed;
+        boost::hash_combine(stream, controller.first);
+        _nodeRngs.emplace_back(new boost::mt19937((uint32_t)stream));
+        _nodeDrops.emplace_back(_cdropRng->clone(*_nodeRngs.back()));
+        controller.second->_drop = _nodeDrops.back().get();
+        if (_optimistic) {
+            boost::mt19937* rng = _nodeRngs.back().get();
+            context_for(controller.first).track_state(controller.second->_events.id, [rng] {
+                auto saved = std::make_shared<boost::mt19937>(*rng);
+                return [rng, saved] { *rng = *saved; };
+            });
+        }
+    }
+    if (_optimistic) {
+        for (auto node : _nodes) {
+            Node* obj = node.second.get();
+            context_for(node.first).track_state(obj->_events.id, [obj] {
+                std::shared_ptr<Node::State> saved = obj->save_state();
+                return [obj, saved] { obj->restore_state(*saved); };
+            });
+        }
+        // Each direction of a link is split between the sender (queue, random stream) and the receiver
+        // (statistics), which may well be in different partitions.
+        for (auto link : _links) {
+            Link* obj = link.second.get();
+            for (Node* sender : {obj->_a.get(), obj->_b.get()}) {
+                Node* receiver = (sender == obj->_a.get() ? obj->_b.get() : obj->_a.get());
+                context_for(sender->_name).track_state(sender->_events.id, [obj, sender] {
+                    return obj->save_direction(sender, true);
+                });
+                context_for(receiver->_name).track_state(receiver->_events.id, [obj, sender] {
+                    return obj->save_direction(sender, false);
+                });
+            }
+        }
+    }
+    std::cout << "Partitions " << _partitions.size() << " lookahead " << _lookahead << std::endl;
+}
+
+std::string Simulation::check_partitioning() const {
+    if (_partitions.empty()) {
+        return "";
+    }
+    for (auto controller : _controllers) {
+        if (std::dynamic_pointer_cast<CoordinationController>(controller.second)) {
+            return "Coordination controllers cannot be run partitioned";
+        }
+    }
+    // Time Warp does not need lookahead, stragglers are simply rolled back.
+    if (!_optimistic && !(_lookahead > 0.0)) {
+        return "Partitioning needs a positive minimum latency on cross-partition links (set min on the latency "
+               "distribution)";
+    }
+    return "";
+}
+
+void Simulation::run_parallel() {
+    if (_optimistic) {
+        TimeWarpEngine engine(_context, _partitions, _checkpointInterval, _window, _context.end());
+        engine.run(_stopped);
+    } else {
+        ParallelEngine engine(_context, _partitions, _lookahead, _context.end());
+        engine.run(_stopped);
+    }
+    Time now = _context.now();
+    for (auto& partition : _partitions) {
+        now = std::max(now, partition->now());
+    }
+    _context.set_time(now);
 }
 
 Simulation::node_map Simulation::populate_nodes(const Time refresh, const Time gossip, const bool version) {
-    igraph_empty(&_graph, 0, IGRAPH_UNDIRECTED);
     node_map nodeMap;
-    igraph_integer_t count = 0;
+    VertexId count = 0;
     for (auto& node : _topology) {
         std::string node_str = node.first.as<std::string>();
         if (node_str == LINKS_KEY || node_str == FAIL_KEY || node_str == RUNFILE_KEY || node_str == CRIT_KEY ||
@@ -75,35 +262,40 @@ Simulation::node_map Simulation::populate_nodes(const Time refresh, const Time g
         std::string type_str = node.second[TYPE_KEY].as<std::string>();
 
         if (type_str == SWITCH_TYPE) {
-            auto sw = std::make_shared<Switch>(_context, node_str, version);
+            auto sw = std::make_shared<Switch>(context_for(node_str), node_str, version);
             nodeMap.emplace(std::make_pair(node_str, sw));
             _switches.emplace(std::make_pair(node_str, sw));
-            _vmap.emplace(std::make_pair(node_str, count));
-            _ivmap.emplace(std::make_pair(count, node_str));
+            _ivmap.push_back(sw->_id);
             count++;
         } else if (type_str == TE_CONTROLLER_TYPE) {
             std::cout << "PILO simulation set limit = " << _flowLimit << std::endl;
-            auto c = std::make_shared<TeController>(_context, node_str, refresh, gossip, _flowLimit, _cdropRng.get());
+            auto c = std::make_shared<TeController>(context_for(node_str), node_str, refresh, gossip, _flowLimit,
+                                                    _cdropRng.get());
             std::cout << "TE Controller " << node_str << std::endl;
             nodeMap.emplace(std::make_pair(node_str, c));
             _controllers.emplace(std::make_pair(node_str, c));
         } else if (type_str == CONTROLLER_TYPE) {
-            auto c = std::make_shared<Controller>(_context, node_str, refresh, gossip, _cdropRng.get());
+            auto c = std::make_shared<Controller>(context_for(node_str), node_str, refresh, gossip, _cdropRng.get());
             std::cout << "Controller " << node_str << std::endl;
             nodeMap.emplace(std::make_pair(node_str, c));
             _controllers.emplace(std::make_pair(node_str, c));
         } else if (type_str == COORD_CONTROLLER_TYPE) {
-            auto c = std::make_shared<CoordinationController>(_context, node_str, refresh, gossip, _cdropRng.get());
+            auto c = std::make_shared<CoordinationController>(context_for(node_str), node_str, refresh, gossip,
+                                                              _cdropRng.get());
             std::cout << "Controller " << node_str << std::endl;
             nodeMap.emplace(std::make_pair(node_str, c));
             _controllers.emplace(std::make_pair(node_str, c));
         } else {
-            auto n = std::make_shared<Node>(_context, node_str);
+            auto n = std::make_shared<Node>(context_for(node_str), node_str);
             nodeMap.emplace(std::make_pair(node_str, n));
             _others.emplace(std::make_pair(node_str, n));
         }
     }
-    igraph_add_vertices(&_graph, count, NULL);
+    _vmap.assign(Ids::nodes(), -1);
+    for (VertexId vertex = 0; vertex < count; vertex++) {
+        _vmap[_ivmap[vertex]] = vertex;
+    }
+    _nsmap.assign(Ids::nodes(), Ids::ANY);
     return nodeMap;
 }
 
@@ -137,58 +329,56 @@ Simulation::link_map Simulation::populate_links(BPS bw) {
             linkMap.emplace(populate_link(link_str, bw, _hlatency));
         }
     }
+    _liveLinks.assign(Ids::links(), false);
+    _graph.build(_ivmap.size(), _vmap);
     return linkMap;
 }
 
 bool Simulation::add_host_graph_link(const std::shared_ptr<PILO::Link>& link) {
-    if (_switches.find(link->_a->_name) == _switches.end()) {
-        _nsmap.emplace(std::make_pair(link->_a->_name, link->_b->_name));
-        _liveLinks.emplace(link->name());
+    if (_vmap[link->_a->_id] < 0) {
+        _nsmap[link->_a->_id] = link->_b->_id;
+        _liveLinks[link->id()] = true;
         return true;
-    } else if (_switches.find(link->_b->_name) == _switches.end()) {
-        _nsmap.emplace(std::make_pair(link->_b->_name, link->_a->_name));
-        _liveLinks.emplace(link->name());
+    } else if (_vmap[link->_b->_id] < 0) {
+        _nsmap[link->_b->_id] = link->_a->_id;
+        _liveLinks[link->id()] = true;
         return true;
     }
     return false;
 }
 
 bool Simulation::remove_host_graph_link(const std::shared_ptr<PILO::Link>& link) {
-    if (_switches.find(link->_a->_name) == _switches.end()) {
-        _nsmap.erase(link->_a->_name);
-        _liveLinks.erase(link->name());
+    if (_vmap[link->_a->_id] < 0) {
+        _nsmap[link->_a->_id] = Ids::ANY;
+        _liveLinks[link->id()] = false;
         return true;
-    } else if (_switches.find(link->_b->_name) == _switches.end()) {
-        _nsmap.erase(link->_b->_name);
-        _liveLinks.erase(link->name());
+    } else if (_vmap[link->_b->_id] < 0) {
+        _nsmap[link->_b->_id] = Ids::ANY;
+        _liveLinks[link->id()] = false;
         return true;
     }
     return false;
 }
 
 void Simulation::add_graph_link(const std::shared_ptr<PILO::Link>& link) {
-    if (add_host_graph_link(link))
+    if (add_host_graph_link(link)) {
+        _topologyEpoch++;
         return;
-    uint32_t e0 = _vmap.at(link->_a->_name);
-    uint32_t e1 = _vmap.at(link->_b->_name);
-    igraph_integer_t eid;
-    igraph_get_eid(&_graph, &eid, e0, e1, IGRAPH_UNDIRECTED, 0);
-    if (eid == -1) {
-        igraph_add_edge(&_graph, e0, e1);
-        _liveLinks.emplace(link->name());
+    }
+    if (_graph.set_link(link->id(), true)) {
+        _liveLinks[link->id()] = true;
+        _topologyEpoch++;
     }
 }
 
 void Simulation::remove_graph_link(const std::shared_ptr<PILO::Link>& link) {
-    if (remove_host_graph_link(link))
+    if (remove_host_graph_link(link)) {
+        _topologyEpoch++;
         return;
-    uint32_t e0 = _vmap.at(link->_a->_name);
-    uint32_t e1 = _vmap.at(link->_b->_name);
-    igraph_integer_t eid;
-    igraph_get_eid(&_graph, &eid, e0, e1, IGRAPH_UNDIRECTED, 0);
-    if (eid != -1) {
-        igraph_delete_edges(&_graph, igraph_ess_1(eid));
-        _liveLinks.erase(link->name());
+    }
+    if (_graph.set_link(link->id(), false)) {
+        _liveLinks[link->id()] = false;
+        _topologyEpoch++;
     }
 }
 
@@ -225,7 +415,7 @@ void Simulation::set_all_links_up_silent() {
         link.second->silent_set_up();
         add_graph_link(link.second);
         for (auto controller : _controllers) {
-            controller.second->add_link(link.first, link.second->version());
+            controller.second->add_link(link.second->id(), link.second->version());
         }
     }
     // std::cout << "Controller Diameter " << compute_controller_diameter() << std::endl;
@@ -240,7 +430,7 @@ void Simulation::set_all_links_down_silent() {
         remove_graph_link(link.second);
 
         for (auto controller : _controllers) {
-            controller.second->remove_link(link.first, link.second->version());
+            controller.second->remove_link(link.second->id(), link.second->version());
         }
     }
     std::cout << "Controller Diameter " << compute_controller_diameter() << std::endl;
@@ -270,11 +460,19 @@ void Simulation::install_all_routes() {
     Controller::flowtable_db diffs;
     for (auto c : _controllers) {
         std::tie(diffs, std::ignore) = c.second->compute_paths();
+        // Routes are now up to date. A held down recomputation may also have been dropped with the event queue
+        // (--converge resets it), so let the next change schedule a new one.
+        c.second->_recompute.pending = false;
     }
     size_t min = 1ull << 33, max = 0, count = 0, total = 0;
-    for (auto diff : diffs) {
+    for (auto sw_pair : _switches) {
+        auto sw = sw_pair.second;
+        auto& diff = diffs[sw->_id];
+        if (diff.empty()) {
+            continue;
+        }
         count++;
-        size_t sz = diff.second.size();
+        size_t sz = diff.size();
         if (sz < min) {
             min = sz;
         }
@@ -282,13 +480,10 @@ void Simulation::install_all_routes() {
             max = sz;
         }
         total += sz;
-        auto sw = _switches.at(diff.first);
-        sw->install_flow_table(diff.second);
+        sw->install_flow_table(std::vector<Packet::Rule>(diff.begin(), diff.end()));
         // Update controller version
-        if (sz > 0) {
-            for (auto c : _controllers) {
-                c.second->_flow_version[diff.first]++;
-            }
+        for (auto c : _controllers) {
+            c.second->_flow_version[sw->_id]++;
         }
     }
     std::cout << "Rule sizes: min " << min << " max " << max << " count " << count << " total " << total << std::endl;
@@ -297,143 +492,228 @@ void Simulation::install_all_routes() {
 double Simulation::check_routes(double& global_distance, double& net_distance, double& difference) const {
     uint64_t checked = 0;
     uint64_t passed = 0;
-    igraph_matrix_t distances;
-    igraph_matrix_init(&distances, 1, 1);
-    igraph_shortest_paths(&_graph, &distances, igraph_vss_all(), igraph_vss_all(), IGRAPH_ALL);
+    // Hop counts from switches with hosts, kept until a link changes.
+    if (_distanceEpoch != _topologyEpoch) {
+        std::vector<VertexId> roots;
+        _distanceRow.assign(_graph.vertices(), -1);
+        for (auto& host : _others) {
+            NodeId sw = _nsmap[host.second->_id];
+            if (sw != Ids::ANY && _distanceRow[_vmap[sw]] < 0) {
+                _distanceRow[_vmap[sw]] = roots.size();
+                roots.push_back(_vmap[sw]);
+            }
+        }
+        _graph.distances(roots, _distances);
+        _distanceEpoch = _topologyEpoch;
+    }
     global_distance = 0.0;
     net_distance = 0.0;
     difference = 0.0;
     std::unordered_map<double, int64_t> distance_cdf;
 
-    for (auto h1 : _others) {
-        for (auto h2 : _others) {
-#if 0
-                std::cout << "Going to check" << std::endl;
-                std::cout << "\t" << h1.first << "   " << h2.first << "    ";
-#endif
-            if (h1.first == h2.first) {
-                continue;
-            }
-            // Skip if the underlying topology is disconnected
-            if (_nsmap.find(h1.first) == _nsmap.end() || _nsmap.find(h2.first) == _nsmap.end()) {
-                continue;
+    // Walks are done per destination. Forwarding to a destination is the same from every source at switches
+    // that only have rules for destinations (and the default route), so once a walk has left the last
+    // switch with rules for its flow, what happens next is worked out once per destination and switch.
+    std::vector<const Node*> hosts;
+    for (auto& host : _others) {
+        hosts.push_back(host.second.get());
+    }
+    std::vector<const Switch*> switch_at(Ids::nodes(), nullptr);
+    std::vector<char> by_destination(Ids::nodes(), false);
+    for (auto& sw : _switches) {
+        switch_at[sw.second->_id] = sw.second.get();
+        by_destination[sw.second->_id] = true;
+        for (auto& rule : sw.second->_forwardingTable) {
+            if (Ids::flow_source(rule.flow) != Ids::ANY) {
+                by_destination[sw.second->_id] = false;
+                break;
             }
-            igraph_integer_t v0 = _vmap.at(_nsmap.at(h1.first));
-            igraph_integer_t v1 = _vmap.at(_nsmap.at(h2.first));
-            if (MATRIX(distances, v0, v1) == IGRAPH_INFINITY) {
+        }
+    }
+    // Whether the flow from h1 to h2 is checked, and the vertices of their switches.
+    auto attached = [&](const Node* h1, const Node* h2, VertexId& v0, VertexId& v1) {
+        NodeId s0 = _nsmap[h1->_id];
+        NodeId s1 = _nsmap[h2->_id];
+        if (h1 == h2 || s0 == Ids::ANY || s1 == Ids::ANY) {
+            return false;
+        }
+        v0 = _vmap[s0];
+        v1 = _vmap[s1];
+        // Skip if the underlying topology is disconnected
+        return _distances[_distanceRow[v0]][v1] != Graph::UNREACHABLE;
+    };
+
+    // What walking a pair's flow from its source found: loops met (one per link out of the source at most),
+    // and whether it reached the destination, in how many hops.
+    struct Walk {
+        uint32_t hops = 0;
+        uint32_t loops = 0;
+        bool reached = false;
+    };
+    // Where walks from a switch (forwarding on destination) to the current destination end: a host (which may
+    // not be the destination) or Ids::ANY for a dead end, and hops to it.
+    struct Tail {
+        NodeId host;
+        uint32_t hops;
+    };
+    std::vector<Walk> walks(hosts.size() * hosts.size());
+    std::vector<Tail> tails(Ids::nodes());
+    std::vector<uint32_t> tail_stamp(Ids::nodes(), 0);
+    std::vector<uint32_t> visited(Ids::nodes(), 0);
+    uint32_t tail_epoch = 0, visit_epoch = 0;
+    std::vector<std::pair<NodeId, uint32_t>> run;  // Switches forwarding on destination up to the end, and hops.
+    for (size_t d = 0; d < hosts.size(); d++) {
+        const Node* h2 = hosts[d];
+        tail_epoch++;
+        for (size_t s = 0; s < hosts.size(); s++) {
+            const Node* h1 = hosts[s];
+            VertexId v0, v1;
+            if (!attached(h1, h2, v0, v1)) {
                 continue;
             }
-
-            checked += 1;
-            std::string sig = Packet::generate_signature(h1.first, h2.first, Packet::DATA);
-            std::unordered_set<std::string> visited;
-            for (auto begin_link : h1.second->_links) {
-                std::string link = begin_link.first;
-                auto current = h1.second;
-                igraph_real_t measured_distance = 0.0;
-                visited.emplace(current->_name);
-                while (current.get() != h2.second.get()) {
-                    if (_links.at(link)->is_up()) {
-                        current = _links.at(link)->get_other(current);
-                        measured_distance += 1.0;
-
-                        if (visited.find(current->_name) != visited.end()) {
-                            std::cout << "WARNING: LOOP DETECTED" << std::endl;
-                            break;
-                        }
-                        visited.emplace(current->_name);
-                        auto as_switch = std::dynamic_pointer_cast<Switch>(current);
-                        if (!as_switch) {
-                            // Maybe we have reached the end, maybe not. But this is not a switch.
-                            break;
-                        }
-                        auto entry = as_switch->_forwardingTable.find(sig);
-                        if (entry != as_switch->_forwardingTable.end()) {
-                            link = entry->second;
-                        } else {
+            Walk& result = walks[s * hosts.size() + d];
+            FlowId flow = Ids::flow(h1->_id, h2->_id);
+            // Hosts with more links share what they visited between links, so their walks depend on more
+            // than the switch they are at.
+            bool share = (h1->_links.size() == 1);
+            visit_epoch++;
+            visited[h1->_id] = visit_epoch;
+            for (Link* link : h1->_links) {
+                NodeId current = h1->_id;
+                uint32_t hops = 0;
+                NodeId end = Ids::ANY;  // Host reached, if any.
+                bool loop = false;
+                run.clear();
+                while (link->is_up()) {
+                    NodeId a, b;
+                    std::tie(a, b) = Ids::ends(link->id());
+                    current = (a == current ? b : a);
+                    hops++;
+                    if (visited[current] == visit_epoch) {
+                        loop = true;
+                        break;
+                    }
+                    visited[current] = visit_epoch;
+                    const Switch* sw = switch_at[current];
+                    if (!sw) {
+                        // Maybe we have reached the end, maybe not. But this is not a switch.
+                        end = current;
+                        break;
+                    }
+                    if (share && by_destination[current]) {
+                        if (tail_stamp[current] == tail_epoch) {
+                            end = tails[current].host;
+                            hops += tails[current].hops;
+                            // A walk that comes back to its source has looped.
+                            loop = (end == h1->_id);
                             break;
                         }
+                        run.emplace_back(current, hops);
                     } else {
-                        // std::cout << "Broken link " << link << std::endl;
+                        run.clear();
+                    }
+                    FlowTable::Port port = sw->output(flow);
+                    if (port == FlowTable::NONE) {
                         break;
                     }
+                    link = sw->_links[port];
                 }
-                if (current.get() == h2.second.get()) {
-                    igraph_real_t distance = MATRIX(distances, v0, v1);
-                    distance += 2.0;  // Tget to switch and back
-                    if (measured_distance >= distance) {
-                        if ((measured_distance - distance) >= difference) {
-                            difference = measured_distance - distance;
-                            net_distance = measured_distance;
-                            global_distance = distance;
-                        }
-                        if (distance_cdf.find(difference) == distance_cdf.end()) {
-                            distance_cdf.emplace(std::make_pair(difference, 1));
-                        } else {
-                            distance_cdf[difference] += 1;
-                        }
-                    } else {
-                        std::cout << "WARNING " << measured_distance << " " << distance << std::endl;
+                if (!loop || end != Ids::ANY) {
+                    for (auto& entry : run) {
+                        tail_stamp[entry.first] = tail_epoch;
+                        tails[entry.first] = {end, hops - entry.second};
                     }
-                    passed++;
+                }
+                if (loop) {
+                    result.loops++;
+                } else if (end == h2->_id) {
+                    result.reached = true;
+                    result.hops = hops;
                     break;
                 }
             }
         }
     }
+
+    for (size_t s = 0; s < hosts.size(); s++) {
+        for (size_t d = 0; d < hosts.size(); d++) {
+            VertexId v0, v1;
+            if (!attached(hosts[s], hosts[d], v0, v1)) {
+                continue;
+            }
+            checked += 1;
+            const Walk& result = walks[s * hosts.size() + d];
+            for (uint32_t loop = 0; loop < result.loops; loop++) {
+                std::cout << "WARNING: LOOP DETECTED" << std::endl;
+            }
+            if (result.reached) {
+                double measured_distance = result.hops;
+                double distance = _distances[_distanceRow[v0]][v1];
+                distance += 2.0;  // Tget to switch and back
+                if (measured_distance >= distance) {
+                    if ((measured_distance - distance) >= difference) {
+                        difference = measured_distance - distance;
+                        net_distance = measured_distance;
+                        global_distance = distance;
+                    }
+                    if (distance_cdf.find(difference) == distance_cdf.end()) {
+                        distance_cdf.emplace(std::make_pair(difference, 1));
+                    } else {
+                        distance_cdf[difference] += 1;
+                    }
+                } else {
+                    std::cout << "WARNING " << measured_distance << " " << distance << std::endl;
+                }
+                passed++;
+            }
+        }
+    }
     for (auto cdf : distance_cdf) {
         std::cout << _context.now() << " IDISTANCE " << cdf.first << " " << cdf.second << std::endl;
     }
     for (auto c : _controllers) {
-        auto links = &c.second->_existingLinks;
+        auto& links = c.second->_existingLinks;
         int64_t count = 0;
         std::cout << _context.now() << " CTRL_LINK_DIFF " << c.first;
-        for (auto l : _liveLinks) {
-            if (links->find(l) == links->end()) {
-                std::cout << " " << l;
+        for (LinkId l = 0; l < _liveLinks.size(); l++) {
+            if (_liveLinks[l] && !links[l]) {
+                std::cout << " " << Ids::link_name(l);
                 count++;
             }
         }
         std::cout << " " << count << std::endl;
         count = 0;
         std::cout << _context.now() << " CTRL_LINK_EXTRA " << c.first;
-        for (auto l : *links) {
-            if (_liveLinks.find(l) == _liveLinks.end()) {
-                std::cout << " " << l;
+        for (LinkId l = 0; l < links.size(); l++) {
+            if (links[l] && !_liveLinks[l]) {
+                std::cout << " " << Ids::link_name(l);
                 count++;
             }
         }
         std::cout << " " << count << std::endl;
     }
     std::cout << "\t" << _context.now() << " Checked " << checked << "    passed   " << passed << std::endl;
-    igraph_matrix_destroy(&distances);
 
     return ((double)passed) / ((double)checked);
 }
 
 double Simulation::compute_controller_diameter() {
-    igraph_vector_t path;
+    std::vector<VertexId> path;
     double longest = 0.0;
     for (auto c0 : _controllers) {
         for (auto c1 : _controllers) {
             if (c0.first == c1.first) {
                 continue;
             }
-            igraph_integer_t c0_idx = _vmap.at(_nsmap.at(c0.first));
-            igraph_integer_t c1_idx = _vmap.at(_nsmap.at(c1.first));
-            igraph_vector_init(&path, 0);
-            igraph_get_shortest_path(&_graph, &path, NULL, c0_idx, c1_idx, IGRAPH_OUT);
-            int path_len = igraph_vector_size(&path);
+            VertexId c0_idx = _vmap[_nsmap[c0.second->_id]];
+            VertexId c1_idx = _vmap[_nsmap[c1.second->_id]];
+            _graph.shortest_path(c0_idx, c1_idx, path);
+            int path_len = path.size();
             assert(path_len > 0);
             double lat_len = 0.0;
             for (int k = 0; k < path_len - 1; k++) {
-                auto l0 = _ivmap.at(VECTOR(path)[k]);
-                auto l1 = _ivmap.at(VECTOR(path)[k + 1]);
-                auto link = l0 + "-" + l1;
-                if (_links.find(link) == _links.end()) {
-                    link = l1 + "-" + l0;
-                }
-                lat_len += _links.at(link)->_latency->mean();
+                auto link = Ids::between(_ivmap[path[k]], _ivmap[path[k + 1]]);
+                lat_len += _links.at(Ids::link_name(link))->_latency->mean();
             }
             if (lat_len > longest) {
                 longest = lat_len;
@@ -452,9 +732,9 @@ void Simulation::dump_bw_used() const {
     }
 
     for (auto link : _links) {
-        total_data += link.second->_totalBits;
-        for (auto bw : link.second->_bitByType) {
-            data_by_type[bw.first] += bw.second;
+        total_data += link.second->total_bits();
+        for (int i = 0; i < Packet::END; i++) {
+            data_by_type[i] += link.second->bits_by_type(i);
         }
     }
 
@@ -471,6 +751,38 @@ void Simulation::dump_bw_used() const {
     }
 }
 
+void Simulation::dump_event_stats() const {
+    if (_partitions.empty()) {
+        _context.dump_event_stats();
+    } else {
+        uint64_t events = _context.scheduled();
+        for (auto& partition : _partitions) {
+            events += partition->scheduled();
+        }
+        std::cout << _context.now() << " events " << events << " boxed closures " << InlineTask::heap_allocations()
+                  << " queue allocations " << EventQueue::allocations() << std::endl;
+    }
+    std::cout << _context.now() << " packets live " << Packet::live() << " peak " << Packet::peak() << " allocated "
+              << Packet::allocated() << std::endl;
+    std::cout << _context.now() << " route cache hits " << Controller::route_cache_hits() << " misses "
+              << Controller::route_cache_misses() << std::endl;
+    for (auto c : _controllers) {
+        auto& stats = c.second->recompute_stats();
+        std::cout << _context.now() << " " << c.first << " recomputations " << stats.runs << " requested "
+                  << stats.requests << " saved " << stats.requests - stats.runs << " patch floods " << stats.floods
+                  << " rule updates " << stats.patches << std::endl;
+        auto& log = c.second->log();
+        std::cout << _context.now() << " " << c.first << " log words " << log.words() << " compacted "
+                  << log.compacted() << std::endl;
+        if (auto te = std::dynamic_pointer_cast<TeController>(c.second)) {
+            auto& te_stats = te->te_stats();
+            std::cout << _context.now() << " " << c.first << " te rounds " << te_stats.rounds << " incremental "
+                      << te_stats.incremental << " admitted " << te_stats.admitted << " rejected "
+                      << te_stats.rejected << " seconds " << te_stats.seconds << std::endl;
+        }
+    }
+}
+
 void Simulation::dump_table_changes() const {
     uint64_t overall_changes = 0;
     uint64_t entries = 0;
@@ -486,7 +798,7 @@ void Simulation::dump_table_changes() const {
         auto ctrl = c.second;
         uint64_t entries = 0;
         for (auto fdb : ctrl->_flowDb) {
-            entries += fdb.second.size();
+            entries += fdb.size();
         }
         std::cout << _context.now() << " " << c.first << " thinks there are " << entries << std::endl;
     }
@@ -496,22 +808,23 @@ void Simulation::dump_table_changes() const {
         int64_t differences_h = 0;
         int64_t differences_by_switch = 0;
         auto ctrl = c.second;
-        for (auto fdb : ctrl->_flowDb) {
+        for (auto sw_pair : _switches) {
             bool sw_d = false;
-            auto sw = _switches.at(fdb.first);
-            if (Controller::compute_hash(fdb.second) != Controller::compute_hash(sw->_forwardingTable)) {
+            auto sw = sw_pair.second;
+            auto& table = ctrl->_flowDb[sw->_id];
+            if (ctrl->_flowHash[sw->_id] != sw->_tableHash) {
                 differences_h++;
                 sw_d = true;
             }
-            for (auto le : fdb.second) {
-                if (sw->_forwardingTable.find(le.first) == sw->_forwardingTable.end() ||
-                    le.second != sw->_forwardingTable.at(le.first)) {
+            for (auto le : table) {
+                FlowTable::Port port = sw->_forwardingTable.find(le.first);
+                if (port == FlowTable::NONE || le.second != sw->_links[port]->id()) {
                     differences_s++;
                     sw_d = true;
                 }
             }
-            for (auto fe : sw->_forwardingTable) {
-                if (fdb.second.find(fe.first) == fdb.second.end()) {
+            for (auto& fe : sw->_forwardingTable) {
+                if (table.find(fe.flow) == Ids::NONE) {
                     differences_c++;
                     sw_d = true;
                 }
@@ -530,9 +843,9 @@ uint32_t Simulation::max_link_usage() const {
     int32_t max = 0;
     for (auto sw_pair : _switches) {
         auto sw = sw_pair.second;
-        for (auto l_pair : sw->_linkStats) {
-            if (!controller->is_host_link(l_pair.first) && max < l_pair.second) {
-                max = l_pair.second;
+        for (size_t port = 0; port < sw->_links.size(); port++) {
+            if (!controller->is_host_link(sw->_links[port]->id()) && max < sw->_linkStats[port]) {
+                max = sw->_linkStats[port];
             }
         }
     }
@@ -546,11 +859,12 @@ void Simulation::dump_link_usage() const {
     for (auto sw_pair : _switches) {
         auto name = sw_pair.first;
         auto sw = sw_pair.second;
-        for (auto l_pair : sw->_linkStats) {
-            if (!controller->is_host_link(l_pair.first)) {
-                std::cout << "\t\t" << name << " " << l_pair.first << " " << l_pair.second << std::endl;
+        for (size_t port = 0; port < sw->_links.size(); port++) {
+            if (!controller->is_host_link(sw->_links[port]->id())) {
+                std::cout << "\t\t" << name << " " << sw->_links[port]->name() << " " << sw->_linkStats[port]
+                          << std::endl;
                 checked++;
-                if (l_pair.second >= _flowLimit) {
+                if (sw->_linkStats[port] >= _flowLimit) {
                     tight++;
                 }
             }
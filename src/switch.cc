@@ -1,52 +1,76 @@
 #include "switch.h"
 #include "packet.h"
 #include "controller.h"
+#include <algorithm>
+#include <cassert>
 namespace PILO {
+const size_t Switch::JOURNAL_MIN;
+
 Switch::Switch(Context& context, const std::string& name, const bool version)
     : Node(context, name),
       _linkState(),
+      _linkStats(),
       _filter(),
       _forwardingTable(),
+      _tableHash(0),
+      _journal(),
+      _journalStart(0),
       _version(0),
       _entries(0),
+      _patches(),
       _filter_version(version) {}
 
-void Switch::receive(std::shared_ptr<Packet> packet, Link* link) {
+void Switch::receive(PacketPtr packet, Link* link) {
     // Get the flooding out of the way
-    if (packet->_type >= Packet::CONTROL && packet->_destination != _name &&
+    if (packet->_type >= Packet::CONTROL && packet->_destination != _id &&
         _filter.find(packet->_id) == _filter.end()) {
-        flood(packet, link->name());
+        flood(packet, link->id());
         _filter.emplace(packet->_id);
     }
 
     if (packet->_type >= Packet::CONTROL &&
-        (packet->_destination == _name || packet->_destination == Packet::WILDCARD)) {
+        (packet->_destination == _id || packet->_destination == Packet::WILDCARD)) {
         // If the packet is intended for the switch, process it.
         switch (packet->_type) {
-            case Packet::CHANGE_RULES:
-                install_flow_table(packet->data.table, packet->data.deleteEntries);
-                break;
+            case Packet::CHANGE_RULES: {
+                // Rules a skipped patch held are brought back by the table hash check.
+                uint64_t& last = _patches[packet->_source];
+                if (packet->data.version > last) {
+                    last = packet->data.version;
+                    install_flow_table(packet->rules().rules, packet->rules().removed);
+                }
+            } break;
             case Packet::SWITCH_INFORMATION_REQ: {
-                auto response = Packet::make_packet(_name, packet->_source, Packet::SWITCH_INFORMATION,
-                                                    Packet::HEADER + (64 + 64 + 8) * _linkState.size());
-                for (auto link : _linkState) {
-                    response->data.linkState[link.first] = link.second;
-                    response->data.linkVersion[link.first] = _links.at(link.first)->version();
+                auto response = Packet::make_packet(_id, packet->_source, Packet::SWITCH_INFORMATION);
+                auto& reports = response->link_reports();
+                for (size_t port = 0; port < _links.size(); port++) {
+                    auto link = _links[port];
+                    reports.push_back(Packet::LinkReport{link->id(), _linkState[port], link->version()});
                 }
                 flood(response);
             } break;
             case Packet::SWITCH_TABLE_REQ: {
-                if (!_filter_version || Controller::compute_hash(_forwardingTable) != packet->data.version) {
-                    std::cout << _context.now() << " HASH " << _name << " sending to " << packet->_source << std::endl;
-                    auto response =
-                        Packet::make_packet(_name, packet->_source, Packet::SWITCH_TABLE_RESP,
-                                            Packet::HEADER + (64 + Packet::HEADER) * _forwardingTable.size());
+                if (!_filter_version || _tableHash != packet->data.version) {
+                    std::cout << _context.now() << " HASH " << _name << " sending to "
+                              << Ids::node_name(packet->_source) << std::endl;
+                    auto response = Packet::make_packet(_id, packet->_source, Packet::SWITCH_TABLE_RESP);
                     response->data.version = _version;
-                    response->data.table.insert(_forwardingTable.cbegin(), _forwardingTable.cend());
+                    response->data.hash = _tableHash;
+                    if (changes_since(packet->data.since, response->rules())) {
+                        response->data.since = packet->data.since;
+                    } else {
+                        response->data.since = Packet::FULL_TABLE;
+                        auto& rules = response->rules().rules;
+                        rules.reserve(_forwardingTable.size());
+                        for (auto& rule : _forwardingTable) {
+                            rules.emplace_back(rule.flow, _links[rule.port]->id());
+                        }
+                        std::sort(rules.begin(), rules.end());
+                    }
                     flood(response);
                 } else {
-                    std::cout << _context.now() << " HASH " << _name << " hashes match " << packet->_source
-                              << std::endl;
+                    std::cout << _context.now() << " HASH " << _name << " hashes match "
+                              << Ids::node_name(packet->_source) << std::endl;
                 }
             } break;
             default:
@@ -56,69 +80,165 @@ void Switch::receive(std::shared_ptr<Packet> packet, Link* link) {
     }
 
     if (packet->_type == Packet::DATA) {
-        auto rule = _forwardingTable.find(packet->_sig);
-        if (rule != _forwardingTable.end()) {
-            _links.at(rule->second)->send(this, packet);
+        FlowTable::Port port = output(packet->_flow);
+        if (port != FlowTable::NONE) {
+            _links[port]->send(this, packet);
         }
     }
 }
 
-void Switch::install_flow_table(const Packet::flowtable& table) {
+FlowTable::Port Switch::output(FlowId flow) const {
+    FlowTable::Port port = _forwardingTable.find(flow);
+    if (port == FlowTable::NONE) {
+        port = _forwardingTable.find(Ids::destination(Ids::flow_destination(flow)));
+    }
+    if (port == FlowTable::NONE) {
+        port = _forwardingTable.find(Ids::DEFAULT_ROUTE);
+    }
+    return port;
+}
+
+LinkId Switch::lookup(FlowId flow) const {
+    FlowTable::Port port = output(flow);
+    return port == FlowTable::NONE ? Ids::NONE : _links[port]->id();
+}
+
+void Switch::install_flow_table(const std::vector<Packet::Rule>& table) {
     //std::cout << _context.now() << " received ft update" << std::endl;
     bool changed = install_flow_table_internal(table);
     if (changed)
-        _version++;
+        next_version();
 }
 
-bool Switch::install_flow_table_internal(const Packet::flowtable& table) {
-    bool changed = false;
-    for (auto rules : table) {
-        if (_forwardingTable.find(rules.first) != _forwardingTable.end()) {
-            if (_forwardingTable.at(rules.first) != rules.second) {
-                // Decrement since we are about to change to some other link
-                _linkStats.at(_forwardingTable.at(rules.first))--;
-                _linkStats.at(rules.second)++;
-                // Number of entries remain unchanged
-                _forwardingTable[rules.first] = rules.second;
-                changed = true;
-            }
+void Switch::next_version() {
+    _version++;
+    size_t limit = std::max(JOURNAL_MIN, _forwardingTable.size());
+    while (_journal.size() > limit) {
+        _journalStart = _journal.front().version;
+        _journal.pop_front();
+    }
+}
+
+bool Switch::changes_since(uint64_t since, Packet::Rules& rules) const {
+    if (since < _journalStart || since > _version) {
+        return false;
+    }
+    auto first = std::upper_bound(_journal.begin(), _journal.end(), since,
+                                  [](uint64_t version, const Change& change) { return version < change.version; });
+    if (first != _journal.end() && (size_t)(_journal.end() - first) >= _forwardingTable.size()) {
+        // At least as many changes as rules, the table is likely no bigger.
+        return false;
+    }
+    // Only the last change to each flow counts.
+    std::vector<Change> changes(first, _journal.end());
+    std::stable_sort(changes.begin(), changes.end(),
+                     [](const Change& a, const Change& b) { return a.flow < b.flow; });
+    for (size_t i = 0; i < changes.size(); i++) {
+        if (i + 1 < changes.size() && changes[i + 1].flow == changes[i].flow) {
+            continue;
+        }
+        if (changes[i].link == Ids::NONE) {
+            rules.removed.push_back(changes[i].flow);
         } else {
-            _linkStats.at(rules.second)++;
-            _forwardingTable[rules.first] = rules.second;
-            changed = true;
+            rules.rules.emplace_back(changes[i].flow, changes[i].link);
+        }
+    }
+    return true;
+}
+
+bool Switch::set_rule(FlowId flow, LinkId link) {
+    FlowTable::Port old;
+    if (link == Ids::NONE) {
+        old = _forwardingTable.erase(flow);
+        if (old == FlowTable::NONE) {
+            return false;
+        }
+        _entries--;
+    } else {
+        size_t p = port(link);
+        assert(p < _links.size());
+        old = _forwardingTable.set(flow, p);
+        if (old == p) {
+            return false;
+        }
+        _linkStats[p]++;
+        _tableHash ^= Controller::rule_hash(flow, link);
+        if (old == FlowTable::NONE) {
             _entries++;
         }
     }
+    if (old != FlowTable::NONE) {
+        // Decrement since the rule no longer uses its old link
+        _linkStats[old]--;
+        _tableHash ^= Controller::rule_hash(flow, _links[old]->id());
+    }
+    _journal.push_back(Change{_version + 1, flow, link});
+    return true;
+}
+
+bool Switch::install_flow_table_internal(const std::vector<Packet::Rule>& table) {
+    bool changed = false;
+    for (auto& rule : table) {
+        changed |= set_rule(rule.first, rule.second);
+    }
     return changed;
 }
-void Switch::install_flow_table(const Packet::flowtable& table, const std::unordered_set<std::string>& remove) {
+
+void Switch::install_flow_table(const std::vector<Packet::Rule>& table, const std::vector<FlowId>& remove) {
     // std::cout << _context.get_time() << " " << _name << " installing rules" << std::endl;
     bool changed = install_flow_table_internal(table);
-    for (auto rule : remove) {
-        if (_forwardingTable.find(rule) != _forwardingTable.end()) {
-            _linkStats.at(_forwardingTable.at(rule))--;
-            _forwardingTable.erase(rule);
-            _entries--;
-            changed = true;
-        }
+    for (auto flow : remove) {
+        changed |= set_rule(flow, Ids::NONE);
     }
     if (changed)
-        _version++;  // Increment to indicate that flow table has changed
+        next_version();  // Increment to indicate that flow table has changed
+}
+
+std::shared_ptr<Node::State> Switch::save_state() const {
+    auto state = std::make_shared<SwitchState>();
+    state->events = _events;
+    state->linkState = _linkState;
+    state->linkStats = _linkStats;
+    state->filter = _filter;
+    state->forwardingTable = _forwardingTable;
+    state->tableHash = _tableHash;
+    state->journal = _journal;
+    state->journalStart = _journalStart;
+    state->version = _version;
+    state->entries = _entries;
+    state->patches = _patches;
+    return state;
+}
+
+void Switch::restore_state(const State& state) {
+    auto& saved = static_cast<const SwitchState&>(state);
+    _events = saved.events;
+    _linkState = saved.linkState;
+    _linkStats = saved.linkStats;
+    _filter = saved.filter;
+    _forwardingTable = saved.forwardingTable;
+    _tableHash = saved.tableHash;
+    _journal = saved.journal;
+    _journalStart = saved.journalStart;
+    _version = saved.version;
+    _entries = saved.entries;
+    _patches = saved.patches;
 }
 
 void Switch::notify_link_existence(Link* link) {
     Node::notify_link_existence(link);
-    _linkState.emplace(std::make_pair(link->name(), Link::DOWN));
-    _linkStats.emplace(std::make_pair(link->name(), 0));
+    _linkState.push_back(Link::DOWN);
+    _linkStats.push_back(0);
 }
 
 void Switch::notify_link_up(Link* link) {
     Node::notify_link_up(link);
-    if (_linkState.at(link->name()) == Link::DOWN) {
+    Link::State& state = _linkState.at(port(link->id()));
+    if (state == Link::DOWN) {
         std::cout << _context.now() << " " << _name << " " << link->name() << " set up " << std::endl;
-        _linkState[link->name()] = Link::UP;
-        auto packet = Packet::make_packet(_name, Packet::LINK_UP, Packet::LINK_UP_SIZE);
-        packet->data.link = link->name();
+        state = Link::UP;
+        auto packet = Packet::make_packet(_id, Packet::LINK_UP);
+        packet->data.link = link->id();
         packet->data.version = link->version();
         flood(packet);
     }
@@ -126,11 +246,12 @@ void Switch::notify_link_up(Link* link) {
 
 void Switch::notify_link_down(Link* link) {
     Node::notify_link_down(link);
-    if (_linkState.at(link->name()) == Link::UP) {
+    Link::State& state = _linkState.at(port(link->id()));
+    if (state == Link::UP) {
         std::cout << _context.now() << " " << _name << " " << link->name() << " set down " << std::endl;
-        _linkState[link->name()] = Link::DOWN;
-        auto packet = Packet::make_packet(_name, Packet::LINK_DOWN, Packet::LINK_DOWN_SIZE);
-        packet->data.link = link->name();
+        state = Link::DOWN;
+        auto packet = Packet::make_packet(_id, Packet::LINK_DOWN);
+        packet->data.link = link->id();
         packet->data.version = link->version();
         flood(packet);
     }
@@ -138,15 +259,11 @@ void Switch::notify_link_down(Link* link) {
 
 void Switch::silent_link_up(Link* link) {
     Node::silent_link_up(link);
-    if (_linkState.at(link->name()) == Link::DOWN) {
-        _linkState[link->name()] = Link::UP;
-    }
+    _linkState.at(port(link->id())) = Link::UP;
 }
 
 void Switch::silent_link_down(Link* link) {
     Node::silent_link_down(link);
-    if (_linkState.at(link->name()) == Link::UP) {
-        _linkState[link->name()] = Link::DOWN;
-    }
+    _linkState.at(port(link->id())) = Link::DOWN;
 }
 }
@@ -1,11 +1,13 @@
 #include "te_controller.h"
 #include "packet.h"
 #include <algorithm>
-#include <boost/functional/hash.hpp>
 // I know these are unnecessary here, but I was having some fun.
 #define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 namespace PILO {
+bool TeController::_incremental = false;
+size_t TeController::_candidates = 0;
+
 TeController::TeController(Context& context, const std::string& name, const Time refresh, const Time gossip,
                            const int max_load, Distribution<bool>* drop)
     : Controller(context, name, refresh, gossip, drop), _maxLoad(max_load) {
@@ -13,144 +15,515 @@ TeController::TeController(Context& context, const std::string& name, const Time
 }
 
 std::pair<Controller::flowtable_db, Controller::deleted_entries> TeController::compute_paths() {
-    igraph_vector_t path;
-    flowtable_db diffs;
-    deleted_entries diffs_negative;
-    flowtable_db new_table;
-    igraph_t workingCopy;
-    std::unordered_map<std::pair<int, int>, int, boost::hash<std::pair<int, int>>> linkUtilization;
+    std::vector<VertexId> path;
+    flowtable_db diffs(_flowDb.size());
+    deleted_entries diffs_negative(_flowDb.size());
+    // Rules are placed one flow at a time, looking up rules placed before, and turned into tables at the end.
+    flowtable_db new_table(_flowDb.size());
+    auto start = std::chrono::steady_clock::now();
+    std::vector<int> utilization(_graph.slots(), 0);  // Indexed by slot.
     std::cout << _name << " Beginning computation " << std::endl;
-    igraph_copy(&workingCopy, &_graph);
-    igraph_to_directed(&workingCopy, IGRAPH_TO_DIRECTED_MUTUAL);
+    // Admission control removes edges, one direction at a time, as they fill up.
+    std::vector<char> removed(_graph.slots(), false);
     uint64_t admissionControlRejected = 0;
     uint64_t admissionControlTried = 0;
-    for (auto sw: _switches) {
-        new_table.emplace(std::make_pair(sw, Packet::flowtable()));
-        diffs_negative.emplace(std::make_pair(sw, std::unordered_set<std::string>())); 
-    }
+    std::unordered_map<FlowId, Placement> placements;
+    std::set<FlowId> rejected;
+    std::vector<std::vector<FlowId>> edgeFlows(_graph.slots());
 
-    for (auto link : _links) {
-        std::string v1, v2;
-        if (is_host_link(link)) {
-            continue;
+    // Admission control depends on the order flows are placed in, so flows are still placed one at a time.
+    // Shortest path trees for the sources are computed ahead, concurrently, and only rebuilt (again for
+    // all remaining sources at once) when an edge in them has been removed. Removing an edge BFS never
+    // discovered a vertex through leaves the tree as it was, so paths are exactly what querying the
+    // graph (less removed edges) for each flow would give.
+    std::vector<VertexId> sources;
+    for (int v0_idx = 0; v0_idx < _usedVertices; v0_idx++) {
+        if (!_hostAtSwitch[_ivertices[v0_idx]].empty()) {
+            sources.push_back(v0_idx);
         }
-        std::tie(v1, v2) = split_parts(link);
-        linkUtilization.emplace(std::make_pair(_vertices.at(v1), _vertices.at(v2)), 0);
-        linkUtilization.emplace(std::make_pair(_vertices.at(v2), _vertices.at(v1)), 0);
     }
+    std::vector<std::vector<VertexId>> parents(_usedVertices);
+    std::vector<char> stale(_usedVertices, 1);
+    std::vector<VertexId> rebuild;
+    size_t current = 0;  // Index in sources of the source being placed.
+    auto shortest_path = [&](VertexId v0_idx, VertexId v1_idx) {
+        if (stale[v0_idx]) {
+            rebuild.clear();
+            for (size_t i = current; i < sources.size(); i++) {
+                if (stale[sources[i]]) {
+                    rebuild.push_back(sources[i]);
+                }
+            }
+            route_parallel_for(rebuild.size(),
+                               [&](size_t i) { _graph.bfs(rebuild[i], parents[rebuild[i]], &removed); });
+            for (auto v : rebuild) {
+                stale[v] = 0;
+            }
+        }
+        const std::vector<VertexId>& parent = parents[v0_idx];
+        path.clear();
+        if (parent[v1_idx] < 0) {
+            return;
+        }
+        for (VertexId v = v1_idx; v != v0_idx; v = parent[v]) {
+            path.push_back(v);
+        }
+        path.push_back(v0_idx);
+        std::reverse(path.begin(), path.end());
+    };
+    auto remove_edge = [&](VertexId n0idx, VertexId n1idx) {
+        Graph::Slot slot = _graph.slot(n0idx, n1idx);
+        assert(slot != Graph::NONE && _graph.up(slot) && !removed[slot]);
+        removed[slot] = true;
+        for (auto v : sources) {
+            if (!stale[v] && parents[v][n1idx] == n0idx) {
+                stale[v] = 1;
+            }
+        }
+    };
 
-    for (int v0_idx = 0; v0_idx < _usedVertices; v0_idx++) {
-        std::string v0 = _ivertices.at(v0_idx);
-
-        if (_hostAtSwitch.at(v0).empty()) {
-            continue;
+    // Forwarding on destination, a path that reaches a switch already forwarding to the destination's hosts
+    // continues along the rules placed for them, and only the switches before it get rules.
+    struct Hop {
+        NodeId sw;
+        NodeId next;
+        bool placed;  // Whether the rule is placed for this path.
+    };
+    std::vector<Hop> hops;
+    if (_forwarding != PER_FLOW) {
+        for (auto v1_idx : sources) {
+            NodeId v1 = _ivertices[v1_idx];
+            for (auto h1 : _hostAtSwitch[v1]) {
+                new_table[v1][Ids::destination(h1)] = Ids::between(v1, h1);
+            }
+        }
+    }
+    auto place_destination = [&](VertexId v0_idx, VertexId v1_idx) {
+        NodeId v0 = _ivertices[v0_idx];
+        NodeId v1 = _ivertices[v1_idx];
+        // Rules at any switch are the same for all of v1's hosts.
+        FlowId key = Ids::destination(_hostAtSwitch[v1].front());
+        shortest_path(v0_idx, v1_idx);
+        hops.clear();
+        bool reached = false;
+        NodeId sw = v0;
+        for (size_t k = 0;;) {
+            auto rule = new_table[sw].find(key);
+            if (rule != new_table[sw].end()) {
+                NodeId a, b;
+                std::tie(a, b) = Ids::ends(rule->second);
+                NodeId next = (a == sw ? b : a);
+                if (!is_switch(next)) {
+                    reached = true;
+                    break;
+                }
+                hops.push_back({sw, next, false});
+                sw = next;
+            } else if (k + 1 < path.size()) {
+                NodeId next = _ivertices[path[++k]];
+                hops.push_back({sw, next, true});
+                sw = next;
+            } else {
+                break;
+            }
+        }
+        size_t flows = _hostAtSwitchCount[v0] * _hostAtSwitchCount[v1];
+        admissionControlTried += flows;
+        if (!reached) {
+            admissionControlRejected += flows;
+            return;
+        }
+        for (auto& hop : hops) {
+            int& load = utilization[_graph.slot(_vertices[hop.sw], _vertices[hop.next])];
+            // Rules placed earlier may use edges that have already filled up.
+            if (load < _maxLoad && load + (int)flows >= _maxLoad) {
+                remove_edge(_vertices[hop.sw], _vertices[hop.next]);
+            }
+            load += flows;
+        }
+        for (auto& hop : hops) {
+            if (!hop.placed) {
+                break;
+            }
+            for (auto h1 : _hostAtSwitch[v1]) {
+                new_table[hop.sw][Ids::destination(h1)] = Ids::between(hop.sw, hop.next);
+            }
         }
+    };
+
+    for (current = 0; current < sources.size(); current++) {
+        int v0_idx = sources[current];
+        NodeId v0 = _ivertices[v0_idx];
 
         for (int v1_idx = 0; v1_idx < _usedVertices; v1_idx++) {
-            std::string v1 = _ivertices.at(v1_idx);
-            if ((!_hostAtSwitch.at(v1).empty())) {
-                if (v0_idx != v1_idx) {
-                    igraph_vector_init(&path, 0);
-                    igraph_get_shortest_path(&workingCopy, &path, NULL, v0_idx, v1_idx, IGRAPH_OUT);
-                    for (auto h0 : _hostAtSwitch.at(v0)) {
-                        for (auto h1 : _hostAtSwitch.at(v1)) {
-                            std::string psig = Packet::generate_signature(h0, h1, Packet::DATA);
+            NodeId v1 = _ivertices[v1_idx];
+            if ((!_hostAtSwitch[v1].empty())) {
+                if (_forwarding != PER_FLOW) {
+                    if (v0_idx != v1_idx) {
+                        place_destination(v0_idx, v1_idx);
+                    }
+                } else if (v0_idx != v1_idx && _candidates > 0) {
+                    auto& candidates = candidate_paths(v0_idx, v1_idx);
+                    for (auto h0 : _hostAtSwitch[v0]) {
+                        for (auto h1 : _hostAtSwitch[v1]) {
+                            FlowId flow = Ids::flow(h0, h1);
+                            admissionControlTried++;
+                            const Candidate* candidate = first_fit(candidates, utilization);
+                            if (!candidate) {
+                                admissionControlRejected++;
+                                rejected.insert(flow);
+                                continue;
+                            }
+                            Placement& placement = placements[flow];
+                            placement.slots = candidate->slots;
+                            for (auto slot : candidate->slots) {
+                                utilization[slot]++;
+                                edgeFlows[slot].push_back(flow);
+                            }
+                            for (size_t k = 0; k < candidate->path.size(); k++) {
+                                NodeId sw = _ivertices[candidate->path[k]];
+                                NodeId nh = (k + 1 < candidate->path.size() ? _ivertices[candidate->path[k + 1]] : h1);
+                                new_table[sw][flow] = Ids::between(sw, nh);
+                                placement.rules.emplace_back(sw, Ids::between(sw, nh));
+                            }
+                        }
+                    }
+                } else if (v0_idx != v1_idx) {
+                    shortest_path(v0_idx, v1_idx);
+                    for (auto h0 : _hostAtSwitch[v0]) {
+                        for (auto h1 : _hostAtSwitch[v1]) {
+                            FlowId flow = Ids::flow(h0, h1);
                             bool recomputed = false;
-                            int path_len = igraph_vector_size(&path);
+                            int path_len = path.size();
 
                             admissionControlTried++;
 
                             if (path_len == 0) {
                                 admissionControlRejected++;
+                                rejected.insert(flow);
                             }
+                            Placement* placement = (path_len == 0 ? nullptr : &placements[flow]);
 
                             for (int k = 0; k < path_len; k++) {
-                                std::string sw = _ivertices.at(VECTOR(path)[k]);
-                                std::string nh;
+                                NodeId sw = _ivertices[path[k]];
+                                NodeId nh;
                                 if (k + 1 < path_len) {
-                                    nh = _ivertices.at(VECTOR(path)[k + 1]);
+                                    nh = _ivertices[path[k + 1]];
                                 } else {
                                     nh = h1;
                                 }
-                                std::string link = sw + "-" + nh;
-
-                                // Cannonicalize
-                                if (_links.find(link) == _links.end()) {
-                                    link = nh + "-" + sw;
-                                }
+                                LinkId link = Ids::between(sw, nh);
 
                                 if (!is_host_link(link)) {
-                                    int n0idx = _vertices.at(sw);
-                                    int n1idx = _vertices.at(nh);
-                                    auto lpair = std::make_pair(n0idx, n1idx);
-                                    linkUtilization[lpair] += 1;
-                                    if (linkUtilization.at(lpair) >= _maxLoad) {
-                                        igraph_integer_t eid;
-                                        igraph_get_eid(&workingCopy, &eid, n0idx, n1idx, IGRAPH_DIRECTED, 0);
-                                        assert(eid != -1);
-                                        igraph_delete_edges(&workingCopy, igraph_ess_1(eid));
+                                    int n0idx = _vertices[sw];
+                                    int n1idx = _vertices[nh];
+                                    Graph::Slot slot = _graph.slot(n0idx, n1idx);
+                                    placement->slots.push_back(slot);
+                                    edgeFlows[slot].push_back(flow);
+                                    if (++utilization[slot] >= _maxLoad) {
+                                        remove_edge(n0idx, n1idx);
                                         recomputed = true;
                                     }
                                 }
-                                assert(_links.find(link) != _links.end());
-                                new_table[sw][psig] = link;
-                                auto rule = _flowDb.at(sw).find(psig);
-                                if (rule == _flowDb.at(sw).end() || rule->second != link) {
-                                    _flowDb[sw][psig] = link;
-                                    diffs[sw][psig] = link;
-                                }
+                                assert(link != Ids::NONE && _links[link]);
+                                new_table[sw][flow] = link;
+                                placement->rules.emplace_back(sw, link);
                                 if (recomputed) {
-                                    igraph_get_shortest_path(&workingCopy, &path, NULL, v0_idx, v1_idx, IGRAPH_OUT);
-                                    if (path_len > 0 && igraph_vector_size(&path)) {
+                                    shortest_path(v0_idx, v1_idx);
+                                    if (path_len > 0 && path.size()) {
                                         std::cout << "Warning: Removal made paths infeasible" << std::endl;
                                     }
-                                    path_len = igraph_vector_size(&path);
+                                    path_len = path.size();
                                 }
                             }
                         }
                     }
-                    igraph_vector_destroy(&path);
                 } else if (v0_idx == v1_idx) {
                     // Set up paths between things connected to the same switch.
-                    for (auto h0 : _hostAtSwitch.at(v0)) {
-                        for (auto h1 : _hostAtSwitch.at(v1)) {
+                    for (auto h0 : _hostAtSwitch[v0]) {
+                        for (auto h1 : _hostAtSwitch[v1]) {
                             if (h0 == h1) {
                                 continue;
                             }
-                            std::string psig = Packet::generate_signature(h0, h1, Packet::DATA);
-                            std::string link = v0 + "-" + h1;
+                            FlowId flow = Ids::flow(h0, h1);
+                            LinkId link = Ids::between(v0, h1);
                             auto sw = v0;
-                            // Cannonicalize
-                            if (_links.find(link) == _links.end()) {
-                                link = h1 + "-" + v0;
-                            }
-                            assert(_links.find(link) != _links.end());
-                            new_table[sw][psig] = link;
-                            auto rule = _flowDb.at(sw).find(psig);
-                            if (rule == _flowDb.at(sw).end() || rule->second != link) {
-                                _flowDb[sw][psig] = link;
-                                diffs[sw][psig] = link;
-                            }
+                            assert(link != Ids::NONE && _links[link]);
+                            new_table[sw][flow] = link;
                         }
                     }
                 }
             }
         }
     }
-    igraph_destroy(&workingCopy);
     std::cout << _name << " Done computing " << admissionControlTried << "   " << admissionControlRejected << std::endl;
-    for (auto swtable : _flowDb) {
-        auto sw = swtable.first;
-        auto table = swtable.second;
-        for (auto match_action : table) {
-            auto sig = match_action.first;
-            if (new_table.find(sw) == new_table.end() || new_table.at(sw).find(sig) == new_table.at(sw).end()) {
-                // OK, remove this signature
-                diffs_negative[sw].emplace(sig);
-            }
+    report(false, admissionControlTried - admissionControlRejected, admissionControlRejected, start);
+    rule_db tables(_flowDb.size());
+    flowtable_version new_hash(_flowDb.size(), 0);
+    std::vector<NodeId> hosts = routed_hosts();
+    std::vector<char> heard = heard_hosts();
+    for (auto sw : _switches) {
+        tables[sw].assign(std::vector<RuleTable::Rule>(new_table[sw].begin(), new_table[sw].end()));
+        new_hash[sw] = compute_hash(tables[sw]);
+        if (_forwarding == AGGREGATED) {
+            aggregate(tables[sw], new_hash[sw], hosts);
+            keep_rules(_flowDb[sw], tables[sw], new_hash[sw], heard);
         }
+        diff(_flowDb[sw], tables[sw], diffs[sw], diffs_negative[sw]);
+    }
+    _flowDb.swap(tables); // Update the table
+    _flowHash.swap(new_hash);
+    _treesValid = (_incremental && _forwarding == PER_FLOW);
+    _pendingLinks.clear();
+    _recompute.refreshed.clear();
+    if (_treesValid) {
+        _load.swap(utilization);
+        _placements.swap(placements);
+        _rejected.swap(rejected);
+        _edgeFlows.swap(edgeFlows);
     }
-    _flowDb.swap(new_table); // Update the table
     return std::make_pair(diffs, diffs_negative);
 }
+
+void TeController::set_incremental(bool incremental) { _incremental = incremental; }
+
+void TeController::set_candidates(size_t k) { _candidates = k; }
+
+const std::vector<TeController::Candidate>& TeController::candidate_paths(VertexId v0_idx, VertexId v1_idx) {
+    if (_candidateState != _graph.state()) {
+        _candidatePaths.clear();
+        _candidateState = _graph.state();
+    }
+    auto inserted = _candidatePaths.emplace(((uint64_t)v0_idx << 32) | (uint32_t)v1_idx, std::vector<Candidate>());
+    std::vector<Candidate>& candidates = inserted.first->second;
+    if (!inserted.second) {
+        return candidates;
+    }
+    // Each path is a shortest path once the edges of the paths before it are taken out.
+    std::vector<char> removed(_graph.slots(), false);
+    std::vector<VertexId> parent;
+    while (candidates.size() < _candidates) {
+        _graph.bfs(v0_idx, parent, &removed);
+        if (parent[v1_idx] < 0) {
+            break;
+        }
+        Candidate candidate;
+        for (VertexId v = v1_idx; v != v0_idx; v = parent[v]) {
+            candidate.path.push_back(v);
+            candidate.slots.push_back(_graph.slot(parent[v], v));
+            removed[candidate.slots.back()] = true;
+        }
+        candidate.path.push_back(v0_idx);
+        std::reverse(candidate.path.begin(), candidate.path.end());
+        std::reverse(candidate.slots.begin(), candidate.slots.end());
+        candidates.push_back(std::move(candidate));
+    }
+    return candidates;
+}
+
+const TeController::Candidate* TeController::first_fit(const std::vector<Candidate>& candidates,
+                                                      const std::vector<int>& load) const {
+    for (auto& candidate : candidates) {
+        if (std::all_of(candidate.slots.begin(), candidate.slots.end(),
+                        [&](Graph::Slot slot) { return load[slot] < _maxLoad; })) {
+            return &candidate;
+        }
+    }
+    return nullptr;
+}
+
+void TeController::report(bool incremental, uint64_t admitted, uint64_t rejected,
+                          std::chrono::steady_clock::time_point start) {
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    _te.rounds++;
+    _te.incremental += incremental;
+    _te.admitted += admitted;
+    _te.rejected += rejected;
+    _te.seconds += seconds;
+    std::cout << _name << " TE round " << (incremental ? "incremental" : "full") << " admitted " << admitted
+              << " rejected " << rejected << " ms " << seconds * 1000 << std::endl;
+}
+
+std::pair<Controller::flowtable_db, Controller::deleted_entries> TeController::update_paths() {
+    if (!_incremental || !_treesValid) {
+        _pendingLinks.clear();
+        return compute_paths();
+    }
+    std::vector<LinkId> links = rewind_pending_links();
+    if (links.empty()) {
+        // Only tables heard from switches, refresh_tables puts back what was placed.
+        return std::make_pair(flowtable_db(_flowDb.size()), deleted_entries(_flowDb.size()));
+    }
+    auto start = std::chrono::steady_clock::now();
+    std::vector<FlowId> moved;
+    bool retry = false;
+    for (auto link : links) {
+        bool added = _existingLinks[link];
+        _graph.set_link(link, added);
+        if (added) {
+            retry = true;
+            continue;
+        }
+        NodeId v0, v1;
+        std::tie(v0, v1) = Ids::ends(link);
+        for (auto slot : {_graph.slot(_vertices[v0], _vertices[v1]), _graph.slot(_vertices[v1], _vertices[v0])}) {
+            moved.insert(moved.end(), _edgeFlows[slot].begin(), _edgeFlows[slot].end());
+        }
+    }
+    if (retry) {
+        moved.insert(moved.end(), _rejected.begin(), _rejected.end());
+    }
+    std::sort(moved.begin(), moved.end());
+    moved.erase(std::unique(moved.begin(), moved.end()), moved.end());
+
+    original_rules original;
+    for (auto flow : moved) {
+        release(flow, original);
+    }
+    std::vector<NodeId> hostSwitch(Ids::nodes(), Ids::ANY);
+    for (auto sw : _switches) {
+        for (auto host : _hostAtSwitch[sw]) {
+            hostSwitch[host] = sw;
+        }
+    }
+    std::vector<char> full(_graph.slots(), false);
+    for (Graph::Slot slot = 0; slot < _graph.slots(); slot++) {
+        full[slot] = (_load[slot] >= _maxLoad);
+    }
+    std::vector<VertexId> parent;
+    VertexId parentRoot = -1;
+    uint64_t admitted = 0;
+    for (auto flow : moved) {
+        NodeId source = hostSwitch[Ids::flow_source(flow)];
+        NodeId destination = hostSwitch[Ids::flow_destination(flow)];
+        assert(source != Ids::ANY && destination != Ids::ANY);
+        admitted += admit(flow, source, destination, full, parent, parentRoot, original);
+    }
+    report(true, admitted, moved.size() - admitted, start);
+    return diff_rules(original);
+}
+
+void TeController::switch_table(NodeId sw, RuleTable& table) const {
+    std::vector<RuleTable::Rule> rules;
+    for (auto h0 : _hostAtSwitch[sw]) {
+        for (auto h1 : _hostAtSwitch[sw]) {
+            if (h0 != h1) {
+                rules.emplace_back(Ids::flow(h0, h1), Ids::between(sw, h1));
+            }
+        }
+    }
+    for (auto& placement : _placements) {
+        for (auto& rule : placement.second.rules) {
+            if (rule.first == sw) {
+                rules.emplace_back(placement.first, rule.second);
+            }
+        }
+    }
+    table.assign(std::move(rules));
+}
+
+void TeController::release(FlowId flow, original_rules& original) {
+    auto placement = _placements.find(flow);
+    if (placement == _placements.end()) {
+        return;
+    }
+    for (auto slot : placement->second.slots) {
+        _load[slot]--;
+        auto& flows = _edgeFlows[slot];
+        auto it = std::find(flows.begin(), flows.end(), flow);
+        assert(it != flows.end());
+        *it = flows.back();
+        flows.pop_back();
+    }
+    for (auto& rule : placement->second.rules) {
+        set_rule(rule.first, flow, Ids::NONE, original);
+    }
+    _placements.erase(placement);
+}
+
+bool TeController::admit(FlowId flow, NodeId source, NodeId destination, std::vector<char>& full,
+                         std::vector<VertexId>& parent, VertexId& parentRoot, original_rules& original) {
+    VertexId v0_idx = _vertices[source];
+    VertexId v1_idx = _vertices[destination];
+    if (_candidates > 0) {
+        const Candidate* candidate = first_fit(candidate_paths(v0_idx, v1_idx), _load);
+        if (!candidate) {
+            _rejected.insert(flow);
+            return false;
+        }
+        _rejected.erase(flow);
+        place(flow, candidate->path, original);
+        return true;
+    }
+    if (parentRoot != v0_idx) {
+        _graph.bfs(v0_idx, parent, &full);
+        parentRoot = v0_idx;
+    }
+    if (parent[v1_idx] < 0) {
+        _rejected.insert(flow);
+        return false;
+    }
+    _rejected.erase(flow);
+    std::vector<VertexId> path;
+    for (VertexId v = v1_idx; v != v0_idx; v = parent[v]) {
+        path.push_back(v);
+    }
+    path.push_back(v0_idx);
+    std::reverse(path.begin(), path.end());
+    if (place(flow, path, original)) {
+        for (size_t k = 0; k + 1 < path.size(); k++) {
+            Graph::Slot slot = _graph.slot(path[k], path[k + 1]);
+            if (_load[slot] >= _maxLoad && !full[slot]) {
+                full[slot] = true;
+                parentRoot = -1;
+            }
+        }
+    }
+    return true;
+}
+
+bool TeController::place(FlowId flow, const std::vector<VertexId>& path, original_rules& original) {
+    Placement& placement = _placements[flow];
+    bool filled = false;
+    for (size_t k = 0; k < path.size(); k++) {
+        NodeId sw = _ivertices[path[k]];
+        NodeId nh = Ids::flow_destination(flow);
+        if (k + 1 < path.size()) {
+            nh = _ivertices[path[k + 1]];
+            Graph::Slot slot = _graph.slot(path[k], path[k + 1]);
+            placement.slots.push_back(slot);
+            _edgeFlows[slot].push_back(flow);
+            filled = (++_load[slot] >= _maxLoad) || filled;
+        }
+        placement.rules.emplace_back(sw, Ids::between(sw, nh));
+        set_rule(sw, flow, Ids::between(sw, nh), original);
+    }
+    return filled;
+}
+
+std::shared_ptr<Node::State> TeController::save_state() const {
+    auto state = std::make_shared<TeControllerState>();
+    Controller::save_state(*state);
+    state->placements = _placements;
+    state->rejected = _rejected;
+    state->load = _load;
+    state->edgeFlows = _edgeFlows;
+    state->treesValid = _treesValid;
+    state->pendingLinks = _pendingLinks;
+    state->te = _te;
+    return state;
+}
+
+void TeController::restore_state(const State& state) {
+    Controller::restore_state(state);
+    auto& saved = static_cast<const TeControllerState&>(state);
+    _placements = saved.placements;
+    _rejected = saved.rejected;
+    _load = saved.load;
+    _edgeFlows = saved.edgeFlows;
+    // Placements are saved, unlike path trees.
+    _treesValid = saved.treesValid;
+    _pendingLinks = saved.pendingLinks;
+    _te = saved.te;
+}
 }
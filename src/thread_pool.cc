@@ -0,0 +1,87 @@
+#include "thread_pool.h"
+#include <algorithm>
+
+namespace PILO {
+ThreadPool::ThreadPool(size_t helpers) : _stop(false) {
+    for (size_t i = 0; i < helpers; i++) {
+        _threads.emplace_back([this] { helper(); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _stop = true;
+    }
+    _wake.notify_all();
+    for (auto& thread : _threads) {
+        thread.join();
+    }
+}
+
+size_t ThreadPool::run(Job& job) {
+    size_t ran = 0;
+    for (size_t i = job.next++; i < job.n; i = job.next++) {
+        (*job.body)(i);
+        ran++;
+    }
+    return ran;
+}
+
+void ThreadPool::parallel_for(size_t n, const std::function<void(size_t)>& body) {
+    if (n == 0) {
+        return;
+    }
+    if (_threads.empty() || n == 1) {
+        for (size_t i = 0; i < n; i++) {
+            body(i);
+        }
+        return;
+    }
+    Job job;
+    job.body = &body;
+    job.n = n;
+    job.next = 0;
+    job.done = 0;
+    job.workers = 0;
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _jobs.push_back(&job);
+    }
+    _wake.notify_all();
+    size_t ran = run(job);
+    std::unique_lock<std::mutex> guard(_lock);
+    auto it = std::find(_jobs.begin(), _jobs.end(), &job);
+    if (it != _jobs.end()) {
+        _jobs.erase(it);
+    }
+    job.done += ran;
+    // Helpers may still be running iterations they took, and must be done with job before it goes away.
+    _finished.wait(guard, [&job] { return job.done == job.n && job.workers == 0; });
+}
+
+void ThreadPool::helper() {
+    std::unique_lock<std::mutex> guard(_lock);
+    while (true) {
+        _wake.wait(guard, [this] { return _stop || !_jobs.empty(); });
+        if (_stop) {
+            return;
+        }
+        Job* job = _jobs.front();
+        job->workers++;
+        guard.unlock();
+        size_t ran = run(*job);
+        guard.lock();
+        // Nothing left to hand out.
+        auto it = std::find(_jobs.begin(), _jobs.end(), job);
+        if (it != _jobs.end()) {
+            _jobs.erase(it);
+        }
+        job->done += ran;
+        job->workers--;
+        if (job->done == job->n && job->workers == 0) {
+            _finished.notify_all();
+        }
+    }
+}
+}